@@ -32,6 +32,16 @@
 
 #include "HyperVariant.h"
 
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
 /* use byte lengths */
 #define varlength(p) varbytes((void*)p)
 
@@ -46,6 +56,184 @@
 #define HT_RESERVE_ITEMS 8L
 #endif
 
+/*
+ * Automatic growth: once itemsTotal exceeds slotCount * HT_MAX_LOAD_FACTOR a
+ * new slot array of slotCount * HT_GROWTH_FACTOR is installed, and each put or
+ * delete migrates HT_REHASH_STEPS of the old slots into it.
+ */
+#ifndef HT_MAX_LOAD_FACTOR
+#define HT_MAX_LOAD_FACTOR 1.0
+#endif
+
+#ifndef HT_GROWTH_FACTOR
+#define HT_GROWTH_FACTOR 2.0
+#endif
+
+#ifndef HT_REHASH_STEPS
+#define HT_REHASH_STEPS 4L
+#endif
+
+/*
+ * HT_OPTION_ARENA tables carve records and spilled values out of slabs of
+ * HT_ARENA_SLAB bytes in power of two size classes, HT_ARENA_CLASSES of them
+ * starting at 1 << HT_ARENA_MIN_CLASS. Anything bigger than a quarter slab is
+ * a separate allocation kept on the arena's large list.
+ */
+#ifndef HT_ARENA_SLAB
+#define HT_ARENA_SLAB (64L << 10)
+#endif
+
+#define HT_ARENA_MIN_CLASS 5
+#define HT_ARENA_CLASSES 10
+
+/*
+ * HashTableOpenFile reserves HT_FILE_RESERVE bytes of address space for a
+ * file, which starts at HT_FILE_INITIAL bytes and doubles whenever its heap
+ * runs out. The heap has HT_FILE_CLASSES power of two size classes, the
+ * smallest being the arena's.
+ */
+#ifndef HT_FILE_RESERVE
+#define HT_FILE_RESERVE (1L << 40)
+#endif
+
+#ifndef HT_FILE_INITIAL
+#define HT_FILE_INITIAL (1L << 20)
+#endif
+
+#define HT_FILE_CLASSES 48
+
+/*
+ * HT_OPTION_CONCURRENT tables guard their buckets with HT_LOCK_STRIPES
+ * reader/writer locks, selected by slot index. Must be a power of two.
+ */
+#ifndef HT_LOCK_STRIPES
+#define HT_LOCK_STRIPES 64L
+#endif
+
+/*
+ * HT_OPTION_LOCK_FREE_READS tables count readers in HT_EPOCH_READERS cache
+ * lines; threads beyond that share lines. Must be a power of two.
+ */
+#ifndef HT_EPOCH_READERS
+#define HT_EPOCH_READERS 64L
+#endif
+
+/* memory retired by writers is parked in batches of HT_RETIRE_BATCH blocks */
+#ifndef HT_RETIRE_BATCH
+#define HT_RETIRE_BATCH 64L
+#endif
+
+/* NewShardedHashTable splits a table this many ways when asked for 0 */
+#ifndef HT_SHARDS
+#define HT_SHARDS 16L
+#endif
+
+/* HashTableGetMany keeps this many lookups in flight at once */
+#ifndef HT_BATCH_WINDOW
+#define HT_BATCH_WINDOW 16L
+#endif
+
+/*
+ * HashTableBulkLoad hashes on up to HT_BULK_THREADS threads, giving each at
+ * least HT_BULK_MINIMUM keys; HashTableBulkLoadFrom asks its source for
+ * HT_BULK_CHUNK pairs at a time.
+ */
+#ifndef HT_BULK_THREADS
+#define HT_BULK_THREADS 8L
+#endif
+
+#ifndef HT_BULK_MINIMUM
+#define HT_BULK_MINIMUM (16L << 10)
+#endif
+
+#ifndef HT_BULK_CHUNK
+#define HT_BULK_CHUNK (64L << 10)
+#endif
+
+/*
+ * HT_HITS_SAMPLED counts one lookup in HT_HIT_SAMPLE as that many hits.
+ * HT_HITS_PER_THREAD counts into one array per HT_HIT_THREADS thread slots,
+ * indexed by reference. Must be a power of two.
+ */
+#ifndef HT_HIT_SAMPLE
+#define HT_HIT_SAMPLE 64L
+#endif
+
+#ifndef HT_HIT_THREADS
+#define HT_HIT_THREADS 16L
+#endif
+
+/*
+ * HT_SORT_PARALLEL sorts split the items over up to HT_SORT_THREADS threads,
+ * giving each at least HT_SORT_MINIMUM of them.
+ */
+#ifndef HT_SORT_THREADS
+#define HT_SORT_THREADS 8L
+#endif
+
+#ifndef HT_SORT_MINIMUM
+#define HT_SORT_MINIMUM (4L << 10)
+#endif
+
+/*
+ * Asynchronous events wait in a ring of HT_EVENT_QUEUE entries unless asked
+ * for another size, and go to their handler HT_EVENT_BATCH at a time. A
+ * delivery thread is woken every HT_EVENT_BATCH events and otherwise looks
+ * for stragglers every HT_EVENT_LATENCY milliseconds. HT_EVENT_BATCH must be
+ * a power of two.
+ */
+#ifndef HT_EVENT_QUEUE
+#define HT_EVENT_QUEUE (8L << 10)
+#endif
+
+#ifndef HT_EVENT_BATCH
+#define HT_EVENT_BATCH 256L
+#endif
+
+#ifndef HT_EVENT_LATENCY
+#define HT_EVENT_LATENCY 10L
+#endif
+
+/*
+ * HashTableParallelEnumerate runs on up to HT_ENUMERATE_THREADS threads,
+ * which claim HT_ENUMERATE_CHUNK item indexes at a time. The chunk should
+ * be a multiple of 64.
+ */
+#ifndef HT_ENUMERATE_THREADS
+#define HT_ENUMERATE_THREADS 64L
+#endif
+
+#ifndef HT_ENUMERATE_CHUNK
+#define HT_ENUMERATE_CHUNK (4L << 10)
+#endif
+
+/*
+ * A write ahead log is committed, with one write and one sync, as soon as
+ * HT_LOG_BATCH records are waiting and otherwise every HT_LOG_LATENCY
+ * milliseconds, unless asked for other values. Until then a write that has
+ * returned is not durable.
+ */
+#ifndef HT_LOG_BATCH
+#define HT_LOG_BATCH 1024L
+#endif
+
+#ifndef HT_LOG_LATENCY
+#define HT_LOG_LATENCY 10L
+#endif
+
+/*
+ * A snapshot keeps its own copy of a run of HT_VIEW_CHUNK item indexes once
+ * the live table first changes one of them.
+ */
+#ifndef HT_VIEW_CHUNK
+#define HT_VIEW_CHUNK 256L
+#endif
+
+/* HT_OPTION_ORDERED_INDEX skip lists have at most this many levels */
+#ifndef HT_ORDERED_LEVELS
+#define HT_ORDERED_LEVELS 32L
+#endif
+
 #define htVoidExpression (void)
 #define htVirtualImmediateFunction(type) static inline type
 
@@ -86,31 +274,341 @@ const char * htErrorInvalidTypeRequest = \
 	"The request could not be completed because of a type error";
 
 typedef struct sHashTableRecord {
+	size_t hash;
 	size_t hitCount;
 	HyperVariant key;
 	HyperVariant value;
 	struct sHashTableRecord * successor;
+	size_t extent;
+	size_t capacity;
 } sHashTableRecord;
 
+/*
+ * A record is one block: the record itself, then the key and value variants
+ * laid out exactly as HyperVariant lays them out, so the usual var* macros
+ * work on both. capacity is the room reserved for the value's bytes; a value
+ * that outgrows it is spilled to its own allocation.
+ */
+typedef struct sHashTableVariant {
+	void * private; size_t type;
+	size_t note; size_t bytes;
+	char data[];
+} sHashTableVariant;
+
+#define HashTableVariantSize sizeof(sHashTableVariant)
+#define htAlign(n) (((n) + sizeof(double) - 1) & ~(sizeof(double) - 1))
+
 #define htRecordReference(r) varnote (r->key)
-#define htRecordHash(r) varnote (r->value)
+#define htRecordHash(r) (r->hash)
 #define htRecordSettings(r) vartype(r->value)
+#define htRecordKeyLength(r) (varlength(r->key) - varpadding(r->key))
 
 #define HashTableRecordSize sizeof(sHashTableRecord)
 typedef sHashTableRecord * HashTableRecord;
 typedef sHashTableRecord ** HashTableRecordList;
 typedef sHashTableRecord ** HashTableRecordItems;
 
+typedef struct sHashTableSlab {
+	struct sHashTableSlab * successor;
+	size_t reserved;
+	char data[];
+} sHashTableSlab;
+
+typedef struct sHashTableLarge {
+	struct sHashTableLarge * predecessor;
+	struct sHashTableLarge * successor;
+} sHashTableLarge;
+
+typedef struct sHashTableArena {
+	sHashTableSlab * slab;
+	sHashTableSlab * current;
+	size_t offset;
+	void * available[HT_ARENA_CLASSES];
+	sHashTableLarge * large;
+} sHashTableArena;
+
+typedef sHashTableArena * HashTableArena;
+
+/*
+ * A table opened with HashTableOpenFile keeps everything that outlives the
+ * process in its file: records, spilled values, the item index and bitmap,
+ * released references, slots and control bytes all come from a heap headed
+ * by this. The file is mapped shared into address space reserved at base,
+ * so it grows in place and pointers into it stay good; mapped anywhere
+ * else, they are moved once on open. The fields after available describe
+ * the table as of the last flush, and clean says whether nothing has
+ * changed since.
+ */
+typedef struct sHashTableHeap {
+	char magic[8];
+	size_t layout[4];
+	size_t base;
+	size_t bytes;
+	size_t top;
+	size_t clean;
+	void * available[HT_FILE_CLASSES];
+	size_t options;
+	size_t hashFunction;
+	size_t seed;
+	double maxLoadFactor;
+	double growthFactor;
+	HashTableRecordItems item;
+	size_t itemsUsed;
+	size_t itemsTotal;
+	size_t itemsMax;
+	uint64_t * occupied;
+	size_t * released;
+	size_t releasedCount;
+	size_t releasedMax;
+	HashTableRecordList slot;
+	size_t slotCount;
+	unsigned char * control;
+	size_t slotsDeleted;
+	size_t impact;
+} sHashTableHeap;
+
+/* dirty is set once clean is off on disk; lock guards the heap */
+typedef struct sHashTableFile {
+	sHashTableHeap * heap;
+	size_t reserved;
+	int descriptor;
+	bool dirty;
+	pthread_mutex_t lock;
+} sHashTableFile;
+
+typedef sHashTableFile * HashTableFile;
+
+/*
+ * table is held shared by ordinary calls and exclusively by anything that
+ * moves slots, grows the item index or frees records; owner marks the thread
+ * holding it exclusively so calls it makes from handlers do not relock.
+ * items serializes reference assignment and the arena.
+ *
+ * Values are replaced under the key's stripe, so whatever reads one takes
+ * the stripe shared. Put and get events fire while the key's stripe is held:
+ * those handlers may read the item they are given but must not look up, put
+ * or delete in the same table, nor read another item, whose stripe another
+ * thread may hold while waiting for theirs.
+ */
+typedef union uHashTableStripe {
+	pthread_rwlock_t lock;
+	char line[64];
+} uHashTableStripe;
+
+typedef struct sHashTableLocks {
+	pthread_rwlock_t table;
+	void * owner;
+	pthread_mutex_t items;
+	uHashTableStripe stripe[HT_LOCK_STRIPES];
+} sHashTableLocks;
+
+typedef sHashTableLocks * HashTableLocks;
+
+/*
+ * Readers of a lock free table announce themselves in the epoch they saw on
+ * entry. Memory unlinked by a writer goes to the limbo batches of the current
+ * epoch, and the epoch only advances once nobody is left in the one before
+ * it, so a batch is released two epochs after it was filled. Writers try to
+ * advance once per filled batch. generation is odd while a bucket is being
+ * moved, and a lookup that misses meanwhile starts over.
+ */
+typedef struct sHashTableRetiredBlock {
+	void * block;
+	size_t bytes;
+} sHashTableRetiredBlock;
+
+typedef struct sHashTableRetired {
+	struct sHashTableRetired * successor;
+	size_t count;
+	sHashTableRetiredBlock retired[HT_RETIRE_BATCH];
+} sHashTableRetired;
+
+typedef union uHashTableReaders {
+	size_t active[3];
+	char line[64];
+} uHashTableReaders;
+
+typedef struct sHashTableEpoch {
+	size_t epoch;
+	size_t generation;
+	sHashTableRetired * limbo[3];
+	uHashTableReaders reader[HT_EPOCH_READERS];
+} sHashTableEpoch;
+
+typedef sHashTableEpoch * HashTableEpoch;
+
+/*
+ * The ring behind asynchronous events takes any number of producers and one
+ * deliverer at a time, whoever holds deliver. A cell's sequence is its
+ * position while free, position + 1 once filled and position + capacity when
+ * delivered, which frees it for the next lap. A producer finding the ring
+ * full waits for the delivery thread, or delivers itself when there is none.
+ *
+ * References are delivered as they were at the event; the items may have
+ * changed or gone since. Batch handlers must not call back into the table,
+ * which a producer waiting for room may be holding.
+ */
+typedef struct sHashTableEventCell {
+	size_t sequence;
+	HashTableEvent event;
+	HashTableItem reference;
+} sHashTableEventCell;
+
+typedef union uHashTableEventPosition {
+	size_t position;
+	char line[64];
+} uHashTableEventPosition;
+
+typedef struct sHashTableEventQueue {
+	uHashTableEventPosition head;
+	uHashTableEventPosition tail;
+	size_t mask;
+	HashTableEvent events;
+	HashTableEventBatchHandler handler;
+	struct sHashTable * table;
+	pthread_mutex_t deliver;
+	pthread_cond_t wake;
+	pthread_t thread;
+	bool threaded;
+	bool stopping;
+	sHashTableEventCell cell[];
+} sHashTableEventQueue;
+
+typedef sHashTableEventQueue * HashTableEventQueue;
+
+/*
+ * Puts, deletes and clears are logged as they are applied, while the key's
+ * stripe or the table is still held, so records of one key are in order.
+ * An entry is followed by its key's data and its value's, each rounded up;
+ * check is a hash of everything after it, so a torn tail is recognized.
+ *
+ * Entries gather in buffer under lock. The log's thread swaps buffer for
+ * spare and writes it out whenever batch entries are waiting or latency
+ * milliseconds have passed; commit keeps those writes in order. error is
+ * the first failure, after which entries are still taken but the log is
+ * no longer trusted.
+ */
+typedef struct sHashTableLogEntry {
+	size_t check;
+	size_t operation;
+	size_t keyType;
+	size_t keyBytes;
+	size_t valueType;
+	size_t valueBytes;
+} sHashTableLogEntry;
+
+typedef struct sHashTableLog {
+	pthread_mutex_t lock;
+	pthread_mutex_t commit;
+	pthread_cond_t wake;
+	pthread_t thread;
+	bool stopping;
+	int descriptor;
+	int error;
+	size_t batch;
+	size_t latency;
+	size_t pending;
+	char * buffer;
+	size_t used;
+	size_t size;
+	char * spare;
+	size_t spareSize;
+} sHashTableLog;
+
+typedef sHashTableLog * HashTableLog;
+
+/*
+ * A snapshot handle is an empty table viewing the table it was taken of,
+ * reading through to that table's items below itemsUsed. Records the view
+ * sees are never changed in place: a put or flag change gives the live table
+ * a copy under the same reference, and a delete leaves the record to the
+ * view. Before the live table changes an index the view copies that index's
+ * chunk, so chunk[n] is either NULL, meaning indexes n * HT_VIEW_CHUNK on
+ * are still as they were, or the records the view sees there. removed holds
+ * the records the view sees that the live table let go of, open addressed by
+ * key. All of it is guarded by the live table's items lock. The live table
+ * finds its view through view, the handle through viewing.
+ */
+typedef struct sHashTableView {
+	struct sHashTable * table;
+	HashTableRecordItems * chunk;
+	size_t itemsUsed;
+	size_t itemsTotal;
+	HashTableRecordList removed;
+	size_t removedCount;
+	size_t removedSlots;
+} sHashTableView;
+
+typedef sHashTableView * HashTableView;
+
+/*
+ * HT_OPTION_ORDERED_INDEX tables also keep their records in a skip list
+ * ordered by key bytes, a key ahead of any longer key it begins. Each node
+ * lives at the end of its record's block, found through the key variant's
+ * private field, and is retired with the record. lock guards the list on
+ * tables with locks; handlers called while it is held may read items but
+ * must not look up, put or delete.
+ */
+typedef struct sHashTableOrderedNode {
+	HashTableRecord record;
+	struct sHashTableOrderedNode * predecessor;
+	size_t levels;
+	struct sHashTableOrderedNode * successor[];
+} sHashTableOrderedNode;
+
+typedef sHashTableOrderedNode * HashTableOrderedNode;
+
+typedef struct sHashTableOrdered {
+	pthread_rwlock_t lock;
+	size_t levels;
+	HashTableOrderedNode tail;
+	HashTableOrderedNode head[HT_ORDERED_LEVELS];
+} sHashTableOrdered;
+
+typedef sHashTableOrdered * HashTableOrdered;
+
 typedef struct sHashTable {
 	HashTableRecordItems item;
 	size_t itemsUsed;
 	size_t itemsTotal;
 	size_t itemsMax;
+	uint64_t * occupied;
+	size_t * released;
+	size_t releasedCount;
+	size_t releasedMax;
 	HashTableRecordList slot;
 	size_t slotCount;
+	unsigned char * control;
+	size_t slotsDeleted;
+	HashTableRecordList rehashSlot;
+	size_t rehashSlotCount;
+	size_t rehashIndex;
+	double maxLoadFactor;
+	double growthFactor;
 	HashTableEventHandler eventHandler;
 	HashTableEvent events;
+	HashTableEventQueue queue;
+	HashTableLog log;
 	size_t impact;
+	HashTableOption options;
+	HashTableHashFunction hashFunction;
+	size_t seed;
+	HashTableArena arena;
+	HashTableLocks locks;
+	HashTableEpoch epoch;
+	HashTableOrdered ordered;
+	struct sHashTable ** shard;
+	size_t shardCount;
+	struct sHashTable * parent;
+	size_t shardIndex;
+	bool adopted;
+	HashTableHitCounting hitCounting;
+	size_t ** hitCounter;
+	void * snapshot;
+	size_t snapshotBytes;
+	HashTableFile file;
+	HashTableView view;
+	HashTableView viewing;
 	void * private;
 } sHashTable;
 
@@ -150,7 +648,21 @@ if ( ! (pointer) ) {                                                           \
 
 #define htReturnIfInvalidReference(table, reference)                           \
 htReturnIfTableUninitialized(table);                                           \
-if ( ! reference || ht->itemsMax < reference || ! ht->item[--reference]) {     \
+if ( ! reference || htRead(ht->itemsMax) < reference                           \
+	|| ! htItem(ht, --reference)) {                                            \
+    errno = HT_ERROR_INVALID_REFERENCE; return HT_ERROR_SENTINEL;              \
+}
+
+/*
+ * As htReturnIfInvalidReference, reading the item once into record: a lock
+ * free reader could see it deleted on a second read.
+ */
+#define htReturnIfInvalidRecord(table, reference, record)                      \
+htReturnIfTableUninitialized(table);                                           \
+HashTableRecord record = (htViewing(table)) ? htViewItem(table, reference) :   \
+    (reference && reference <= htRead(table->itemsMax))                        \
+    ? htItem(table, reference - 1) : NULL;                                     \
+if ( ! record ) {                                                              \
     errno = HT_ERROR_INVALID_REFERENCE; return HT_ERROR_SENTINEL;              \
 }
 
@@ -160,6 +672,11 @@ if ( !reference || reference > table->itemsMax || !table->item[--reference]) { \
     errno = HT_ERROR_INVALID_REFERENCE; return;                                \
 }
 
+#define htReturnIfNoCallBackHandler(handler)                                   \
+if (! (handler) ) {                                                            \
+    errno = HT_ERROR_NO_CALLBACK_HANDLER; return HT_ERROR_SENTINEL;            \
+}
+
 #define htReturnVoidIfNoCallBackHandler(handler)                               \
 if (! (handler) ) { errno = HT_ERROR_NO_CALLBACK_HANDLER; return; }
 
@@ -179,9 +696,6 @@ if (htRecordSettings(i) & HTI_NON_CONFIGURABLE) {                              \
 #define htDblInfinity(d)                                                       \
 (((d == d) && ((d - d) != 0.0)) ? (d < 0.0 ? -1 : 1) : 0)
 
-#define htKeyHash(table, keyLength, realKey)                                   \
-( htCreateHash ( keyLength, realKey ) % (table->slotCount) )
-
 #define htRealKeyOrReturn(length, value, hint)                                 \
 (hint & HTI_DOUBLE)? &value : ptrval(value);                                   \
 if ( ! length && (hint & HTI_UTF8)) length = strlen(ptrval(value));            \
@@ -189,917 +703,6026 @@ if ( ! length ) {                                                              \
     errno = HT_ERROR_ZERO_LENGTH_KEY; return HT_ERROR_SENTINEL;                \
 }
 
-#define htCompareRecordToRealKey(e, l, k, h)                                   \
-(e->key == k || (varbytes(e->key) == l+(varpadding(e->key)) && (memcmp(e->key, k, l) == 0)))
+/* the stored hash rejects most records without touching the key variant */
+#define htCompareRecordToRealKey(e, hash, l, k)                                \
+(e->key == k || (htRecordHash(e) == hash &&                                    \
+	varbytes(e->key) == l+(varpadding(e->key)) && (memcmp(e->key, k, l) == 0)))
+
+#define htRecordInlineValue(r)                                                 \
+((char *) r->value > (char *) r && (char *) r->value < (char *) r + r->extent)
 
 /* I wouldn't call this on an incomplete record if I were you... */
 #define htRecordImpact(r) (                                                    \
-	(varimpact(r->key)) + (varimpact(r->value)) + (HashTableRecordSize)        \
+	(r->extent) + (htRecordInlineValue(r) ? 0 : varimpact(r->value))           \
 )
 
 /* Jenkins' "One At a Time Hash" === Perl "Like" Hashing */
-inline static size_t htCreateHash (size_t length, char * realKey)
+size_t HashTableJenkinsHash (const void * key, size_t length, size_t seed)
 {
-	size_t hash, i;
-	for ( hash = i = 0; i < length; ++i ) hash += realKey[i],
+	const char * realKey = key;
+	size_t hash = seed, i;
+	for ( i = 0; i < length; ++i ) hash += realKey[i],
 		hash += ( hash << 10 ), hash ^= ( hash >> 6 );
 	hash += ( hash << 3 ), hash ^= ( hash >> 11 ), hash += ( hash << 15 );
 	return hash;
 }
 
-inline static HashTableRecord htFindKeyWithParent (
-	HashTable ht, size_t keyLength, void * realKey, size_t keyHint,
-	HashTableRecord primary, HashTableRecord * parent
-) {
-	while ( primary ) {
-		if (htCompareRecordToRealKey(primary, keyLength, realKey, keyHint))
-			return primary;
-		*parent = primary; primary = primary->successor;
-	}
-	return NULL;
+/*
+ * Wang Yi's wyhash (public domain): 8 bytes per load, 48 bytes per round,
+ * folded with 64 x 64 -> 128 bit multiplies.
+ */
+static const uint64_t htWySecret[4] = {
+	0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+	0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+htVirtualImmediateFunction (void) htWyMum (uint64_t * a, uint64_t * b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = *a; r *= *b;
+	*a = (uint64_t) r, *b = (uint64_t) (r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a,
+		lb = (uint32_t) *b, hi, lo,
+		rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb,
+		t = rl + (rm0 << 32), c = t < rl;
+	lo = t + (rm1 << 32), c += lo < t;
+	hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+	*a = lo, *b = hi;
+#endif
 }
 
-inline static HashTableRecord htFindKey (
-	HashTable ht, size_t keyLength, void * realKey, size_t keyHint
-) {
-	HashTableRecord primary = ht->slot[htKeyHash(ht, keyLength, realKey)];
-	while ( primary ) {
-		if ((keyLength+varpadding(primary->key)) == varlength(primary->key) && (memcmp(primary->key, realKey, keyLength) == 0))
-			return primary;
-		primary = primary->successor;
+htVirtualImmediateFunction (uint64_t) htWyMix (uint64_t a, uint64_t b)
+{
+	htWyMum(&a, &b); return a ^ b;
+}
+
+htVirtualImmediateFunction (uint64_t) htWyRead8 (const uint8_t * p)
+{
+	uint64_t v; memcpy(&v, p, 8); return v;
+}
+
+htVirtualImmediateFunction (uint64_t) htWyRead4 (const uint8_t * p)
+{
+	uint32_t v; memcpy(&v, p, 4); return v;
+}
+
+size_t HashTableWyHash (const void * key, size_t length, size_t seed)
+{
+	const uint8_t * p = key;
+	uint64_t a, b, s = htWyMix(seed ^ htWySecret[0], htWySecret[1]) ^ seed;
+	if (length <= 16) {
+		if (length >= 4) {
+			a = (htWyRead4(p) << 32) | htWyRead4(p + ((length >> 3) << 2));
+			b = (htWyRead4(p + length - 4) << 32) |
+				htWyRead4(p + length - 4 - ((length >> 3) << 2));
+		} else if (length > 0) {
+			a = ((uint64_t) p[0] << 16) | ((uint64_t) p[length >> 1] << 8) |
+				p[length - 1];
+			b = 0;
+		} else a = b = 0;
+	} else {
+		size_t i = length;
+		if (i > 48) {
+			uint64_t s1 = s, s2 = s;
+			do {
+				s = htWyMix(htWyRead8(p) ^ htWySecret[1], htWyRead8(p + 8) ^ s);
+				s1 = htWyMix(
+					htWyRead8(p + 16) ^ htWySecret[2], htWyRead8(p + 24) ^ s1
+				);
+				s2 = htWyMix(
+					htWyRead8(p + 32) ^ htWySecret[3], htWyRead8(p + 40) ^ s2
+				);
+				p += 48, i -= 48;
+			} while (i > 48);
+			s ^= s1 ^ s2;
+		}
+		while (i > 16) {
+			s = htWyMix(htWyRead8(p) ^ htWySecret[1], htWyRead8(p + 8) ^ s);
+			p += 16, i -= 16;
+		}
+		a = htWyRead8(p + i - 16), b = htWyRead8(p + i - 8);
 	}
-	errno = HT_ERROR_INVALID_REFERENCE;
-	return NULL;
+	a ^= htWySecret[1], b ^= s;
+	htWyMum(&a, &b);
+	return (size_t) htWyMix(a ^ htWySecret[0] ^ length, b ^ htWySecret[1]);
 }
 
-static HashTableRecord htCreateRecord
-(
-	HashTable ht,
-	size_t keyLength, double key, HashTableDataFlags keyHint,
-	size_t valueLength, double value, HashTableDataFlags valueHint
-) {
+/* Murmur3's 64 bit finalizer for word sized keys; anything else is wyhash */
+size_t HashTableIntegerHash (const void * key, size_t length, size_t seed)
+{
+	uint64_t x;
+	if (length == sizeof(uint64_t)) x = htWyRead8(key);
+	else if (length == sizeof(uint32_t)) x = htWyRead4(key);
+	else return HashTableWyHash(key, length, seed);
+	x ^= seed;
+	x ^= x >> 33, x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33, x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	return (size_t) x;
+}
 
-	HashTableRecord this = calloc(1, HashTableRecordSize);
-	htReturnIfAllocationFailure(this, {});
+/* the functions a snapshot or a file can name, by index */
+static const HashTableHashFunction htSnapshotHash[] = {
+	HashTableJenkinsHash, HashTableWyHash, HashTableIntegerHash
+};
 
-	htReturnIfAllocationFailure(
-		this->key = varcreate(keyLength, key, keyHint),
-		free(this)
-	);
+#define htSnapshotHashes (sizeof(htSnapshotHash) / sizeof(*htSnapshotHash))
 
-	htReturnIfAllocationFailure(
-		this->value = varcreate(valueLength, value, valueHint),
-		free(this), varfree(this->key)
-	);
+#define htCreateHash(ht, length, realKey)                                      \
+(ht->hashFunction(realKey, length, ht->seed))
 
-	if (ht->itemsMax == ht->itemsUsed) {
-		HashTableRecordItems list = calloc(
-			sizeof(void*),
-			ht->itemsUsed + HT_RESERVE_ITEMS
-		);
-		htReturnIfAllocationFailure(list, {});
-		if (ht->item) {
-			memcpy(list, ht->item, sizeof(void*) * ht->itemsUsed);
-			free(ht->item);
-		}
-		ht->impact += sizeof(void *) * HT_RESERVE_ITEMS;
-		ht->itemsMax += HT_RESERVE_ITEMS;
-		ht->item = list;
+/* power of two slot counts are masked instead of divided */
+#define htSlotIndex(hash, count)                                               \
+(((count) & ((count) - 1)) ? (hash) % (count) : (hash) & ((count) - 1))
+
+/* links lock free readers may be following while a writer changes them */
+#define htRead(lvalue) __atomic_load_n(&(lvalue), __ATOMIC_ACQUIRE)
+#define htPublish(lvalue, value)                                               \
+__atomic_store_n(&(lvalue), (value), __ATOMIC_RELEASE)
+
+#define htItem(ht, index) htRead(htRead(ht->item)[index])
+
+/*
+ * The old slot array is authoritative for slots not yet migrated. Slot
+ * arrays are published before their count, so the count is read first.
+ * Lock free readers make sure the old array is still the one being drained
+ * after reading its count and progress; their epoch keeps it from being
+ * freed and reused meanwhile.
+ */
+inline static HashTableRecordList htBucket (HashTable ht, size_t hash)
+{
+	HashTableRecordList old = htRead(ht->rehashSlot);
+	if (old) {
+		size_t count = htRead(ht->rehashSlotCount),
+			moved = htRead(ht->rehashIndex), index;
+		if (count && htRead(ht->rehashSlot) == old
+			&& (index = htSlotIndex(hash, count)) >= moved) return old + index;
 	}
+	size_t count = htRead(ht->slotCount);
+	return htRead(ht->slot) + htSlotIndex(hash, count);
+}
 
-	ht->item[ht->itemsUsed++] = this;
-	ht->itemsTotal++, ht->impact += htRecordImpact(this);
-	htRecordReference(this) = ht->itemsUsed;
+#define htRecordBucket(table, r) htBucket(table, htRecordHash(r))
 
-	return this;
+/*
+ * Open addressing engine (HT_OPTION_OPEN_ADDRESSING): slot[] holds records
+ * directly and control[] holds one byte per slot, either HT_PROBE_EMPTY,
+ * HT_PROBE_DELETED or the low 7 bits of the record's hash. Probing inspects
+ * HT_PROBE_GROUP control bytes at once and walks groups triangularly.
+ */
+#define HT_PROBE_GROUP 16L
+#define HT_PROBE_EMPTY 0x80
+#define HT_PROBE_DELETED 0xFE
+#define HT_PROBE_MAX_LOAD(slots) (((slots) >> 3) * 7)
+
+#define htOpenAddressing(ht) (ht->options & HT_OPTION_OPEN_ADDRESSING)
+#define htProbeFragment(hash) ((unsigned char)((hash) & 0x7F))
+#define htProbeGroups(ht) (ht->slotCount / HT_PROBE_GROUP)
 
+/*
+ * The most items and tombstones slots may hold: the table's maxLoadFactor,
+ * but never more than 7/8 of them, since probes stop at empty bytes. A
+ * factor of 0 cannot switch growth off here, so it means 7/8 as well.
+ */
+htVirtualImmediateFunction (size_t) htProbeMaxLoad (HashTable ht, size_t slots)
+{
+	size_t most = HT_PROBE_MAX_LOAD(slots);
+	double load = ht->maxLoadFactor * slots;
+	return (ht->maxLoadFactor > 0 && load < most) ? (size_t) load : most;
 }
+#define htProbeHome(ht, hash) (((hash) >> 7) & (htProbeGroups(ht) - 1))
 
-htVirtualImmediateFunction (HashTableItem) htAutoFireItemEvent
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+htVirtualImmediateFunction (unsigned) htProbeMatch
 (
-	htDoc (does not check) HashTable ht,
-	htDoc (does not check) HashTableItem reference,
-	htDocFires (any registered) HashTableEvent withEvents,
-	htDoc (?:= ht->private) void * private
+	const unsigned char * group,
+	unsigned char byte
 ) {
-	if (ht->eventHandler) {
-		if (htGetEventMask(ht, withEvents) == withEvents) {
-			return ht->eventHandler(
-				ht, withEvents,
-				reference,
-				(private) ? private : ht->private
-			);
-		}
-	}
-	return reference;
+	__m128i control = _mm_loadu_si128((const __m128i *) group);
+	return _mm_movemask_epi8(
+		_mm_cmpeq_epi8(control, _mm_set1_epi8((char) byte))
+	);
 }
 
-HashTableData HashTableUserData
+/* empty and deleted are the only control bytes with the high bit set */
+htVirtualImmediateFunction (unsigned) htProbeMatchFree
 (
-	size_t valueLength,
-	double value,
-	size_t valueHint
+	const unsigned char * group
 ) {
-	HashTableData result = varcreate(valueLength, value, valueHint);
-	htReturnIfAllocationFailure(result,	{});
-	return result;
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
 }
 
-void FreeHashTableUserData
+#else
+
+htVirtualImmediateFunction (unsigned) htProbeMatch
 (
-	HashTableData * data
+	const unsigned char * group,
+	unsigned char byte
 ) {
-	if (! data && ! *data) {
-		errno = HT_ERROR_INVALID_REFERENCE; return;
-	}
-	varfree(*(void**)data);
-	*(void**)data = NULL;
+	unsigned mask = 0, index;
+	for (index = 0; index < HT_PROBE_GROUP; index++)
+		if (group[index] == byte) mask |= 1U << index;
+	return mask;
 }
 
-HashTable NewHashTable
+htVirtualImmediateFunction (unsigned) htProbeMatchFree
 (
-	size_t size,
-	HashTableEvent withEvents,
-	HashTableEventHandler eventHandler,
-	void * private
+	const unsigned char * group
 ) {
+	unsigned mask = 0, index;
+	for (index = 0; index < HT_PROBE_GROUP; index++)
+		if (group[index] & 0x80) mask |= 1U << index;
+	return mask;
+}
 
-	HashTable ht = calloc(1, HashTableSize);
-	htReturnIfAllocationFailure(ht, {});
+#endif
 
-	if (!size) size = HT_RESERVE_SLOTS;
+/* returns the slot holding the key, and how many groups were inspected */
+static HashTableRecordList htProbeFind (
+	HashTable ht, size_t hash, size_t keyLength, void * realKey,
+	size_t * distance
+) {
+	size_t mask = htProbeGroups(ht) - 1, group = htProbeHome(ht, hash), step;
+	unsigned char fragment = htProbeFragment(hash), * control;
+	unsigned match;
+	for (step = 0; step <= mask; group = (group + ++step) & mask) {
+		control = ht->control + group * HT_PROBE_GROUP;
+		__builtin_prefetch(ht->slot + group * HT_PROBE_GROUP);
+		match = htProbeMatch(control, fragment);
+		while (match) {
+			HashTableRecordList entry =
+				ht->slot + group * HT_PROBE_GROUP + __builtin_ctz(match);
+			if (htCompareRecordToRealKey((*entry), hash, keyLength, realKey)) {
+				if (distance) *distance = step + 1;
+				return entry;
+			}
+			match &= match - 1;
+		}
+		if (htProbeMatch(control, HT_PROBE_EMPTY)) break;
+	}
+	return NULL;
+}
 
-	ht->slotCount = size, ht->events = withEvents,
-	ht->eventHandler = eventHandler,
-	ht->private = private,
-	ht->slot = calloc(size, sizeof(void*));
+/* the caller guarantees a free slot; see htAutoGrow */
+static void htProbeInsert (HashTable ht, HashTableRecord record)
+{
+	size_t mask = htProbeGroups(ht) - 1,
+		group = htProbeHome(ht, htRecordHash(record)), step = 0, index;
+	unsigned match;
+	while (! (match = htProbeMatchFree(ht->control + group * HT_PROBE_GROUP)))
+		group = (group + ++step) & mask;
+	index = group * HT_PROBE_GROUP + __builtin_ctz(match);
+	if (ht->control[index] == HT_PROBE_DELETED) ht->slotsDeleted--;
+	ht->control[index] = htProbeFragment(htRecordHash(record));
+	ht->slot[index] = record;
+}
 
-	htReturnIfAllocationFailure(ht->slot, free(ht));
+static void htProbeRemove (HashTable ht, HashTableRecordList entry)
+{
+	size_t index = entry - ht->slot;
+	/* a group with an empty byte already ends every probe passing by */
+	if (htProbeMatch(ht->control + (index & ~(HT_PROBE_GROUP - 1)),
+		HT_PROBE_EMPTY)) ht->control[index] = HT_PROBE_EMPTY;
+	else ht->control[index] = HT_PROBE_DELETED, ht->slotsDeleted++;
+	*entry = NULL;
+}
 
-	ht->impact = HashTableSize + (sizeof(void*) * (size));
+/* slot arrays, the item index and its company; from the file if there is one */
+static void * htArrayAllocate (HashTable ht, size_t bytes, bool zero);
+static void * htArrayResize
+(
+	HashTable ht, void * block, size_t held, size_t bytes
+);
+static void htArrayRelease (HashTable ht, void * block, size_t bytes);
 
-	htVoidExpression htAutoFireItemEvent(ht, 0, HT_EVENT_CONSTRUCTED, NULL);
+/* rebuild into a power of two of at least slots; drops all tombstones */
+static bool htProbeResize (HashTable ht, size_t slots)
+{
+	size_t capacity = HT_PROBE_GROUP, index, count = ht->slotCount;
+	while (capacity < slots || htProbeMaxLoad(ht, capacity) <= ht->itemsTotal)
+		capacity <<= 1;
+	HashTableRecordList list = htArrayAllocate(
+		ht, capacity * sizeof(void*), true
+	);
+	unsigned char * control = htArrayAllocate(ht, capacity, false);
+	if (! list || ! control) {
+		htArrayRelease(ht, list, capacity * sizeof(void*));
+		htArrayRelease(ht, control, capacity);
+		errno = HT_ERROR_ALLOCATION_FAILURE;
+		return false;
+	}
+	memset(control, HT_PROBE_EMPTY, capacity);
+	HashTableRecordList old = ht->slot;
+	htArrayRelease(ht, ht->control, count);
+	ht->slot = list, ht->control = control;
+	ht->slotCount = capacity, ht->slotsDeleted = 0;
+	for (index = 0; index < count; index++)
+		if (old[index]) htProbeInsert(ht, old[index]);
+	htArrayRelease(ht, old, count * sizeof(void*));
+	ht->impact -= count * (sizeof(void*) + 1);
+	ht->impact += capacity * (sizeof(void*) + 1);
+	return true;
+}
 
-	return ht;
+/* counters shared between threads of a concurrent table */
+#define htAdd(ht, lvalue, delta)                                               \
+((ht->locks) ? __atomic_add_fetch(&(lvalue), (delta), __ATOMIC_RELAXED)        \
+	: ((lvalue) += (delta)))
 
-}
+#define htSubtract(ht, lvalue, delta) htAdd(ht, lvalue, -(size_t)(delta))
 
-void OptimizeHashTable
-(
-	HashTable ht,
-	size_t slots,
-	size_t references
-) {
-	htReturnVoidIfTableUninitialized(ht);
-
-	{	/* sort by existence */
-		void * entry[ht->itemsTotal];
-		register size_t source = 0, dest = 0;
-		size_t len = ht->itemsTotal;
-		while (dest < len) {
-			void * val = ht->item[source];
-			if (val) ht->item[source] = NULL, entry[dest++] = val;
-			source++;
-		}
-		while (dest) ht->item[--dest] = entry[dest];
-		ht->itemsUsed = ht->itemsTotal;
-		if (references) { /* adjust padding */
-			size_t
-			index = ht->itemsTotal,
-				max = index + references,
-					bytes = max * sizeof(void*);
-			ht->item = realloc(ht->item, bytes);
-			ht->impact -= ht->itemsMax * sizeof(void*);
-			ht->itemsMax = max, ht->impact += bytes;
-			while(index < max) ht->item[index++] = NULL;
-		}
-	}
+static __thread char htThreadToken;
+#define htThisThread ((void *) &htThreadToken)
 
-	if (slots) {
-		size_t len = ht->itemsTotal;
-		HashTableRecord entry[len];
-		register size_t source = 0, dest = 0;
-		while (dest < len) {
-			void * val = ht->item[source];
-			if (val) entry[dest++] = val;
-			source++;
-		}
-		free(ht->slot);
-		ht->impact -= (ht->slotCount * sizeof(void*));
-		ht->slot = calloc(slots, sizeof(void*));
-		ht->impact += (slots * sizeof(void*));
-		ht->slotCount = slots;
-		while (dest) {
-			HashTableRecord record = entry[--dest];
-			record->successor = NULL;
-			size_t hash = htKeyHash(ht, varlength(record->key), record->key);
-			htRecordHash(record) = hash;
-			HashTableRecord parent = ht->slot[hash];
-			while (parent && parent->successor) parent = parent->successor;
-			if (parent) parent->successor = record;
-			else ht->slot[hash] = record;
-		}
-	}
+/* the stripe this thread holds, so handlers reading their item do not relock */
+static __thread void * htHeldStripe;
 
-}
+/* the locks of a table whose exclusive owner this thread is working for */
+static __thread void * htHelping;
 
-void DestroyHashTable
-(
-	HashTable * ht
-) {
-	htReturnVoidIfTableUninitialized((ht)?*ht:0);
+typedef struct sHashTableLockScope {
+	pthread_rwlock_t * lock;
+	void ** owner;
+	size_t * reader;
+} sHashTableLockScope;
 
-	htVoidExpression htAutoFireItemEvent(*ht, 0, HT_EVENT_DESTRUCTING, NULL);
+static size_t htThreadSequence;
+static __thread size_t htThreadReader;
 
-	HashTable xt = *ht;
-	*ht = NULL;
+/* a small number unique to each thread, for spreading threads over lines */
+htVirtualImmediateFunction (size_t) htThreadSlot (void)
+{
+	if (! htThreadReader) htThreadReader =
+		__atomic_add_fetch(&htThreadSequence, 1, __ATOMIC_RELAXED);
+	return htThreadReader;
+}
 
-	size_t item = 0, length = xt->itemsMax; HashTableRecord target = NULL;
-	for (item = 0; item < length; item++) {
-		target = xt->item[item];
-		if (target) {
-			varfree(target->key); varfree(target->value); free(target);
-		}
+/* returns the counter to decrement when the reader leaves */
+static size_t * htEpochEnter (HashTableEpoch epoch)
+{
+	uHashTableReaders * reader =
+		epoch->reader + (htThreadSlot() & (HT_EPOCH_READERS - 1));
+	size_t current, * active;
+	for (;;) {
+		current = __atomic_load_n(&epoch->epoch, __ATOMIC_SEQ_CST);
+		active = reader->active + current % 3;
+		__atomic_add_fetch(active, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&epoch->epoch, __ATOMIC_SEQ_CST) == current)
+			return active;
+		__atomic_sub_fetch(active, 1, __ATOMIC_RELEASE);
 	}
-	free(xt->item), free(xt->slot), free(xt);
-	return;
 }
 
-void HashTableRegisterEvents
-(
-	HashTable ht,
-	HashTableEvent withEvents,
-	HashTableEventHandler eventHandler
-) {
-	htReturnVoidIfTableUninitialized(ht);
-	ht->events = withEvents;
-	if ( eventHandler ) ht->eventHandler = eventHandler;
-}
+#define htEpochLeave(active) __atomic_sub_fetch(active, 1, __ATOMIC_RELEASE)
 
-size_t HashTableItemsUsed
-(
-	HashTable ht
-) {
-	htReturnIfTableUninitialized(ht);
-	return ht->itemsUsed;
-}
+/* readers never wait for a writer; a miss is checked afterwards instead */
+#define htEpochGeneration(epoch) htRead((epoch)->generation)
 
-size_t HashTableItemsTotal
-(
-	HashTable ht
-) {
-	htReturnIfTableUninitialized(ht);
-	return ht->itemsTotal;
+/*
+ * After a miss: true when a bucket was moving, or moved, underneath and the
+ * lookup must rerun. Only one bucket moves at a time, so this settles as
+ * soon as that bucket is done.
+ */
+static bool htEpochRetry (HashTableEpoch epoch, size_t * generation)
+{
+	size_t seen = *generation;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	*generation = __atomic_load_n(&epoch->generation, __ATOMIC_RELAXED);
+	return (seen & 1) || *generation != seen;
 }
 
-size_t HashTableItemsMax
-(
-	HashTable ht
-) {
-	htReturnIfTableUninitialized(ht);
-	return ht->itemsMax;
-}
+#define htRewire(ht)                                                           \
+if (ht->epoch) __atomic_add_fetch(&ht->epoch->generation, 1, __ATOMIC_SEQ_CST)
 
-size_t HashTableSlotCount
-(
-	HashTable ht
-) {
-	htReturnIfTableUninitialized(ht);
-	return ht->slotCount;
+static void htUnlockScope (sHashTableLockScope * scope)
+{
+	if (scope->reader) htEpochLeave(scope->reader);
+	if (! scope->lock) return;
+	if (scope->owner) __atomic_store_n(scope->owner, NULL, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(scope->lock);
 }
 
-size_t HashTableSlotsUsed
-(
-	HashTable ht
-) {
-	htReturnIfTableUninitialized(ht);
-	size_t used = 0, index, max = ht->slotCount;
-	for (index = 0; index < max; index++) if (ht->slot[index]) used++;
-	return used;
-}
+#define htOwnsTable(locks)                                                     \
+(htHelping == (locks) ||                                                       \
+    __atomic_load_n(&locks->owner, __ATOMIC_RELAXED) == htThisThread)
 
-double HashTableLoadFactor
-(
-	HashTable ht
-) {
-	htReturnIfTableUninitialized(ht);
-	volatile double factor = (((double)ht->itemsTotal)/((double)ht->slotCount));
-	return htDblInfinity(factor) ? 0 : factor;
+/* on lock free tables the shared side only enters the current epoch */
+static sHashTableLockScope htLockTable (sHashTable * ht, bool exclusive)
+{
+	sHashTableLockScope scope = { NULL, NULL, NULL };
+	HashTableLocks locks = ht->locks;
+	if (! locks || htOwnsTable(locks)) return scope;
+	if (ht->epoch && ! exclusive) {
+		scope.reader = htEpochEnter(ht->epoch);
+		return scope;
+	}
+	scope.lock = &locks->table;
+	if (exclusive) {
+		pthread_rwlock_wrlock(scope.lock);
+		scope.owner = &locks->owner;
+		__atomic_store_n(scope.owner, htThisThread, __ATOMIC_RELAXED);
+	} else pthread_rwlock_rdlock(scope.lock);
+	return scope;
 }
 
-size_t HashTableImpact
+/*
+ * Open addressing and lock free table writers hold the whole table instead
+ * of a stripe.
+ */
+static sHashTableLockScope htLockStripe
 (
-	HashTable ht
+	sHashTable * ht, size_t hash, bool exclusive
 ) {
-	htReturnIfTableUninitialized(ht);
-	return ht->impact;
+	sHashTableLockScope scope = { NULL, NULL, NULL };
+	HashTableLocks locks = ht->locks;
+	if (! locks || htOwnsTable(locks)) return scope;
+	if (htOpenAddressing(ht) || ht->epoch) return scope;
+	size_t index = htSlotIndex(hash, ht->slotCount) & (HT_LOCK_STRIPES - 1);
+	pthread_rwlock_t * lock = &locks->stripe[index].lock;
+	if (lock == htHeldStripe) return scope;
+	if (exclusive) pthread_rwlock_wrlock(lock);
+	else pthread_rwlock_rdlock(lock);
+	scope.lock = lock, scope.owner = &htHeldStripe, htHeldStripe = lock;
+	return scope;
 }
 
-HashTableItem HashTableHasKey
-(
-	HashTable ht,
-	size_t keyLength,
-	double key,
-	HashTableDataFlags hint
-) {
-	htReturnIfTableUninitialized(ht);
-	char * realKey = htRealKeyOrReturn(keyLength, key, hint);
+/* these unlock when the enclosing block exits, returns included */
+#define htLockScope(name, lock)                                                \
+sHashTableLockScope name __attribute__((cleanup(htUnlockScope))) = lock
 
-	size_t oldError = errno;
-	HashTableRecord item = htFindKey(ht, keyLength, realKey, hint);
-	if (item) return htRecordReference(item);
-	else errno = oldError;
-	return HT_ERROR_SENTINEL;
+#define htSharedScope(ht) htLockScope(htTableScope, htLockTable(ht, false))
+#define htExclusiveScope(ht) htLockScope(htTableScope, htLockTable(ht, true))
+
+#define htWriterScope(ht)                                                      \
+htLockScope(htTableScope, htLockTable(ht, htOpenAddressing(ht)))
+
+#define htStripeScope(ht, hash, exclusive)                                     \
+htLockScope(htStripe, htLockStripe(ht, hash, exclusive))
+
+#define htLockItems(ht) if (ht->locks) pthread_mutex_lock(&ht->locks->items)
+#define htUnlockItems(ht) if (ht->locks) pthread_mutex_unlock(&ht->locks->items)
+
+#define htLockHeap(ht) if (ht->locks) pthread_mutex_lock(&ht->file->lock)
+#define htUnlockHeap(ht) if (ht->locks) pthread_mutex_unlock(&ht->file->lock)
+
+/*
+ * The first change after a flush puts clean out on disk before anything
+ * else of the file can get there.
+ */
+static void htFileDirty (HashTableFile file)
+{
+	pthread_mutex_lock(&file->lock);
+	if (! file->dirty) {
+		file->heap->clean = false;
+		htVoidExpression msync(file->heap, sizeof(sHashTableHeap), MS_SYNC);
+		__atomic_store_n(&file->dirty, true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&file->lock);
 }
 
-bool HashTableHasItem
-(
-	HashTable ht,
-	HashTableItem reference
+#define htFileChanging(ht)                                                     \
+if (ht->file && ! __atomic_load_n(&ht->file->dirty, __ATOMIC_ACQUIRE))         \
+    htFileDirty(ht->file)
+
+inline static HashTableRecord htLookup (
+	HashTable ht, size_t hash, size_t keyLength, void * realKey
 ) {
-	htReturnIfTableUninitialized(ht);
-	if ( ! (reference) || ht->itemsMax < --reference) return false;
-	return (ht->item[reference]) ? true : false;
+	if (htOpenAddressing(ht)) {
+		HashTableRecordList entry = htProbeFind(
+			ht, hash, keyLength, realKey, NULL
+		);
+		return (entry) ? *entry : NULL;
+	}
+	HashTableEpoch epoch = ht->epoch;
+	size_t generation = (epoch) ? htEpochGeneration(epoch) : 0;
+	do {
+		HashTableRecord primary = htRead(*htBucket(ht, hash));
+		while ( primary ) {
+			if (htCompareRecordToRealKey(primary, hash, keyLength, realKey))
+				return primary;
+			primary = htRead(primary->successor);
+		}
+	} while (epoch && htEpochRetry(epoch, &generation));
+	return NULL;
 }
 
-size_t HashTableItemDistribution
-(
-	HashTable ht,
-	HashTableItem reference
-) {
-	htReturnIfInvalidReference(ht, reference);
-	register HashTableRecord child;
-	register size_t distribution = 0;
-	child = ht->slot[htRecordHash(ht->item[reference])];
-	while (child) distribution++, child = child->successor;
-	return distribution;
+#define htRecordNode(r) varprvt(r->key)
+#define htOrderedNodeBytes(levels)                                             \
+(sizeof(sHashTableOrderedNode) + (levels) * sizeof(HashTableOrderedNode))
+
+static sHashTableLockScope htLockOrdered (sHashTable * ht, bool exclusive)
+{
+	sHashTableLockScope scope = { NULL, NULL, NULL };
+	if (! ht->locks) return scope;
+	scope.lock = &ht->ordered->lock;
+	if (exclusive) pthread_rwlock_wrlock(scope.lock);
+	else pthread_rwlock_rdlock(scope.lock);
+	return scope;
 }
 
-size_t HashTableItemHits
+#define htOrderedScope(ht, exclusive)                                          \
+htLockScope(htOrderedLockScope, htLockOrdered(ht, exclusive))
+
+static int htOrderedKeys
 (
-	HashTable ht,
-	HashTableItem reference
+	size_t length, const void * key, size_t otherLength, const void * other
 ) {
-	htReturnIfInvalidReference(ht, reference);
-	return ht->item[reference]->hitCount;
+	size_t common = (length < otherLength) ? length : otherLength;
+	int order = memcmp(key, other, common);
+	if (order || length == otherLength) return order;
+	return (length < otherLength) ? -1 : 1;
 }
 
-size_t HashTableItemImpact
+static int htOrderedCompare
 (
-	HashTable ht,
-	HashTableItem reference
+	HashTableRecord record, size_t keyLength, const void * realKey
 ) {
-	htReturnIfInvalidReference(ht, reference);
-	return htRecordImpact(ht->item[reference]);
+	return htOrderedKeys(
+		htRecordKeyLength(record), record->key, keyLength, realKey
+	);
 }
 
-bool HashTablePutPrivate
+/* as htOrderedCompare, with every key the prefix begins counted as equal */
+static int htOrderedPrefix
 (
-	HashTable ht,
-	void * private
+	HashTableRecord record, size_t keyLength, const void * realKey
 ) {
-	htReturnIfTableUninitialized(ht);
-	ht->private = private; return true;
+	size_t length = htRecordKeyLength(record);
+	if (length < keyLength) return htOrderedCompare(record, keyLength, realKey);
+	return memcmp(record->key, realKey, keyLength);
 }
 
-void * HashTableGetPrivate
+typedef int (*HashTableOrderedComparison)
 (
-	HashTable ht
-) {
-	htReturnIfTableUninitialized(ht);
-	return ht->private;
-}
+	HashTableRecord record, size_t keyLength, const void * realKey
+);
 
-HashTableItem HashTablePut
+/*
+ * The first node at or after the key, or after it when not inclusive. update
+ * receives the successor links that lead there on each level.
+ */
+static HashTableOrderedNode htOrderedSeek
 (
-	HashTable ht,
+	HashTableOrdered index,
+	HashTableOrderedComparison compare,
 	size_t keyLength,
-	double key,
-	HashTableDataFlags keyHint,
-	size_t valueLength,
-	double value,
-	HashTableDataFlags valueHint
+	const void * realKey,
+	bool inclusive,
+	HashTableOrderedNode * update[]
 ) {
-
-	htReturnIfTableUninitialized(ht);
-
-	char * realKey = htRealKeyOrReturn(keyLength, key, keyHint);
-
-	if (!valueLength) {
-		if (valueHint & HTI_UTF8) valueLength = strlen(ptrval(value));
+	HashTableOrderedNode * link = index->head, node;
+	size_t level = index->levels;
+	int order;
+	while (level--) {
+		while ((node = link[level])) {
+			order = compare(node->record, keyLength, realKey);
+			if (order > 0 || (inclusive && ! order)) break;
+			link = node->successor;
+		}
+		if (update) update[level] = link;
 	}
+	return link[0];
+}
 
-	size_t index = htKeyHash(ht, keyLength, realKey);
-
-	HashTableRecord root, parent = NULL, current = htFindKeyWithParent(
-		ht, keyLength, realKey, keyHint, (root = ht->slot[index]), &parent
+static void htOrderedInsert (HashTable ht, HashTableRecord record)
+{
+	HashTableOrdered index = ht->ordered;
+	HashTableOrderedNode node = htRecordNode(record);
+	HashTableOrderedNode * update[HT_ORDERED_LEVELS];
+	htOrderedScope(ht, true);
+	htVoidExpression htOrderedSeek(index, htOrderedCompare,
+		htRecordKeyLength(record), record->key, true, update
 	);
+	size_t level;
+	for (level = index->levels; level < node->levels; level++)
+		update[level] = index->head;
+	if (node->levels > index->levels) index->levels = node->levels;
+	for (level = 0; level < node->levels; level++)
+		node->successor[level] = update[level][level],
+		update[level][level] = node;
+	node->predecessor = (update[0] == index->head) ? NULL : (void *)
+		((char *) update[0] - offsetof(sHashTableOrderedNode, successor));
+	if (node->successor[0]) node->successor[0]->predecessor = node;
+	else index->tail = node;
+}
 
-	if ( current ) {
+static void htOrderedRemove (HashTable ht, HashTableRecord record)
+{
+	HashTableOrdered index = ht->ordered;
+	HashTableOrderedNode node = htRecordNode(record);
+	HashTableOrderedNode * update[HT_ORDERED_LEVELS];
+	htOrderedScope(ht, true);
+	htVoidExpression htOrderedSeek(index, htOrderedCompare,
+		htRecordKeyLength(record), record->key, true, update
+	);
+	size_t level;
+	for (level = 0; level < node->levels; level++)
+		update[level][level] = node->successor[level];
+	if (node->successor[0]) node->successor[0]->predecessor = node->predecessor;
+	else index->tail = node->predecessor;
+	while (index->levels && ! index->head[index->levels - 1]) index->levels--;
+}
 
-		htReturnIfNotWritableItem(current);
+/* records are appended to their chain; the hash must already be stored */
+static void htLink (HashTable ht, HashTableRecord record)
+{
+	if (htOpenAddressing(ht)) {
+		htProbeInsert(ht, record);
+		return;
+	}
+	HashTableRecordList bucket = htRecordBucket(ht, record);
+	while (*bucket) bucket = &(*bucket)->successor;
+	record->successor = NULL, htPublish(*bucket, record);
+}
 
-		HyperVariant varValue = varcreate(valueLength, value, valueHint);
-		htReturnIfAllocationFailure(varValue, {});
+static void htUnlink (HashTable ht, HashTableRecord record)
+{
+	htFileChanging(ht);
+	if (ht->ordered) htOrderedRemove(ht, record);
+	if (htOpenAddressing(ht)) {
+		htProbeRemove(ht, htProbeFind(
+			ht, htRecordHash(record), htRecordKeyLength(record), record->key,
+			NULL
+		));
+		return;
+	}
+	HashTableRecordList bucket = htRecordBucket(ht, record);
+	while (*bucket != record) bucket = &(*bucket)->successor;
+	htPublish(*bucket, record->successor);
+}
 
-		HashTableItem
-			currentSelection = htRecordReference(current),
-			/* There is already a pair for this key; Update Value? */
-			selection = htAutoFireItemEvent(
-				ht, currentSelection, HT_EVENT_PUT, varValue
-			)
-		;
+static void htRetire (HashTable ht, void * block, size_t bytes);
 
-		if (! selection) goto discardNewRecord;
+/* memory lock free readers may still hold is retired instead of freed */
+#define htDispose(ht, block, bytes)                                            \
+if (ht->epoch) htRetire(ht, block, 0); else htArrayRelease(ht, block, bytes)
 
-		if (selection == currentSelection) {
-			ht->impact -= varimpact(current->value),
-			ht->impact += varimpact(varValue);
-			varfree(current->value);
-			current->value = varValue,
-			current->hitCount++;
-			return selection;
+/*
+ * Migrate up to steps slots of the old slot array into the current one. A
+ * slot counts as migrated once all of its records are in the current array,
+ * and readers meeting a slot while it moves retry that one lookup.
+ */
+static void htRehashStep (HashTable ht, size_t steps)
+{
+	HashTableRecord record, successor, moving;
+	size_t index;
+	if (ht->rehashSlot) htFileChanging(ht);
+	while (ht->rehashSlot && steps--) {
+		record = moving = ht->rehashSlot[ht->rehashIndex];
+		if (moving) htRewire(ht);
+		while (record) {
+			successor = record->successor;
+			index = htSlotIndex(htRecordHash(record), ht->slotCount);
+			htPublish(record->successor, ht->slot[index]);
+			htPublish(ht->slot[index], record);
+			record = successor;
 		}
+		htPublish(ht->rehashIndex, ht->rehashIndex + 1);
+		if (moving) htRewire(ht);
+		if (ht->rehashIndex == ht->rehashSlotCount) {
+			HashTableRecordList old = ht->rehashSlot;
+			htPublish(ht->rehashSlot, NULL);
+			htDispose(ht, old, ht->rehashSlotCount * sizeof(void*));
+			ht->impact -= ht->rehashSlotCount * sizeof(void*);
+			htPublish(ht->rehashSlotCount, 0), htPublish(ht->rehashIndex, 0);
+		}
+	}
+}
 
-		discardNewRecord:
-			varfree(varValue);
-
-		return selection;
+#define htRehashComplete(ht) htRehashStep(ht, ht->rehashSlotCount)
 
+/*
+ * Relink every record from its stored hash; chains end up in item order.
+ * Only open addressing can fail, leaving the old slots as they were.
+ */
+static bool htRelinkAll (HashTable ht)
+{
+	size_t index = ht->itemsUsed;
+	HashTableRecord record;
+	if (htOpenAddressing(ht)) return htProbeResize(ht, ht->slotCount);
+	htRehashComplete(ht);
+	htFileChanging(ht);
+	memset(ht->slot, 0, ht->slotCount * sizeof(void*));
+	while (index--) if ((record = ht->item[index])) {
+		HashTableRecordList bucket = htRecordBucket(ht, record);
+		record->successor = *bucket, *bucket = record;
 	}
+	return true;
+}
 
-	HashTableRecord thisRecord = htCreateRecord(
-		ht,
-		keyLength, key, keyHint,
-		valueLength, value, valueHint
-	);
+/* install a larger slot array; the old one is drained by htRehashStep */
+static bool htRehashBegin (HashTable ht, size_t slots)
+{
+	HashTableRecordList list = htArrayAllocate(ht, slots * sizeof(void*), true);
+	if (! list) return false;
+	/* a reader between the two arrays may see neither, and retries */
+	htRewire(ht);
+	htPublish(ht->rehashSlotCount, ht->slotCount);
+	htPublish(ht->rehashIndex, 0);
+	htPublish(ht->rehashSlot, ht->slot);
+	htPublish(ht->slot, list), htPublish(ht->slotCount, slots);
+	htRewire(ht);
+	ht->impact += slots * sizeof(void*);
+	return true;
+}
 
-	if (thisRecord) {
+/* whether the next put would make htAutoGrow move anything */
+static bool htGrowthDue (HashTable ht)
+{
+	size_t items = __atomic_load_n(&ht->itemsTotal, __ATOMIC_RELAXED);
+	if (htOpenAddressing(ht))
+		return items + ht->slotsDeleted >= htProbeMaxLoad(ht, ht->slotCount);
+	if (ht->rehashSlot) return true;
+	return ht->maxLoadFactor > 0 &&
+		(double)(items + 1) > ht->maxLoadFactor * ht->slotCount;
+}
 
-		htRecordHash(thisRecord) = index;
+/*
+ * Called before every put or delete. Chained tables never do more than
+ * HT_REHASH_STEPS here, except concurrent ones, which hold the table
+ * exclusively and migrate everything at once; open addressing tables
+ * rebuild in one pass at htProbeMaxLoad, and fail only once no empty control
+ * byte is left, which is the only way this returns false.
+ */
+static bool htAutoGrow (HashTable ht)
+{
+	if (htOpenAddressing(ht)) {
+		size_t slots = ht->slotCount, most = htProbeMaxLoad(ht, slots);
+		if (ht->itemsTotal + ht->slotsDeleted < most) return true;
+		/* mostly tombstones: rebuild at the same size */
+		if (ht->itemsTotal >= most >> 1)
+			slots = (size_t)(slots * ht->growthFactor);
+		return htProbeResize(ht, slots)
+			|| ht->itemsTotal + ht->slotsDeleted < ht->slotCount;
+	}
+	if (ht->rehashSlot) {
+		htRehashStep(ht, HT_REHASH_STEPS);
+		return true;
+	}
+	if (ht->maxLoadFactor <= 0) return true;
+	if ((double)(ht->itemsTotal + 1) <= ht->maxLoadFactor * ht->slotCount)
+		return true;
+	size_t slots = (size_t)(ht->slotCount * ht->growthFactor);
+	if (slots <= ht->slotCount) slots = ht->slotCount + 1;
+	int oldError = errno;
+	/* failing to grow is not fatal; the chains just get longer */
+	if (! htRehashBegin(ht, slots)) errno = oldError;
+	/* stripes are chosen by slot index; never leave two arrays live */
+	else if (ht->locks) htRehashComplete(ht);
+	return true;
+}
 
-		HashTableItem
-			currentSelection = htRecordReference(thisRecord),
-			selection = htAutoFireItemEvent(
-				ht, currentSelection, HT_EVENT_PUT, thisRecord->value
-			)
-		;
+htVirtualImmediateFunction (size_t) htArenaClass (size_t bytes)
+{
+	size_t class = 0;
+	while (((size_t) 1 << (class + HT_ARENA_MIN_CLASS)) < bytes) class++;
+	return class;
+}
 
-		if (selection == currentSelection) {
-			if ( ! root ) ht->slot[index] = thisRecord;
-			else if ( root == current ) root->successor = thisRecord;
-			else parent->successor = thisRecord;
-			return currentSelection;
+static void * htArenaAllocate (HashTableArena arena, size_t bytes)
+{
+	if (bytes > HT_ARENA_SLAB >> 2) {
+		sHashTableLarge * large = malloc(sizeof(sHashTableLarge) + bytes);
+		if (! large) return NULL;
+		large->predecessor = NULL, large->successor = arena->large;
+		if (arena->large) arena->large->predecessor = large;
+		arena->large = large;
+		return large + 1;
+	}
+	size_t class = htArenaClass(bytes);
+	void * block = arena->available[class];
+	if (block) {
+		arena->available[class] = *(void **) block;
+		return block;
+	}
+	bytes = (size_t) 1 << (class + HT_ARENA_MIN_CLASS);
+	while (! arena->current || arena->offset + bytes > HT_ARENA_SLAB) {
+		/* slabs kept by HashTableClear are reused before new ones */
+		if (arena->current && arena->current->successor) {
+			arena->current = arena->current->successor, arena->offset = 0;
+			continue;
 		}
+		sHashTableSlab * slab = malloc(sizeof(sHashTableSlab) + HT_ARENA_SLAB);
+		if (! slab) return NULL;
+		slab->successor = NULL, slab->reserved = HT_ARENA_SLAB;
+		if (arena->current) arena->current->successor = slab;
+		else arena->slab = slab;
+		arena->current = slab, arena->offset = 0;
+	}
+	block = arena->current->data + arena->offset;
+	arena->offset += bytes;
+	return block;
+}
 
-		discardThisRecord:
-			ht->item[currentSelection - 1] = NULL,
-			ht->itemsTotal--, ht->itemsUsed--,
-			ht->impact -= htRecordImpact(thisRecord);
-			varfree(thisRecord->key), varfree(thisRecord->value);
-			free(thisRecord);
+static void htArenaRelease (HashTableArena arena, void * block, size_t bytes)
+{
+	if (bytes > HT_ARENA_SLAB >> 2) {
+		sHashTableLarge * large = (sHashTableLarge *) block - 1,
+			* predecessor = large->predecessor, * successor = large->successor;
+		if (predecessor) predecessor->successor = successor;
+		else arena->large = successor;
+		if (successor) successor->predecessor = predecessor;
+		free(large);
+		return;
+	}
+	size_t class = htArenaClass(bytes);
+	*(void **) block = arena->available[class];
+	arena->available[class] = block;
+}
 
-		return selection;
+/* maps more of the file, at least up to bytes, after what is mapped already */
+static bool htHeapGrow (HashTableFile file, size_t bytes)
+{
+	size_t held = file->heap->bytes, size = held << 1,
+		page = (size_t) sysconf(_SC_PAGESIZE);
+	if (size < bytes) size = bytes;
+	size = (size + page - 1) & ~(page - 1);
+	if (size > file->reserved) size = file->reserved;
+	if (size < bytes) return false;
+	if (ftruncate(file->descriptor, size) || mmap(
+		(char *) file->heap + held, size - held, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_FIXED, file->descriptor, held
+	) == MAP_FAILED) return false;
+	file->heap->bytes = size;
+	return true;
+}
 
+/*
+ * Like the arena, minus slabs: blocks come off the top of the heap and go
+ * back to the free list of their class. The top was never handed out, so
+ * only reused blocks need zeroing.
+ */
+static void * htHeapAllocate (HashTable ht, size_t bytes, bool zero)
+{
+	sHashTableHeap * heap = ht->file->heap;
+	size_t class = htArenaClass(bytes);
+	void * block = NULL;
+	if (class >= HT_FILE_CLASSES) return NULL;
+	htFileChanging(ht);
+	htLockHeap(ht);
+	if ((block = heap->available[class])) {
+		heap->available[class] = *(void **) block;
+		if (zero) memset(block, 0, bytes);
+	} else {
+		bytes = (size_t) 1 << (class + HT_ARENA_MIN_CLASS);
+		if (heap->top + bytes <= heap->bytes
+			|| htHeapGrow(ht->file, heap->top + bytes))
+			block = (char *) heap + heap->top, heap->top += bytes;
 	}
+	htUnlockHeap(ht);
+	return block;
+}
 
-	return HT_ERROR_SENTINEL;
+static void htHeapRelease (HashTable ht, void * block, size_t bytes)
+{
+	sHashTableHeap * heap = ht->file->heap;
+	size_t class = htArenaClass(bytes);
+	if (! block) return;
+	htFileChanging(ht);
+	htLockHeap(ht);
+	*(void **) block = heap->available[class];
+	heap->available[class] = block;
+	htUnlockHeap(ht);
+}
 
+static void * htArrayAllocate (HashTable ht, size_t bytes, bool zero)
+{
+	if (ht->file) return htHeapAllocate(ht, bytes, zero);
+	return (zero) ? calloc(1, bytes) : malloc(bytes);
 }
 
-HashTableItem HashTablePutItemByKey
+static void * htArrayResize
 (
-	HashTable ht,
-	HashTableData realKey,
-	size_t valueLength,
-	double value,
-	HashTableDataFlags valueHint
+	HashTable ht, void * block, size_t held, size_t bytes
 ) {
+	if (! ht->file) return realloc(block, bytes);
+	if (block && htArenaClass(held) == htArenaClass(bytes)) return block;
+	void * resized = htHeapAllocate(ht, bytes, false);
+	if (! resized) return NULL;
+	if (block) memcpy(resized, block, (held < bytes) ? held : bytes);
+	htHeapRelease(ht, block, held);
+	return resized;
+}
 
-	if (! realKey) {
-		errno = HT_ERROR_ZERO_LENGTH_KEY; return HT_ERROR_SENTINEL;
-	}
-
-	return HashTablePut(ht,
-		varlength(realKey), (double)(size_t)realKey, vartype(realKey),
-		valueLength, value, valueHint
-	);
+static void htArrayRelease (HashTable ht, void * block, size_t bytes)
+{
+	if (ht->file) htHeapRelease(ht, block, bytes);
+	else free(block);
+}
 
+static void * htAllocate (HashTable ht, size_t bytes)
+{
+	if (ht->file) return htHeapAllocate(ht, bytes, false);
+	if (! ht->arena) return malloc(bytes);
+	htLockItems(ht);
+	void * block = htArenaAllocate(ht->arena, bytes);
+	htUnlockItems(ht);
+	return block;
 }
 
-HashTableItem HashTablePutItemByKeyData
-(
-	HashTable ht,
-	HashTableData realKey,
-	HashTableData realData
-) {
+/* records of a mapped snapshot go back with the mapping */
+#define htSnapshotBlock(ht, block)                                             \
+((char *) (block) >= (char *) ht->snapshot &&                                  \
+    (char *) (block) < (char *) ht->snapshot + ht->snapshotBytes)
 
-	if (! realKey) {
-		errno = HT_ERROR_ZERO_LENGTH_KEY; return HT_ERROR_SENTINEL;
-	}
+static void htRelease (HashTable ht, void * block, size_t bytes)
+{
+	if (htSnapshotBlock(ht, block)) return;
+	if (ht->file) { htHeapRelease(ht, block, bytes); return; }
+	if (! ht->arena) { free(block); return; }
+	htLockItems(ht);
+	htArenaRelease(ht->arena, block, bytes);
+	htUnlockItems(ht);
+}
 
-	if (! realData) {
-			errno = HT_ERROR_INVALID_REFERENCE; return HT_ERROR_SENTINEL;
+/* forget every block; slabs are kept for reuse unless release is set */
+static void htArenaReset (HashTableArena arena, bool release)
+{
+	sHashTableLarge * large = arena->large, * nextLarge;
+	while (large) nextLarge = large->successor, free(large), large = nextLarge;
+	arena->large = NULL;
+	memset(arena->available, 0, sizeof(arena->available));
+	if (release) {
+		sHashTableSlab * slab = arena->slab, * nextSlab;
+		while (slab) nextSlab = slab->successor, free(slab), slab = nextSlab;
+		arena->slab = NULL;
 	}
+	arena->current = arena->slab, arena->offset = 0;
+}
 
-	return HashTablePut(ht,
-		varlength(realKey), (double)(size_t)realKey, vartype(realKey),
-		varlength(realData), (double)(size_t)realData, vartype(realData)
-	);
-
+/* the data bytes varcreate would allocate for these arguments */
+static size_t htVarBytes (size_t bytes, double data, size_t type)
+{
+	void * ptr = ptrval(data);
+	if (type & HTI_UTF8) {
+		if (bytes == 0) bytes = strlen(ptr);
+		bytes++;
+	} else if (type & HTI_UTF16) {
+		if (bytes == 0) bytes = strlen(ptr);
+		bytes += sizeof(uint16_t);
+	} else if (type & HTI_UTF32) {
+		if (bytes == 0) bytes = (wcslen(ptr)*sizeof(wchar_t)) + sizeof(wchar_t);
+		else bytes += sizeof(wchar_t);
+	}
+	return bytes;
 }
 
-HashTableItem HashTableGetItemByKey
+/*
+ * varcreate into caller supplied memory; bytes comes from htVarBytes. ptr is
+ * where anything but an HTI_DOUBLE comes from, normally ptrval(data).
+ */
+static HyperVariant htVarInit
 (
-	HashTable ht,
-	HashTableData realKey
+	void * head, size_t bytes, double data, const void * ptr, size_t type
 ) {
-	htReturnIfTableUninitialized(ht);
-
-	if (! realKey) {
-		errno = HT_ERROR_ZERO_LENGTH_KEY; return HT_ERROR_SENTINEL;
+	register sHashTableVariant * var = head;
+	var->note = 0, var->private = 0, var->type = type, var->bytes = bytes;
+	if (type & HTI_UTF8) var->data[--bytes] = 0,
+		memcpy(var->data, ptr, bytes);
+	else if (type & HTI_POINTER || type & HTI_NUMBER)
+		varptr(var->data) = (void *) ptr;
+	else if (type & HTI_DOUBLE) vardouble(var->data) = data;
+	else if (type & HTI_BLOCK) memcpy(var->data, ptr, bytes);
+	else if (type & HTI_UTF16) {
+		bytes -= sizeof(uint16_t);
+		* varlea(0, uint16_t, var->data+bytes) = 0,
+		memcpy(var->data, ptr, bytes);
+	} else if (type & HTI_UTF32) {
+		bytes -= sizeof(wchar_t);
+		* varlea(0, wchar_t, var->data+bytes) = 0,
+		memcpy(var->data, ptr, bytes);
 	}
-
-	HashTableRecord item = htFindKey(ht, varlength(realKey), (void*) realKey, vartype(realKey));
-
-	if (! item) return HT_ERROR_SENTINEL;
-
-	HashTableItem
-		currentSelection = htRecordReference(item),
-		selection = htAutoFireItemEvent(
-				ht, currentSelection, HT_EVENT_GET, item->value
-		)
-	;
-
-	if (selection == currentSelection) item->hitCount++;
-	return selection;
-
+	return var->data;
 }
 
-HashTableItem HashTableGet
+/* varcreate for variants owned by the table */
+static HyperVariant htVarCreate
 (
-	HashTable ht,
-	size_t keyLength,
-	double key,
-	HashTableDataFlags hint
+	HashTable ht, size_t bytes, double data, size_t type
 ) {
+	bytes = htVarBytes(bytes, data, type);
+	void * head = htAllocate(ht, HashTableVariantSize + bytes);
+	return (head) ? htVarInit(head, bytes, data, ptrval(data), type) : NULL;
+}
 
-	htReturnIfTableUninitialized(ht);
-	char * realKey = htRealKeyOrReturn(keyLength, key, hint);
+/*
+ * Values adopted by HashTablePutData keep their releaser in the variant's
+ * private field, which is zero for everything the table allocates itself.
+ * They are always spilled, never copied into the record.
+ */
+#define htAdoptedHint HashTableBitFlag(16)
+#define htVarReleaser(v) ((HashTableReleaser) varprvt(v))
 
-	HashTableRecord item = htFindKey(ht, keyLength, realKey, hint);
+static void htVarFree (HashTable ht, HyperVariant var)
+{
+	if (htVarReleaser(var)) htVarReleaser(var)(var);
+	else htRelease(ht, varhead(var), HashTableVariantSize + varbytes(var));
+}
 
-	if (! item) return HT_ERROR_SENTINEL;
+static void htFreeRecord (HashTable ht, HashTableRecord record)
+{
+	if (! htRecordInlineValue(record)) htVarFree(ht, record->value);
+	htRelease(ht, record, record->extent);
+}
 
-	HashTableItem
-		currentSelection = htRecordReference(item),
-		selection = htAutoFireItemEvent(
-				ht, currentSelection, HT_EVENT_GET, item->value
-		)
-	;
+/* arena tables drop their records wholesale; adopted values still go back */
+static void htReleaseAdopted (HashTable ht, HashTableRecord record)
+{
+	if (! htRecordInlineValue(record) && htVarReleaser(record->value))
+		htVarFree(ht, record->value);
+}
 
-	if (selection == currentSelection) item->hitCount++;
+/* Clear and Destroy only look for adopted values once a table has some */
+#define htAdopting(ht)                                                         \
+if (! __atomic_load_n(&ht->adopted, __ATOMIC_RELAXED)) {                       \
+    size_t shard;                                                              \
+    __atomic_store_n(&ht->adopted, true, __ATOMIC_RELAXED);                    \
+    for (shard = 0; shard < ht->shardCount; shard++)                           \
+        __atomic_store_n(&ht->shard[shard]->adopted, true, __ATOMIC_RELAXED);  \
+}
 
-	return selection;
+/* a put that fails still owns the value it was handed */
+#define htDiscardAdopted(ht, value, hint)                                      \
+if ((hint) & htAdoptedHint) htVarFree(ht, ptrval(value))
 
+/* retired spilled values are whole variants, marked by this byte count */
+#define htRetiredValue ((size_t) -1)
+
+static void htReleaseRetired (HashTable ht, void * block, size_t bytes)
+{
+	if (bytes == htRetiredValue) htVarFree(ht, block);
+	else if (bytes) htRelease(ht, block, bytes);
+	else free(block);
 }
 
-bool HashTableDeleteItem
-(
-	HashTable ht,
-	HashTableItem reference
-) {
-	htReturnIfInvalidReference(ht, reference);
-	HashTableRecord parent = NULL;
-	HashTableRecord item = ht->item[reference];
-	htReturnIfNotConfigurableItem(item);
+static void htReclaim (HashTable ht, sHashTableRetired * batch)
+{
+	sHashTableRetired * successor;
+	sHashTableRetiredBlock * retired;
+	while (batch) {
+		successor = batch->successor;
+		retired = batch->retired + batch->count;
+		while (retired-- > batch->retired)
+			htReleaseRetired(ht, retired->block, retired->bytes);
+		free(batch), batch = successor;
+	}
+}
 
-	HashTableItem
-		currentSelection = htRecordReference(item),
-		selection = htAutoFireItemEvent(
-				ht, currentSelection, HT_EVENT_DELETE, item->value
-		)
-	;
+/* moves to the next epoch unless readers remain in the previous one */
+static bool htEpochAdvance (HashTable ht)
+{
+	HashTableEpoch epoch = ht->epoch;
+	size_t current = epoch->epoch, previous = (current + 2) % 3, reader;
+	for (reader = 0; reader < HT_EPOCH_READERS; reader++) if (__atomic_load_n(
+		&epoch->reader[reader].active[previous], __ATOMIC_SEQ_CST
+	)) return false;
+	htReclaim(ht, epoch->limbo[previous]), epoch->limbo[previous] = NULL;
+	__atomic_store_n(&epoch->epoch, current + 1, __ATOMIC_SEQ_CST);
+	return true;
+}
 
-	if (selection == currentSelection) {
-		item = htFindKeyWithParent(
-			ht, varlength(item->key), item->key, vartype(item->key),
-			ht->slot[htRecordHash(item)],
-			&parent
-		);
+/* returns once no reader can still be in an epoch entered before the call */
+static void htEpochSynchronize (HashTable ht)
+{
+	size_t passed = 0;
+	while (passed < 2) if (htEpochAdvance(ht)) passed++; else sched_yield();
+}
 
-		if (parent) parent->successor = item->successor;
-		else {
-			ht->slot[htRecordHash(item)] = item->successor;
+/*
+ * bytes is zero for memory that goes back to free rather than htRelease, and
+ * htRetiredValue for a spilled value. Only filling a batch tries to move the
+ * epoch on, and only then is another batch allocated.
+ */
+static void htRetire (HashTable ht, void * block, size_t bytes)
+{
+	HashTableEpoch epoch = ht->epoch;
+	size_t current = epoch->epoch % 3;
+	sHashTableRetired * batch = epoch->limbo[current];
+	if (batch && batch->count == HT_RETIRE_BATCH) {
+		htVoidExpression htEpochAdvance(ht);
+		current = epoch->epoch % 3, batch = epoch->limbo[current];
+	}
+	if (! batch || batch->count == HT_RETIRE_BATCH) {
+		sHashTableRetired * fresh = malloc(sizeof(sHashTableRetired));
+		if (! fresh) { /* nowhere to park it: wait out every reader instead */
+			htEpochSynchronize(ht);
+			htReleaseRetired(ht, block, bytes);
+			return;
 		}
-
-		ht->item[reference] = NULL,
-		ht->itemsTotal--,
-		ht->impact -= htRecordImpact(item);
-		varfree(item->key); varfree(item->value); free(item);
-		return true;
+		fresh->successor = batch, fresh->count = 0;
+		epoch->limbo[current] = batch = fresh;
 	}
+	batch->retired[batch->count].block = block;
+	batch->retired[batch->count++].bytes = bytes;
+}
 
-	return false;
+static void htRetireRecord (HashTable ht, HashTableRecord record)
+{
+	if (! htRecordInlineValue(record))
+		htRetire(ht, record->value, htRetiredValue);
+	htRetire(ht, record, record->extent);
+}
+
+#define htDisposeRecord(ht, record)                                            \
+if (ht->epoch) htRetireRecord(ht, record); else htFreeRecord(ht, record)
 
+/*
+ * Replace the value, reusing the inline room when the new value fits. Lock
+ * free readers may be copying the old value, so those tables always spill.
+ */
+static void htRecordSetValue (HashTable ht, HashTableRecord record, void * var)
+{
+	char * room = (char *) record->key + htAlign(varbytes(record->key));
+	htFileChanging(ht);
+	htSubtract(ht, ht->impact, htRecordImpact(record));
+	if (ht->epoch) {
+		HyperVariant old = record->value;
+		bool spilled = ! htRecordInlineValue(record);
+		htPublish(record->value, var);
+		if (spilled) htRetire(ht, old, htRetiredValue);
+	} else {
+		if (! htRecordInlineValue(record)) htVarFree(ht, record->value);
+		if (! htVarReleaser(var) && varbytes(var) <= record->capacity) {
+			memcpy(room, varhead(var), HashTableVariantSize + varbytes(var));
+			record->value = room + HashTableVariantSize;
+			htVarFree(ht, var);
+		} else record->value = var;
+	}
+	htAdd(ht, ht->impact, htRecordImpact(record));
 }
 
-HashTableData HashTableItemKey
+static HashTableRecord htThaw (HashTable ht, HashTableRecord record);
+
+/*
+ * Writes a value that fits in the record's room straight there, sparing the
+ * variant htRecordSetValue would copy it from. False, with the value left
+ * as it was, on lock free tables, for adopted values, values too long and
+ * values read out of that very room, and when the record cannot be thawed.
+ */
+static bool htRecordWriteValue
 (
-	HashTable ht,
-	HashTableItem reference
+	HashTable ht, HashTableRecord * target, size_t length, double value,
+	HashTableDataFlags type
 ) {
-	htReturnIfInvalidReference(ht, reference);
-	return ht->item[reference]->key;
+	size_t bytes = htVarBytes(length, value, type);
+	if (ht->epoch || type & htAdoptedHint || bytes > (*target)->capacity)
+		return false;
+	HashTableRecord record = htThaw(ht, *target);
+	if (! record) return false;
+	*target = record;
+	char * room = (char *) record->key + htAlign(varbytes(record->key));
+	const char * from = ptrval(value);
+	if (! (type & HTI_DOUBLE) && from >= room
+		&& from < room + HashTableVariantSize + record->capacity) return false;
+	HyperVariant old = (htRecordInlineValue(record)) ? NULL : record->value;
+	htFileChanging(ht);
+	htSubtract(ht, ht->impact, htRecordImpact(record));
+	record->value = htVarInit(room, bytes, value, from, type);
+	if (old) htVarFree(ht, old);
+	htAdd(ht, ht->impact, htRecordImpact(record));
+	return true;
 }
 
-HashTableData HashTableItemData
-(
-	HashTable ht,
-	HashTableItem reference
-) {
-	htReturnIfInvalidReference(ht, reference);
-	return ht->item[reference]->value;
+/* the snapshot handle, as opposed to the table it was taken of */
+#define htViewing(ht) (ht->viewing != NULL)
+
+/* what the view sees at index; the caller holds the live items lock */
+static HashTableRecord htViewRecord (HashTableView view, size_t index)
+{
+	HashTableRecordItems chunk;
+	if (index >= view->itemsUsed) return NULL;
+	chunk = view->chunk[index / HT_VIEW_CHUNK];
+	return (chunk) ? chunk[index % HT_VIEW_CHUNK] : view->table->item[index];
 }
 
-size_t HashTableDataLength
-(
-	HashTableData data
-) {
-	if (data) return varlength(data);
-	return HT_ERROR_SENTINEL;
+/* whether an open view sees this live record */
+#define htViewSees(view, record)                                               \
+((view) && htViewRecord(view, htRecordReference(record) - 1) == (record))
+
+/* the view takes its own copy of index's chunk before the index changes */
+static bool htViewCopy (HashTable ht, size_t index)
+{
+	HashTableView view = ht->view;
+	size_t chunk = index / HT_VIEW_CHUNK, first = chunk * HT_VIEW_CHUNK, count;
+	if (index >= view->itemsUsed || view->chunk[chunk]) return true;
+	count = view->itemsUsed - first;
+	if (count > HT_VIEW_CHUNK) count = HT_VIEW_CHUNK;
+	HashTableRecordItems copy = malloc(count * sizeof(HashTableRecord));
+	if (! copy) return false;
+	memcpy(copy, ht->item + first, count * sizeof(HashTableRecord));
+	view->chunk[chunk] = copy;
+	return true;
 }
 
-HashTableDataFlags HashTableDataType
+/* the removed slot holding key, or the empty one ending its probe */
+static HashTableRecordList htViewRemoved
 (
-	HashTableData data
+	HashTableView view,
+	size_t keyLength,
+	const void * realKey
 ) {
-	if (data) return (vartype(data) &
-		(HTI_NUMBER | HTI_DOUBLE | HTI_POINTER | HTI_BLOCK)
-	);
-	return HT_ERROR_SENTINEL;
+	size_t mask = view->removedSlots - 1,
+		index = HashTableWyHash(realKey, keyLength, 0) & mask;
+	HashTableRecord record;
+	while ((record = view->removed[index])
+		&& (htRecordKeyLength(record) != keyLength
+			|| memcmp(record->key, realKey, keyLength)))
+		index = (index + 1) & mask;
+	return view->removed + index;
 }
 
-HashTableDataFlags HashTableDataSettings
-(
-	HashTableData data
-) {
-	if (data) return vartype(data);
-	return HT_ERROR_SENTINEL;
+/* removed stays at most half full */
+static bool htViewReserveRemoved (HashTableView view)
+{
+	HashTableRecordList held = view->removed;
+	size_t index, slots = view->removedSlots;
+	if ((view->removedCount + 1) << 1 <= slots) return true;
+	view->removed = calloc((slots) ? slots << 1 : 64, sizeof(HashTableRecord));
+	if (! view->removed) { view->removed = held; return false; }
+	view->removedSlots = (slots) ? slots << 1 : 64;
+	for (index = 0; index < slots; index++) if (held[index]) *htViewRemoved(
+		view, htRecordKeyLength(held[index]), held[index]->key
+	) = held[index];
+	free(held);
+	return true;
 }
 
-bool HashTableItemGetEnumerable
-(
-	HashTable ht,
-	HashTableItem reference
-) {
-	htReturnIfInvalidReference(ht, reference);
-	return \
-		(htRecordSettings(ht->item[reference]) & HTI_NON_ENUMERABLE) == 0;
+/*
+ * The view takes a record the live table is done with, found by its key
+ * from then on; the caller holds the items lock.
+ */
+static bool htViewLeave (HashTable ht, HashTableRecord record)
+{
+	HashTableView view = ht->view;
+	if (! htViewReserveRemoved(view)
+		|| ! htViewCopy(ht, htRecordReference(record) - 1)) return false;
+	*htViewRemoved(view, htRecordKeyLength(record), record->key) = record;
+	view->removedCount++;
+	return true;
 }
 
-bool HashTableItemSetEnumerable
-(
-	HashTable ht,
-	HashTableItem reference,
-	bool value
-) {
-	htReturnIfInvalidReference(ht, reference);
-	HashTableRecord item = ht->item[reference];
-	htReturnIfNotConfigurableItem(item);
-	if (! value) {
-		htRecordSettings(item) &= ~HTI_NON_ENUMERABLE;
-	} else {
-		htRecordSettings(item) |= HTI_NON_ENUMERABLE;
+/*
+ * The record to change in place of one a view still sees: a copy taking
+ * over its reference and its place in the slots, with a spilled value of
+ * its own, while the view keeps the original. The caller holds the key's
+ * stripe or the table; NULL if there is no memory.
+ */
+static HashTableRecord htThaw (HashTable ht, HashTableRecord record)
+{
+	if (! ht->view) return record;
+	size_t index = htRecordReference(record) - 1;
+	htLockItems(ht);
+	bool seen = htViewSees(ht->view, record);
+	htUnlockItems(ht);
+	if (! seen) return record;
+
+	htFileChanging(ht);
+	HashTableRecord copy = htAllocate(ht, record->extent);
+	htReturnIfAllocationFailure(copy, {});
+	sHashTableVariant * value = NULL;
+	size_t valueBytes = 0;
+	if (! htRecordInlineValue(record)) {
+		valueBytes = HashTableVariantSize + varbytes(record->value);
+		value = htAllocate(ht, valueBytes);
+		htReturnIfAllocationFailure(value, htRelease(ht, copy, record->extent));
+		memcpy(value, varhead(record->value), valueBytes);
+		value->private = NULL;
 	}
-	return true;
+
+	memcpy(copy + 1, record + 1, record->extent - HashTableRecordSize);
+	copy->hash = record->hash, copy->hitCount = htRead(record->hitCount);
+	copy->extent = record->extent, copy->capacity = record->capacity;
+	copy->successor = record->successor;
+	copy->key = (char *) copy + ((char *) record->key - (char *) record);
+	copy->value = (value) ? value->data :
+		(char *) copy + ((char *) record->value - (char *) record);
+
+	htLockItems(ht);
+	if ((seen = htViewLeave(ht, record))) htPublish(ht->item[index], copy);
+	htUnlockItems(ht);
+	if (! seen) {
+		if (value) htRelease(ht, value, valueBytes);
+		htRelease(ht, copy, record->extent);
+		errno = HT_ERROR_ALLOCATION_FAILURE; return NULL;
+	}
+
+	if (htOpenAddressing(ht)) htPublish(*htProbeFind(
+		ht, htRecordHash(record), htRecordKeyLength(record), record->key, NULL
+	), copy);
+	else {
+		HashTableRecordList bucket = htRecordBucket(ht, record);
+		while (*bucket != record) bucket = &(*bucket)->successor;
+		htPublish(*bucket, copy);
+	}
+	return copy;
 }
 
-bool HashTableItemGetWritable
-(
-	HashTable ht,
-	HashTableItem reference
-) {
-	htReturnIfInvalidReference(ht, reference);
-	return \
-		(htRecordSettings(ht->item[reference]) & HTI_NON_WRITABLE) == 0;
+/* a deleted record a view still sees is left to it */
+static bool htViewKeep (HashTable ht, HashTableRecord record)
+{
+	htLockItems(ht);
+	bool kept = htViewLeave(ht, record);
+	htUnlockItems(ht);
+	return kept;
 }
 
-bool HashTableItemSetWritable
+/*
+ * A key the view saw is either in removed, having been changed or deleted
+ * since, or still on the same record in the live table.
+ */
+static HashTableItem htViewGet
 (
 	HashTable ht,
-	HashTableItem reference,
-	bool value
+	size_t keyLength,
+	void * realKey,
+	HashTableEvent event
 ) {
-	htReturnIfInvalidReference(ht, reference);
-	HashTableRecord item = ht->item[reference];
-	htReturnIfNotConfigurableItem(item);
-	if (! value) {
-		htRecordSettings(item) &= ~HTI_NON_WRITABLE;
-	} else {
-		htRecordSettings(item) |= HTI_NON_WRITABLE;
+	HashTableView view = ht->viewing;
+	HashTable live = view->table;
+	HashTableRecord record;
+	HashTableItem found = 0;
+	htSharedScope(live);
+	size_t hash = htCreateHash(live, keyLength, realKey);
+	htStripeScope(live, hash, false);
+	htLockItems(live);
+	if (view->removedCount
+		&& (record = *htViewRemoved(view, keyLength, realKey))) {
+		found = htRecordReference(record);
+	} else if ((record = htLookup(live, hash, keyLength, realKey))) {
+		if (htViewRecord(view, htRecordReference(record) - 1) == record)
+			found = htRecordReference(record);
 	}
-	return true;
+	htUnlockItems(live);
+	if (! found && event) errno = HT_ERROR_INVALID_REFERENCE;
+	return found;
 }
 
-bool HashTableItemGetConfigurable
-(
-	HashTable ht,
-	HashTableItem reference
-) {
-	htReturnIfInvalidReference(ht, reference);
-	return \
-		(htRecordSettings(ht->item[reference]) & HTI_NON_CONFIGURABLE) == 0
-	;
+/* the record a view sees for reference, or NULL */
+static HashTableRecord htViewItem (HashTable ht, HashTableItem reference)
+{
+	HashTableView view = ht->viewing;
+	HashTableRecord record;
+	if (! reference) return NULL;
+	htSharedScope(view->table);
+	htLockItems(view->table);
+	record = htViewRecord(view, reference - 1);
+	htUnlockItems(view->table);
+	return record;
 }
 
-bool HashTableItemSetConfigurable
+/*
+ * The next enumerable reference a view sees after reference, going either
+ * way; 0 starts from either end and is the end.
+ */
+static HashTableItem htViewStep
 (
 	HashTable ht,
 	HashTableItem reference,
-	bool value
+	bool forward
 ) {
-	htReturnIfInvalidReference(ht, reference);
-	HashTableRecord item = ht->item[reference];
-	htReturnIfNotConfigurableItem(item);
-	if (! value) {
-		htRecordSettings(item) &= ~HTI_NON_CONFIGURABLE;
-	} else {
-		htRecordSettings(item) |= HTI_NON_CONFIGURABLE;
-	}
-	return true;
+	HashTableView view = ht->viewing;
+	HashTableRecord record;
+	size_t used = view->itemsUsed;
+	if (! forward && reference > used) reference = used + 1;
+	htSharedScope(view->table);
+	htLockItems(view->table);
+	do {
+		if (forward) reference = (reference < used) ? reference + 1 : 0;
+		else reference = (reference) ? reference - 1 : used;
+	} while (reference && (! (record = htViewRecord(view, reference - 1))
+		|| htRecordSettings(record) & HTI_NON_ENUMERABLE));
+	htUnlockItems(view->table);
+	return reference;
 }
 
-void HashTableEnumerate
-(
-	HashTable ht,
-	HashTableEnumerateDirection direction,
-	HashTableEnumerationHandler handler,
-	void * private
-) {
-	htReturnVoidIfTableUninitialized(ht);
-	htReturnVoidIfNoCallBackHandler(handler);
+static __thread uint64_t htThreadRandom;
 
-	size_t index, maximum = ht->itemsMax;
-	HashTableRecord item;
-	if (! maximum ) return;
-	if (direction == HT_ENUMERATE_FORWARD) {
-		for (index = 0; index < maximum; index++) {
-			item = ht->item[index];
-			if (item && ! (htRecordSettings(item) & HTI_NON_ENUMERABLE)) {
-				if ( ! handler(ht, direction, index + 1, private) ) break;
-			}
-		}
-	} else {
-		index = maximum;
-		while (--index) {
-			item = ht->item[index];
-			if (item && ! (htRecordSettings(item) & HTI_NON_ENUMERABLE)) {
-				if ( ! handler(ht, direction, index + 1, private) ) break;
-			}
-		}
-		/* manually enumerate the last item (0) */
-		item = ht->item[0];
-		if (item && ! (htRecordSettings(item) & HTI_NON_ENUMERABLE)) {
-			handler(ht, direction, index + 1, private);
+/* xorshift64*, seeded from the thread's own address */
+htVirtualImmediateFunction (uint64_t) htRandom (void)
+{
+	uint64_t x = htThreadRandom;
+	if (! x) x = (uint64_t)(size_t) htThisThread * 0x9E3779B97F4A7C15ull | 1;
+	x ^= x >> 12, x ^= x << 25, x ^= x >> 27;
+	htThreadRandom = x;
+	return x * 0x2545F4914F6CDD1Dull;
+}
+
+/*
+ * Per thread hit arrays are as long as the item index. They are folded into
+ * the records and dropped before the index or the references move, and come
+ * back on the next hit.
+ */
+static void htFlushHits (HashTable ht)
+{
+	size_t slot, index;
+	if (! ht->hitCounter) return;
+	for (slot = 0; slot < HT_HIT_THREADS; slot++) {
+		size_t * counter = ht->hitCounter[slot];
+		if (! counter) continue;
+		for (index = 0; index < ht->itemsMax; index++)
+			if (counter[index] && ht->item[index])
+				ht->item[index]->hitCount += counter[index];
+		free(counter), ht->hitCounter[slot] = NULL;
+		ht->impact -= ht->itemsMax * sizeof(size_t);
+	}
+}
+
+static void htCountThreadHit (HashTable ht, size_t index)
+{
+	size_t ** slot =
+		ht->hitCounter + (htThreadSlot() & (HT_HIT_THREADS - 1)),
+		* counter = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (! counter) {
+		size_t * fresh = calloc(ht->itemsMax, sizeof(size_t));
+		if (! fresh) return; /* the hit goes uncounted */
+		if (__atomic_compare_exchange_n(
+			slot, &counter, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+		)) {
+			counter = fresh;
+			htAdd(ht, ht->impact, ht->itemsMax * sizeof(size_t));
+		} else free(fresh);
+	}
+	htAdd(ht, counter[index], 1);
+}
+
+/* a new record's reference may have counted hits for an older one */
+static void htClearThreadHits (HashTable ht, size_t index)
+{
+	size_t slot, * counter;
+	if (ht->hitCounter) for (slot = 0; slot < HT_HIT_THREADS; slot++)
+		if ((counter = htRead(ht->hitCounter[slot])))
+			__atomic_store_n(counter + index, 0, __ATOMIC_RELAXED);
+}
+
+static void htCountHit (HashTable ht, HashTableRecord record)
+{
+	switch (ht->hitCounting) {
+	case HT_HITS_OFF:
+		return;
+	case HT_HITS_SAMPLED:
+		if (! (htRandom() & (HT_HIT_SAMPLE - 1)))
+			htAdd(ht, record->hitCount, HT_HIT_SAMPLE);
+		return;
+	case HT_HITS_PER_THREAD:
+		/* lock free readers could be adding up arrays the writer drops */
+		if (! ht->epoch) {
+			htCountThreadHit(ht, htRecordReference(record) - 1);
+			return;
 		}
+		/* fall through */
+	default:
+		htAdd(ht, record->hitCount, 1);
 	}
 }
 
-void HashTableSortItems
+/*
+ * One bit per item index, set while the index holds a record, so walks
+ * step over 64 holes at a time.
+ */
+#define htOccupancyWords(items) (((items) + 63) >> 6)
+#define htOccupancyBit(index) ((uint64_t) 1 << ((index) & 63))
+
+#define htOccupy(ht, index)                                                    \
+((ht->locks) ? __atomic_fetch_or(ht->occupied + ((index) >> 6),               \
+    htOccupancyBit(index), __ATOMIC_RELEASE)                                   \
+    : (ht->occupied[(index) >> 6] |= htOccupancyBit(index)))
+
+#define htVacate(ht, index)                                                    \
+((ht->locks) ? __atomic_fetch_and(ht->occupied + ((index) >> 6),              \
+    ~htOccupancyBit(index), __ATOMIC_RELEASE)                                  \
+    : (ht->occupied[(index) >> 6] &= ~htOccupancyBit(index)))
+
+/*
+ * The first occupied reference after reference and up to last, or 0.
+ * itemsMax is read before the bitmap, which is published first when it
+ * grows.
+ */
+static HashTableItem htOccupiedNext
 (
 	HashTable ht,
-	HashTableSortType type,
-	HashTableSortDirection direction,
-	HashTableSortHandler sortHandler,
-	void * private
+	HashTableItem reference,
+	HashTableItem last
 ) {
-	htReturnVoidIfTableUninitialized(ht);
-	htReturnVoidIfNoCallBackHandler(sortHandler);
+	size_t limit = htRead(ht->itemsMax), used = htRead(ht->itemsUsed);
+	uint64_t * occupied = htRead(ht->occupied), bits;
+	if (used < limit) limit = used;
+	if (last < limit) limit = last;
+	if (reference >= limit) return 0;
+	size_t word = reference >> 6;
+	bits = htRead(occupied[word]) & (~(uint64_t) 0 << (reference & 63));
+	while (! bits) {
+		if (++word >= htOccupancyWords(limit)) return 0;
+		bits = htRead(occupied[word]);
+	}
+	reference = (word << 6) + __builtin_ctzll(bits);
+	return (reference < limit) ? reference + 1 : 0;
+}
 
-	if (ht->itemsMax < 2) return;
+/* the last occupied reference before reference (0 for the end), or 0 */
+static HashTableItem htOccupiedPrevious (HashTable ht, HashTableItem reference)
+{
+	size_t limit = htRead(ht->itemsMax), used = htRead(ht->itemsUsed);
+	uint64_t * occupied = htRead(ht->occupied), bits;
+	if (used < limit) limit = used;
+	if (! reference || reference > limit) reference = limit + 1;
+	if (reference < 2) return 0;
+	size_t index = reference - 2, word = index >> 6;
+	bits = htRead(occupied[word]) & (~(uint64_t) 0 >> (63 - (index & 63)));
+	while (! bits) {
+		if (! word--) return 0;
+		bits = htRead(occupied[word]);
+	}
+	return (word << 6) + (63 - __builtin_clzll(bits)) + 1;
+}
 
-	size_t maximum = ht->itemsMax;
-	register HashTableItem primary,secondary;
-	HashTableItem selection;
+#define htOccupiedStep(ht, reference, forward)                                 \
+((forward) ? htOccupiedNext(ht, reference, SIZE_MAX) :                        \
+    htOccupiedPrevious(ht, reference))
 
-	HashTableRecord primaryRecord;
-	HashTableRecord secondaryRecord;
+/* after items move around wholesale; nothing may be reading the table */
+static void htRebuildOccupancy (HashTable ht)
+{
+	size_t index = ht->itemsMax;
+	memset(ht->occupied, 0, htOccupancyWords(index) * sizeof(uint64_t));
+	while (index--) if (ht->item[index]) htOccupy(ht, index);
+}
 
-	for (primary = 0; primary < maximum; primary++) {
-		if (! ht->item[primary] && ! type & HT_SORT_EMPTY_ITEMS) continue;
-		for (secondary = primary + 1; secondary < maximum; secondary++) {
-			if (! ht->item[secondary] && ! type & HT_SORT_EMPTY_ITEMS) continue;
-			selection = sortHandler(
-				ht, type, direction, primary+1, secondary+1, private
-			);
-			if (! selection--) goto BuildItemReferences;
-			else if (selection == secondary){
-				primaryRecord = ht->item[primary];
-				secondaryRecord = ht->item[secondary];
-				ht->item[primary] = secondaryRecord;
-				ht->item[secondary] = primaryRecord;
-			}
-		}
+/*
+ * The item index grows geometrically; new entries are always NULL. Lock
+ * free tables copy it, since readers may still be indexing the old one.
+ * The occupancy bitmap follows it.
+ */
+static bool htReserveItems (HashTable ht, size_t count)
+{
+	if (count <= ht->itemsMax) return true;
+	htFlushHits(ht);
+	size_t max = (ht->itemsMax < HT_RESERVE_ITEMS) ?
+		HT_RESERVE_ITEMS : ht->itemsMax << 1;
+	if (max < count) max = count;
+	size_t words = htOccupancyWords(max),
+		held = htOccupancyWords(ht->itemsMax);
+	uint64_t * occupied = (ht->epoch) ? malloc(words * sizeof(uint64_t)) :
+		htArrayResize(ht, ht->occupied, held * sizeof(uint64_t),
+			words * sizeof(uint64_t));
+	if (! occupied) return false;
+	if (! ht->epoch) ht->occupied = occupied;
+	HashTableRecordItems list = (ht->epoch) ? malloc(max * sizeof(void*)) :
+		htArrayResize(ht, ht->item, ht->itemsMax * sizeof(void*),
+			max * sizeof(void*));
+	if (! list) {
+		if (ht->epoch) free(occupied);
+		return false;
 	}
+	HashTableRecordItems old = (ht->epoch) ? ht->item : NULL;
+	uint64_t * vacated = (ht->epoch) ? ht->occupied : NULL;
+	if (old) memcpy(list, old, ht->itemsMax * sizeof(void*));
+	if (vacated) memcpy(occupied, vacated, held * sizeof(uint64_t));
+	memset(list + ht->itemsMax, 0, (max - ht->itemsMax) * sizeof(void*));
+	memset(occupied + held, 0, (words - held) * sizeof(uint64_t));
+	ht->impact += (max - ht->itemsMax) * sizeof(void*) +
+		(words - held) * sizeof(uint64_t);
+	htPublish(ht->occupied, occupied);
+	htPublish(ht->item, list), htPublish(ht->itemsMax, max);
+	if (old) htRetire(ht, old, 0), htRetire(ht, vacated, 0);
+	return true;
+}
 
-BuildItemReferences:
-	for(primary = 0; primary < maximum;) {
-		primaryRecord = ht->item[primary++];
-		if (primaryRecord) htRecordReference(primaryRecord) = primary;
+/*
+ * Called once item[index] is NULL. With HT_OPTION_REUSE_REFERENCES the index
+ * is handed out again by htCreateRecord; otherwise only the last reference
+ * can be taken back, and only when the caller asks to.
+ */
+static void htReleaseReference (HashTable ht, size_t index, bool last)
+{
+	if (last && index + 1 == ht->itemsUsed) {
+		htSubtract(ht, ht->itemsUsed, 1); return;
+	}
+	if (! (ht->options & HT_OPTION_REUSE_REFERENCES)) return;
+	if (ht->releasedCount == ht->releasedMax) {
+		size_t max = (ht->releasedMax) ?
+			ht->releasedMax << 1 : HT_RESERVE_ITEMS;
+		size_t * list = htArrayResize(ht, ht->released,
+			ht->releasedMax * sizeof(size_t), max * sizeof(size_t));
+		if (! list) return; /* the reference is simply not reused */
+		ht->impact += (max - ht->releasedMax) * sizeof(size_t);
+		ht->released = list, ht->releasedMax = max;
 	}
+	ht->released[ht->releasedCount++] = index;
+}
 
+/*
+ * The next released index, or SIZE_MAX. CompactHashTable leaves behind
+ * released indexes it filled or cut off; they are dropped here.
+ */
+static size_t htReleasedReference (HashTable ht)
+{
+	size_t index;
+	while (ht->releasedCount) {
+		index = ht->released[--ht->releasedCount];
+		if (index < ht->itemsUsed && ! ht->item[index]) return index;
+	}
+	return SIZE_MAX;
 }
 
-void HashTableSortItemHash
+/* after references move around, collect the holes below itemsUsed again */
+static void htRebuildReleasedReferences (HashTable ht)
+{
+	size_t index = ht->itemsUsed;
+	ht->releasedCount = 0;
+	if (! (ht->options & HT_OPTION_REUSE_REFERENCES)) return;
+	while (index--) if (! ht->item[index]) htReleaseReference(ht, index, false);
+}
+
+/* one level in four climbs to the next */
+static size_t htOrderedLevels (void)
+{
+	size_t levels = 1;
+	uint64_t bits = htRandom();
+	while (levels < HT_ORDERED_LEVELS && ! (bits & 3)) levels++, bits >>= 2;
+	return levels;
+}
+
+static HashTableRecord htCreateRecord
 (
 	HashTable ht,
-	HashTableItem reference,
-	HashTableSortType type,
-	HashTableSortDirection direction,
-	HashTableSortHandler sortHandler,
-	void * private
+	size_t keyLength, const void * realKey, double key,
+	HashTableDataFlags keyHint,
+	size_t valueLength, double value, HashTableDataFlags valueHint
 ) {
 
-	htReturnVoidIfInvalidReference(ht, reference);
-	htReturnVoidIfNoCallBackHandler(sortHandler);
+	bool adopted = valueHint & htAdoptedHint;
 
-	HashTableRecord item = ht->item[reference];
-	size_t maximum = 0, index = 0, recordHash = htRecordHash(item);
-	item = ht->slot[recordHash];
-	while (item) maximum++, item = item->successor;
-	HashTableRecord array[maximum+1];
-	array[maximum] = NULL;
-	item = ht->slot[recordHash];
-	while (item) array[index++] = item, item = item->successor;
+	size_t
+		keyBytes = htVarBytes(keyLength, key, keyHint),
+		valueBytes = (adopted) ? 0 : htVarBytes(valueLength, value, valueHint),
+		levels = (ht->ordered) ? htOrderedLevels() : 0,
+		extent = HashTableRecordSize + (HashTableVariantSize << 1) +
+			htAlign(keyBytes) + htAlign(valueBytes) +
+			((levels) ? htOrderedNodeBytes(levels) : 0);
 
-	HashTableItem primary, secondary;
-	for (primary = 0; primary < maximum; primary++) {
-		for (secondary = primary + 1; secondary < maximum; secondary++) {
-			HashTableItem selection,
-			primaryRef = htRecordReference(array[primary]),
-			secondaryRef = htRecordReference(array[secondary]);
-			selection = sortHandler(
-				ht, type, direction, primaryRef--, secondaryRef--, private
-			);
-			if (--selection == secondaryRef){
-				array[secondary] = ht->item[primaryRef];
-				array[primary] = ht->item[secondaryRef];
+	HashTableRecord this = htAllocate(ht, extent);
+	htReturnIfAllocationFailure(this, {});
+
+	this->hash = this->hitCount = 0, this->successor = NULL;
+	this->extent = extent, this->capacity = htAlign(valueBytes);
+	this->key = htVarInit(this + 1, keyBytes, key, realKey, keyHint);
+	this->value = (adopted) ? ptrval(value) : htVarInit(
+		(char *) this->key + htAlign(keyBytes), valueBytes, value,
+		ptrval(value), valueHint
+	);
+	if (levels) {
+		HashTableOrderedNode node = (void *)
+			((char *) this + extent - htOrderedNodeBytes(levels));
+		node->record = this, node->levels = levels;
+		htRecordNode(this) = node;
+	}
+
+	size_t index;
+	bool reserved = true;
+
+	htLockItems(ht);
+	if ((index = htReleasedReference(ht)) == SIZE_MAX) {
+		/* readers hold the item index; the caller grows it exclusively */
+		if (ht->locks && ! htOwnsTable(ht->locks)
+			&& ht->itemsUsed == ht->itemsMax) reserved = false, errno = EAGAIN;
+		else if ((reserved = htReserveItems(ht, ht->itemsUsed + 1)))
+			index = htAdd(ht, ht->itemsUsed, 1) - 1;
+	}
+	/* an open snapshot keeps what it saw at a reused index */
+	if (reserved && ht->view && ! htViewCopy(ht, index))
+		reserved = false, htReleaseReference(ht, index, true);
+	if (reserved) htRecordReference(this) = index + 1,
+		htClearThreadHits(ht, index), htPublish(ht->item[index], this),
+		htOccupy(ht, index);
+	htUnlockItems(ht);
+
+	if (! reserved) {
+		htRelease(ht, this, extent);
+		if (errno != EAGAIN) errno = HT_ERROR_ALLOCATION_FAILURE;
+		return NULL;
+	}
+
+	htAdd(ht, ht->itemsTotal, 1), htAdd(ht, ht->impact, htRecordImpact(this));
+
+	return this;
+
+}
+
+/*
+ * Sharded tables route keys by the high half of the hash, leaving the low
+ * bits to pick slots inside the shard. Their references interleave the
+ * shards: shard local reference l of shard i is (l - 1) * shards + i + 1.
+ */
+#define htShardHalf (sizeof(size_t) << 2)
+#define htShardFor(ht, hash)                                                   \
+(ht->shard[(((hash) >> htShardHalf) * ht->shardCount) >> htShardHalf])
+
+htVirtualImmediateFunction(HashTableItem) htShardReference
+(HashTable ht, size_t index, HashTableItem local)
+{
+	if (! local) return HT_ERROR_SENTINEL;
+	return (local - 1) * ht->shardCount + index + 1;
+}
+
+/* the shard holding reference, which becomes the shard local reference */
+static HashTable htShardItem (HashTable ht, HashTableItem * reference)
+{
+	if (! *reference) return ht->shard[0];
+	size_t index = (*reference - 1) % ht->shardCount;
+	*reference = (*reference - 1) / ht->shardCount + 1;
+	return ht->shard[index];
+}
+
+/* hands a reference addressed to a sharded table on to its shard */
+#define htReturnIfSharded(ht, reference, function, ...)                        \
+if (ht->shard) {                                                               \
+    HashTable shard = htShardItem(ht, &reference);                             \
+    return function(shard, reference, ##__VA_ARGS__);                          \
+}
+
+#define htShardResult(shard, local)                                            \
+htShardReference(shard->parent, shard->shardIndex, local)
+
+#define htAsyncEvents(withEvents)                                              \
+((withEvents) & (HT_EVENT_PUT | HT_EVENT_GET | HT_EVENT_DELETE))
+
+#define htEventQueueImpact(queue)                                              \
+((queue) ? sizeof(sHashTableEventQueue) +                                      \
+    (queue->mask + 1) * sizeof(sHashTableEventCell) : 0)
+
+/* hands everything waiting to the handler; the caller holds deliver */
+static size_t htDeliverEvents (HashTableEventQueue queue)
+{
+	HashTableEvent event[HT_EVENT_BATCH];
+	HashTableItem reference[HT_EVENT_BATCH];
+	size_t delivered = 0, count, tail = queue->tail.position;
+	sHashTableEventCell * cell;
+	do {
+		for (count = 0; count < HT_EVENT_BATCH; count++, tail++) {
+			cell = queue->cell + (tail & queue->mask);
+			if (htRead(cell->sequence) != tail + 1) break;
+			event[count] = cell->event, reference[count] = cell->reference;
+			htPublish(cell->sequence, tail + queue->mask + 1);
+		}
+		queue->tail.position = tail;
+		if (count) queue->handler(
+			queue->table, count, event, reference, queue->table->private
+		);
+		delivered += count;
+	} while (count == HT_EVENT_BATCH);
+	return delivered;
+}
+
+static void * htEventThread (void * argument)
+{
+	HashTableEventQueue queue = argument;
+	struct timespec deadline;
+	pthread_mutex_lock(&queue->deliver);
+	while (! queue->stopping) {
+		htVoidExpression htDeliverEvents(queue);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += HT_EVENT_LATENCY * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&queue->wake, &queue->deliver, &deadline);
+	}
+	htVoidExpression htDeliverEvents(queue);
+	pthread_mutex_unlock(&queue->deliver);
+	return NULL;
+}
+
+static void htQueueEvent
+(
+	HashTableEventQueue queue,
+	HashTableEvent event,
+	HashTableItem reference
+) {
+	size_t position = __atomic_load_n(&queue->head.position, __ATOMIC_RELAXED);
+	sHashTableEventCell * cell;
+	ptrdiff_t lag;
+	for (;;) {
+		cell = queue->cell + (position & queue->mask);
+		lag = (ptrdiff_t) (htRead(cell->sequence) - position);
+		if (! lag) {
+			if (__atomic_compare_exchange_n(&queue->head.position, &position,
+				position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+			)) break;
+			continue;
+		}
+		if (lag < 0) { /* full: make room or wait for the thread to */
+			if (! queue->threaded && ! pthread_mutex_trylock(&queue->deliver)) {
+				htVoidExpression htDeliverEvents(queue);
+				pthread_mutex_unlock(&queue->deliver);
+			} else {
+				if (queue->threaded) pthread_cond_signal(&queue->wake);
+				sched_yield();
 			}
 		}
+		position = __atomic_load_n(&queue->head.position, __ATOMIC_RELAXED);
 	}
+	cell->event = event, cell->reference = reference;
+	htPublish(cell->sequence, position + 1);
+	if (queue->threaded && ! ((position + 1) & (HT_EVENT_BATCH - 1)))
+		pthread_cond_signal(&queue->wake);
+}
 
-MakeLinkedList:
+static HashTableEventQueue htCreateEventQueue
+(
+	HashTable ht,
+	HashTableEvent withEvents,
+	HashTableEventBatchHandler handler,
+	size_t capacity,
+	bool threaded
+) {
+	size_t cells = 2, index;
+	if (! capacity) capacity = HT_EVENT_QUEUE;
+	while (cells < capacity) cells <<= 1;
+	HashTableEventQueue queue = calloc(1,
+		sizeof(sHashTableEventQueue) + cells * sizeof(sHashTableEventCell)
+	);
+	htReturnIfAllocationFailure(queue, {});
+	for (index = 0; index < cells; index++) queue->cell[index].sequence = index;
+	queue->mask = cells - 1, queue->events = htAsyncEvents(withEvents),
+	queue->handler = handler, queue->table = ht, queue->threaded = threaded;
+	pthread_mutex_init(&queue->deliver, NULL);
+	pthread_cond_init(&queue->wake, NULL);
+	if (threaded && pthread_create(&queue->thread, NULL, htEventThread, queue))
+	{
+		pthread_cond_destroy(&queue->wake);
+		pthread_mutex_destroy(&queue->deliver);
+		free(queue), queue = NULL;
+	}
+	htReturnIfAllocationFailure(queue, {});
+	return queue;
+}
 
-	for (index = 0; index < maximum;)
-		array[index]->successor = array[++index];
-	ht->slot[recordHash] = array[0];
+/* stops delivery once whatever is still waiting has been handed over */
+static void htCloseEventQueue (HashTableEventQueue queue)
+{
+	pthread_mutex_lock(&queue->deliver);
+	queue->stopping = true;
+	if (! queue->threaded) htVoidExpression htDeliverEvents(queue);
+	pthread_cond_signal(&queue->wake);
+	pthread_mutex_unlock(&queue->deliver);
+	if (queue->threaded) pthread_join(queue->thread, NULL);
+	pthread_cond_destroy(&queue->wake);
+	pthread_mutex_destroy(&queue->deliver);
+	free(queue);
+}
 
+/*
+ * Shards queue to their parent's ring. Lock free readers may be queueing to
+ * the ring being replaced until they leave their epoch.
+ */
+static void htSetEventQueue (HashTable ht, HashTableEventQueue queue)
+{
+	size_t index;
+	for (index = 0; index < ht->shardCount; index++)
+		htSetEventQueue(ht->shard[index], queue);
+	htExclusiveScope(ht);
+	if (! ht->parent) ht->impact +=
+		htEventQueueImpact(queue) - htEventQueueImpact(ht->queue);
+	htPublish(ht->queue, queue);
+	if (ht->epoch) htEpochSynchronize(ht);
 }
 
-void HashTableEnumerateItemHash
+#define HT_LOG_PUT 1
+#define HT_LOG_DELETE 2
+#define HT_LOG_CLEAR 3
+
+/* the room an entry takes in the log, data included */
+#define htLogEntryBytes(entry)                                                 \
+(sizeof(sHashTableLogEntry) + htAlign((entry)->keyBytes) +                     \
+    htAlign((entry)->valueBytes))
+
+static size_t htLogCheck
 (
-	HashTable ht,
+	sHashTableLogEntry * entry, const void * key, const void * value
+) {
+	size_t check = HashTableWyHash(&entry->operation,
+		sizeof(sHashTableLogEntry) - sizeof(size_t), 0);
+	if (entry->keyBytes) check = HashTableWyHash(key, entry->keyBytes, check);
+	if (entry->valueBytes)
+		check = HashTableWyHash(value, entry->valueBytes, check);
+	return check;
+}
+
+/* a clear has no key and names the shard it emptied instead */
+static void htLogAppend
+(
+	HashTable ht, size_t operation, HyperVariant key, HyperVariant value
+) {
+	HashTableLog log = ht->log;
+	sHashTableLogEntry entry = {
+		0, operation,
+		(key) ? vartype(key) : ht->shardIndex, (key) ? varbytes(key) : 0,
+		(value) ? vartype(value) : 0, (value) ? varbytes(value) : 0
+	};
+	size_t bytes = htLogEntryBytes(&entry);
+	entry.check = htLogCheck(&entry, key, value);
+	pthread_mutex_lock(&log->lock);
+	if (log->used + bytes > log->size) {
+		size_t size = (log->size) ? log->size << 1 : HT_LOG_BATCH << 6;
+		while (size < log->used + bytes) size <<= 1;
+		char * buffer = realloc(log->buffer, size);
+		if (! buffer) {
+			if (! log->error) log->error = HT_ERROR_ALLOCATION_FAILURE;
+			pthread_mutex_unlock(&log->lock);
+			return;
+		}
+		log->buffer = buffer, log->size = size;
+	}
+	char * at = log->buffer + log->used;
+	memset(at, 0, bytes);
+	memcpy(at, &entry, sizeof(entry)), at += sizeof(entry);
+	if (key) memcpy(at, key, entry.keyBytes), at += htAlign(entry.keyBytes);
+	if (value) memcpy(at, value, entry.valueBytes);
+	log->used += bytes;
+	if (++log->pending == log->batch) pthread_cond_signal(&log->wake);
+	pthread_mutex_unlock(&log->lock);
+}
+
+#define htLog(ht, operation, key, value)                                       \
+if (ht->log) htLogAppend(ht, operation, key, value)
+
+/* writes and syncs whatever is waiting; false once anything has failed */
+static bool htLogCommit (HashTableLog log)
+{
+	pthread_mutex_lock(&log->commit);
+	pthread_mutex_lock(&log->lock);
+	char * buffer = log->buffer;
+	size_t used = log->used, size = log->size, written = 0;
+	ssize_t wrote;
+	log->buffer = log->spare, log->size = log->spareSize;
+	log->spare = buffer, log->spareSize = size;
+	log->used = log->pending = 0;
+	pthread_mutex_unlock(&log->lock);
+	while (written < used && ! log->error) {
+		wrote = write(log->descriptor, buffer + written, used - written);
+		if (wrote >= 0) written += wrote;
+		else if (errno != EINTR) log->error = errno;
+	}
+	if (used && ! log->error && fdatasync(log->descriptor))
+		log->error = errno;
+	bool committed = ! log->error;
+	pthread_mutex_unlock(&log->commit);
+	return committed;
+}
+
+static void * htLogThread (void * argument)
+{
+	HashTableLog log = argument;
+	struct timespec deadline;
+	pthread_mutex_lock(&log->lock);
+	while (! log->stopping) {
+		if (log->pending) {
+			pthread_mutex_unlock(&log->lock);
+			htVoidExpression htLogCommit(log);
+			pthread_mutex_lock(&log->lock);
+			if (log->pending >= log->batch) continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += log->latency * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&log->wake, &log->lock, &deadline);
+	}
+	pthread_mutex_unlock(&log->lock);
+	return NULL;
+}
+
+/* commits what is left and lets go of the file */
+static void htCloseLog (HashTableLog log)
+{
+	pthread_mutex_lock(&log->lock);
+	log->stopping = true;
+	pthread_cond_signal(&log->wake);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->thread, NULL);
+	htVoidExpression htLogCommit(log);
+	close(log->descriptor);
+	pthread_cond_destroy(&log->wake);
+	pthread_mutex_destroy(&log->commit);
+	pthread_mutex_destroy(&log->lock);
+	free(log->buffer), free(log->spare), free(log);
+}
+
+/*
+ * Asynchronous subscribers only hear of operations that went ahead as asked,
+ * after any synchronous handler has had its say.
+ */
+htVirtualImmediateFunction (HashTableItem) htAutoFireItemEvent
+(
+	htDoc (does not check) HashTable ht,
+	htDoc (does not check) HashTableItem reference,
+	htDocFires (any registered) HashTableEvent withEvents,
+	htDoc (?:= ht->private) void * private
+) {
+	HashTableItem selection = reference;
+	if (ht->eventHandler) {
+		if (htGetEventMask(ht, withEvents) == withEvents) {
+			selection = ht->eventHandler(
+				ht, withEvents,
+				reference,
+				(private) ? private : ht->private
+			);
+		}
+	}
+	HashTableEventQueue queue = htRead(ht->queue);
+	if (queue && selection == reference && reference &&
+		(queue->events & withEvents) == withEvents) htQueueEvent(
+			queue, withEvents,
+			(ht->parent) ? htShardResult(ht, reference) : reference
+		);
+	return selection;
+}
+
+/*
+ * Every shard reports to this handler, which hands the parent and its
+ * references to the parent's handler. A selection naming another shard's
+ * item cannot be honored from inside this one and counts as a refusal.
+ */
+static HashTableItem htShardEvent
+(
+	void * hashTable,
+	HashTableEvent event,
 	HashTableItem reference,
+	void * private
+) {
+	HashTable shard = hashTable, ht = shard->parent;
+	if (! ht->eventHandler) return reference;
+	HashTableItem selection = ht->eventHandler(
+		ht, event, htShardResult(shard, reference),
+		(private) ? private : ht->private
+	);
+	if (! selection || (selection - 1) % ht->shardCount != shard->shardIndex)
+		return HT_ERROR_SENTINEL;
+	return (selection - 1) / ht->shardCount + 1;
+}
+
+/*
+ * Statistics of a sharded table are sums over its shards, except for the
+ * reference bounds, which must cover the highest interleaved reference.
+ */
+static size_t htShardStatistic
+(
+	HashTable ht, size_t (*statistic)(HashTable), bool sum
+) {
+	size_t index, result = 0, value;
+	for (index = 0; index < ht->shardCount; index++) {
+		value = statistic(ht->shard[index]);
+		if (sum) result += value;
+		else if (value > result) result = value;
+	}
+	return (sum) ? result : result * ht->shardCount;
+}
+
+/* construction and destruction are reported by the parent alone */
+#define htShardEvents(withEvents)                                              \
+((withEvents) & ~(HT_EVENT_CONSTRUCTED | HT_EVENT_DESTRUCTING))
+
+typedef struct sHashTableShardVisit {
+	HashTable parent;
+	size_t shardIndex;
+	HashTableEnumerationHandler handler;
+	HashTableSortHandler sortHandler;
+	void * private;
+	bool stopped;
+} sHashTableShardVisit;
+
+static bool htShardEnumeration
+(
+	void * hashTable,
 	HashTableEnumerateDirection direction,
-	HashTableEnumerationHandler handler,
+	HashTableItem item,
 	void * private
 ) {
-	htReturnVoidIfInvalidReference(ht, reference);
-	htReturnVoidIfNoCallBackHandler(handler);
+	sHashTableShardVisit * visit = private;
+	HashTable ht = visit->parent; /* hashTable is the shard */
+	(void) hashTable;
+	if (visit->handler(
+		ht, direction, htShardReference(ht, visit->shardIndex, item),
+		visit->private
+	)) return true;
+	visit->stopped = true;
+	return false;
+}
 
-	HashTableRecord item = ht->item[reference];
-	size_t maximum = 0, index = 0, recordHash = htRecordHash(item);
-	item = ht->slot[recordHash];
-	while (item) maximum++, item = item->successor;
-	HashTableRecord array[maximum];
-	item = ht->slot[recordHash];
-	while (item) array[index++] = item, item = item->successor;
+static HashTableItem htShardSort
+(
+	void * hashTable,
+	HashTableSortType type,
+	HashTableSortDirection direction,
+	HashTableItem primary,
+	HashTableItem secondary,
+	void * private
+) {
+	sHashTableShardVisit * visit = private;
+	HashTable ht = visit->parent; /* hashTable is the shard */
+	(void) hashTable;
+	HashTableItem selection = visit->sortHandler(
+		ht, type, direction,
+		htShardReference(ht, visit->shardIndex, primary),
+		htShardReference(ht, visit->shardIndex, secondary),
+		visit->private
+	);
+	if (! selection) return HT_ERROR_SENTINEL;
+	htVoidExpression htShardItem(ht, &selection);
+	return selection;
+}
 
-	if (direction == HT_ENUMERATE_FORWARD) {
-		for (index = 0; index < maximum; index++) {
-			item = array[index];
-			if (! (htRecordSettings(item) & HTI_NON_ENUMERABLE)) {
-				if ( ! handler(ht, direction, htRecordReference(item), private))
-					break;
-			}
-		}
-	} else {
-		index = maximum;
-		while (--index) {
-			item = array[index];
-			if (! (htRecordSettings(item) & HTI_NON_ENUMERABLE)) {
-				if ( ! handler(
-					ht, direction, htRecordReference(item), private)
-				) break;
-			}
-		}
-		/* manually enumerate the last item (0) */
-		item = array[0];
-		if (! (htRecordSettings(item) & HTI_NON_ENUMERABLE)) {
-			handler(ht, direction, htRecordReference(item), private);
+HashTableData HashTableUserData
+(
+	size_t valueLength,
+	double value,
+	size_t valueHint
+) {
+	HashTableData result = varcreate(valueLength, value, valueHint);
+	htReturnIfAllocationFailure(result,	{});
+	return result;
+}
+
+void FreeHashTableUserData
+(
+	HashTableData * data
+) {
+	if (! data && ! *data) {
+		errno = HT_ERROR_INVALID_REFERENCE; return;
+	}
+	varfree(*(void**)data);
+	*(void**)data = NULL;
+}
+
+/*
+ * Also the epoch state and the ordered index; nothing may be reading the
+ * table any more.
+ */
+static void htDestroyLocks (HashTable ht)
+{
+	HashTableLocks locks = ht->locks;
+	HashTableEpoch epoch = ht->epoch;
+	size_t index;
+	if (epoch) {
+		for (index = 0; index < 3; index++) htReclaim(ht, epoch->limbo[index]);
+		free(epoch), ht->epoch = NULL;
+	}
+	if (ht->ordered) {
+		if (locks) pthread_rwlock_destroy(&ht->ordered->lock);
+		free(ht->ordered), ht->ordered = NULL;
+	}
+	if (! locks) return;
+	pthread_rwlock_destroy(&locks->table);
+	pthread_mutex_destroy(&locks->items);
+	for (index = 0; index < HT_LOCK_STRIPES; index++)
+		pthread_rwlock_destroy(&locks->stripe[index].lock);
+	free(locks), ht->locks = NULL;
+}
+
+static size_t htRandomSeed (HashTable ht)
+{
+	static size_t sequence;
+	struct { time_t now; clock_t ticks; size_t sequence; void * at; } noise = {
+		time(NULL), clock(), sequence++, &noise
+	};
+	return HashTableWyHash(&noise, sizeof(noise), (size_t) ht);
+}
+
+/* a file whose heap already holds a table brings its own slots and items */
+static void htFileLoad (HashTable ht)
+{
+	sHashTableHeap * heap = ht->file->heap;
+	ht->item = heap->item, ht->itemsUsed = heap->itemsUsed,
+	ht->itemsTotal = heap->itemsTotal, ht->itemsMax = heap->itemsMax,
+	ht->occupied = heap->occupied, ht->released = heap->released,
+	ht->releasedCount = heap->releasedCount,
+	ht->releasedMax = heap->releasedMax,
+	ht->slot = heap->slot, ht->slotCount = heap->slotCount,
+	ht->control = heap->control, ht->slotsDeleted = heap->slotsDeleted,
+	ht->seed = heap->seed,
+	ht->maxLoadFactor = heap->maxLoadFactor,
+	ht->growthFactor = heap->growthFactor,
+	ht->impact = heap->impact;
+}
+
+static HashTable htNewTable
+(
+	size_t size,
+	HashTableOption options,
+	HashTableEvent withEvents,
+	HashTableEventHandler eventHandler,
+	void * private,
+	HashTableFile file
+) {
+
+	/* lock free readers walk chains; they cannot follow probe sequences */
+	if (options & HT_OPTION_LOCK_FREE_READS
+		&& options & HT_OPTION_OPEN_ADDRESSING) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return HT_ERROR_SENTINEL;
+	}
+
+	HashTable ht = calloc(1, HashTableSize);
+	htReturnIfAllocationFailure(ht, {});
+
+	if (!size) size = HT_RESERVE_SLOTS;
+
+	ht->options = options, ht->events = withEvents,
+	ht->hashFunction = (options & HT_OPTION_WYHASH) ? HashTableWyHash :
+		(options & HT_OPTION_INTEGER_HASH) ? HashTableIntegerHash :
+		HashTableJenkinsHash,
+	ht->seed = (options & HT_OPTION_RANDOM_SEED) ? htRandomSeed(ht) : 0,
+	ht->maxLoadFactor = HT_MAX_LOAD_FACTOR,
+	ht->growthFactor = HT_GROWTH_FACTOR,
+	ht->eventHandler = eventHandler,
+	ht->private = private,
+	ht->impact = HashTableSize,
+	ht->file = file;
+
+	if (options & HT_OPTION_ARENA) {
+		ht->arena = calloc(1, sizeof(sHashTableArena));
+		htReturnIfAllocationFailure(ht->arena, free(ht));
+	}
+
+	if (options & HT_OPTION_LOCK_FREE_READS) {
+		ht->epoch = calloc(1, sizeof(sHashTableEpoch));
+		htReturnIfAllocationFailure(ht->epoch, free(ht->arena), free(ht));
+		ht->impact += sizeof(sHashTableEpoch);
+	}
+
+	if (options & (HT_OPTION_CONCURRENT | HT_OPTION_LOCK_FREE_READS)) {
+		ht->locks = calloc(1, sizeof(sHashTableLocks));
+		htReturnIfAllocationFailure(
+			ht->locks, free(ht->epoch), free(ht->arena), free(ht)
+		);
+		size_t stripe;
+		pthread_rwlock_init(&ht->locks->table, NULL);
+		pthread_mutex_init(&ht->locks->items, NULL);
+		for (stripe = 0; stripe < HT_LOCK_STRIPES; stripe++)
+			pthread_rwlock_init(&ht->locks->stripe[stripe].lock, NULL);
+		ht->impact += sizeof(sHashTableLocks);
+	}
+
+	if (options & HT_OPTION_ORDERED_INDEX) {
+		ht->ordered = calloc(1, sizeof(sHashTableOrdered));
+		htReturnIfAllocationFailure(
+			ht->ordered, htDestroyLocks(ht), free(ht->arena), free(ht)
+		);
+		if (ht->locks) pthread_rwlock_init(&ht->ordered->lock, NULL);
+		ht->impact += sizeof(sHashTableOrdered);
+	}
+
+	if (file && file->heap->slot) htFileLoad(ht);
+	else if (htOpenAddressing(ht)) {
+		htReturnIfAllocationFailure(
+			htProbeResize(ht, size), htDestroyLocks(ht), free(ht->arena),
+			free(ht)
+		);
+	} else {
+		ht->slotCount = size,
+		ht->slot = htArrayAllocate(ht, size * sizeof(void*), true);
+		htReturnIfAllocationFailure(
+			ht->slot, htDestroyLocks(ht), free(ht->arena), free(ht)
+		);
+		ht->impact += (sizeof(void*) * (size));
+	}
+
+	htVoidExpression htAutoFireItemEvent(ht, 0, HT_EVENT_CONSTRUCTED, NULL);
+
+	return ht;
+
+}
+
+HashTable NewHashTableWithOptions
+(
+	size_t size,
+	HashTableOption options,
+	HashTableEvent withEvents,
+	HashTableEventHandler eventHandler,
+	void * private
+) {
+	return htNewTable(
+		size, options, withEvents, eventHandler, private, NULL
+	);
+}
+
+HashTable NewHashTable
+(
+	size_t size,
+	HashTableEvent withEvents,
+	HashTableEventHandler eventHandler,
+	void * private
+) {
+	return NewHashTableWithOptions(
+		size, 0, withEvents, eventHandler, private
+	);
+}
+
+void DestroyHashTable (HashTable * ht);
+
+/*
+ * Each shard is a complete table with its own locks; the parent holds no
+ * items and only routes. Shards share the parent's hash function and seed.
+ */
+HashTable NewShardedHashTable
+(
+	size_t shards,
+	size_t size,
+	HashTableOption options,
+	HashTableEvent withEvents,
+	HashTableEventHandler eventHandler,
+	void * private
+) {
+
+	if (! shards) shards = HT_SHARDS;
+	if (size) size = (size + shards - 1) / shards;
+
+	HashTable ht = calloc(1, HashTableSize);
+	htReturnIfAllocationFailure(ht, {});
+
+	ht->shard = calloc(shards, sizeof(HashTable));
+	htReturnIfAllocationFailure(ht->shard, free(ht));
+
+	ht->shardCount = shards,
+	ht->options = options, ht->events = withEvents,
+	ht->hashFunction = (options & HT_OPTION_WYHASH) ? HashTableWyHash :
+		(options & HT_OPTION_INTEGER_HASH) ? HashTableIntegerHash :
+		HashTableJenkinsHash,
+	ht->seed = (options & HT_OPTION_RANDOM_SEED) ? htRandomSeed(ht) : 0,
+	ht->eventHandler = eventHandler,
+	ht->private = private,
+	ht->impact = HashTableSize + shards * sizeof(HashTable);
+
+	if (! (options & HT_OPTION_LOCK_FREE_READS))
+		options |= HT_OPTION_CONCURRENT;
+	options &= ~HT_OPTION_RANDOM_SEED;
+
+	size_t index;
+	for (index = 0; index < shards; index++) {
+		HashTable shard = NewHashTableWithOptions(
+			size, options, htShardEvents(withEvents), htShardEvent, NULL
+		);
+		if (! shard) {
+			while (index--) DestroyHashTable(&ht->shard[index]);
+			free(ht->shard), free(ht);
+			return HT_ERROR_SENTINEL;
+		}
+		shard->parent = ht, shard->shardIndex = index;
+		shard->hashFunction = ht->hashFunction, shard->seed = ht->seed;
+		ht->shard[index] = shard;
+	}
+
+	htVoidExpression htAutoFireItemEvent(ht, 0, HT_EVENT_CONSTRUCTED, NULL);
+
+	return ht;
+
+}
+
+/*
+ * Sets the item index to exactly max entries, which must cover itemsUsed.
+ * Nothing may be reading the table.
+ */
+static bool htResizeItems (HashTable ht, size_t max)
+{
+	size_t words = htOccupancyWords(max),
+		held = htOccupancyWords(ht->itemsMax),
+		kept = (max < ht->itemsMax) ? max : ht->itemsMax;
+	HashTableRecordItems list = htArrayAllocate(ht, max * sizeof(void*), false);
+	uint64_t * occupied = htArrayAllocate(ht, words * sizeof(uint64_t), false);
+	if (! list || ! occupied) {
+		htArrayRelease(ht, list, max * sizeof(void*));
+		htArrayRelease(ht, occupied, words * sizeof(uint64_t));
+		return false;
+	}
+	memcpy(list, ht->item, kept * sizeof(void*));
+	memset(list + kept, 0, (max - kept) * sizeof(void*));
+	if (words < held) held = words;
+	memcpy(occupied, ht->occupied, held * sizeof(uint64_t));
+	memset(occupied + held, 0, (words - held) * sizeof(uint64_t));
+	ht->impact -= ht->itemsMax * sizeof(void*) +
+		htOccupancyWords(ht->itemsMax) * sizeof(uint64_t);
+	ht->impact += max * sizeof(void*) + words * sizeof(uint64_t);
+	htArrayRelease(ht, ht->item, ht->itemsMax * sizeof(void*));
+	htArrayRelease(ht, ht->occupied,
+		htOccupancyWords(ht->itemsMax) * sizeof(uint64_t));
+	ht->item = list, ht->occupied = occupied, ht->itemsMax = max;
+	return true;
+}
+
+/* the first hole at or after index, or itemsUsed */
+static size_t htVacantNext (HashTable ht, size_t index)
+{
+	size_t limit = ht->itemsUsed, word = index >> 6;
+	if (index >= limit) return limit;
+	uint64_t bits = ~ht->occupied[word] & (~(uint64_t) 0 << (index & 63));
+	while (! bits) {
+		if (++word >= htOccupancyWords(limit)) return limit;
+		bits = ~ht->occupied[word];
+	}
+	index = (word << 6) + __builtin_ctzll(bits);
+	return (index < limit) ? index : limit;
+}
+
+/*
+ * Items slide down over the holes in one pass, keeping their order, and
+ * take the references of where they land. Chains are rebuilt by prepending.
+ */
+void OptimizeHashTable
+(
+	HashTable ht,
+	size_t slots,
+	size_t references
+) {
+	htReturnVoidIfTableUninitialized(ht);
+	if (ht->shard) {
+		size_t index, count = ht->shardCount;
+		for (index = 0; index < count; index++) OptimizeHashTable(
+			ht->shard[index], (slots + count - 1) / count,
+			(references + count - 1) / count
+		);
+		return;
+	}
+	htExclusiveScope(ht);
+	/* references held by lock free readers or snapshots would change meaning */
+	if (ht->epoch || ht->view) { htReturnVoidUnsupportedFunction(); }
+
+	htRehashComplete(ht);
+	htFlushHits(ht);
+	htFileChanging(ht);
+
+	size_t source, dest = 0;
+	HashTableRecord record;
+	for (source = 0; source < ht->itemsUsed; source++) {
+		if (! (record = ht->item[source])) continue;
+		if (source != dest) {
+			ht->item[source] = NULL, ht->item[dest] = record;
+			htVacate(ht, source), htOccupy(ht, dest);
+			htRecordReference(record) = dest + 1;
+		}
+		dest++;
+	}
+	ht->itemsUsed = dest, ht->releasedCount = 0;
+
+	/* adjust padding */
+	if (references) {
+		bool resized = htResizeItems(ht, dest + references);
+		htReturnVoidIfAllocationFailure(resized, {});
+	}
+
+	if (slots && htOpenAddressing(ht)) {
+		htVoidExpression htProbeResize(ht, slots);
+	} else if (slots) {
+		HashTableRecordList list = htArrayAllocate(
+			ht, slots * sizeof(void*), true
+		);
+		htReturnVoidIfAllocationFailure(list, {});
+		htArrayRelease(ht, ht->slot, ht->slotCount * sizeof(void*));
+		ht->impact -= ht->slotCount * sizeof(void*);
+		ht->impact += slots * sizeof(void*);
+		ht->slot = list, ht->slotCount = slots;
+		htVoidExpression htRelinkAll(ht);
+	}
+
+}
+
+/*
+ * Moves up to references of the highest items into the lowest holes, so
+ * the work can be spread over idle moments. Moved items take the reference
+ * of their hole. Returns the holes still left below itemsUsed, or
+ * (size_t) -1 with errno set where references others still hold cannot
+ * move: on lock free tables and on snapshots and the tables under them.
+ */
+size_t CompactHashTable
+(
+	HashTable ht,
+	size_t references
+) {
+	htReturnIfTableUninitialized(ht);
+	if (ht->shard) {
+		size_t index, count = ht->shardCount, holes = 0, left;
+		for (index = 0; index < count; index++) {
+			left = CompactHashTable(
+				ht->shard[index], (references + count - 1) / count
+			);
+			if (left == (size_t) -1) return left;
+			holes += left;
+		}
+		return holes;
+	}
+	htExclusiveScope(ht);
+	if (ht->epoch || ht->view || htViewing(ht)) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return (size_t) -1;
+	}
+
+	htFlushHits(ht);
+	htFileChanging(ht);
+
+	size_t hole, scan = 0, last, vacant;
+	HashTableRecord record;
+	while (references-- && ht->itemsUsed > ht->itemsTotal) {
+		last = ht->itemsUsed - 1;
+		if (! (record = ht->item[last])) { ht->itemsUsed--; continue; }
+		/* released holes come cheaper than searching the bitmap */
+		vacant = htReleasedReference(ht);
+		if (vacant < last) hole = vacant;
+		else if ((hole = scan = htVacantNext(ht, scan)) >= last) break;
+		ht->item[hole] = record, ht->item[last] = NULL;
+		htOccupy(ht, hole), htVacate(ht, last);
+		htRecordReference(record) = hole + 1;
+		ht->itemsUsed--;
+	}
+
+	return ht->itemsUsed - ht->itemsTotal;
+}
+
+static bool htFileSync (HashTable ht);
+static void htFileClose (HashTableFile file);
+static void htCloseView (HashTableView view);
+
+void DestroyHashTable
+(
+	HashTable * ht
+) {
+	htReturnVoidIfTableUninitialized((ht)?*ht:0);
+	/* the snapshot handle still reads records the table owns */
+	if ((*ht)->view) { htReturnVoidUnsupportedFunction(); }
+
+	htVoidExpression htAutoFireItemEvent(*ht, 0, HT_EVENT_DESTRUCTING, NULL);
+
+	HashTable xt = *ht;
+	*ht = NULL;
+
+	if (htViewing(xt)) htCloseView(xt->viewing);
+	if (xt->queue && ! xt->parent) htCloseEventQueue(xt->queue);
+	if (xt->log && ! xt->parent) htCloseLog(xt->log);
+
+	if (xt->shard) {
+		size_t index;
+		for (index = 0; index < xt->shardCount; index++)
+			DestroyHashTable(&xt->shard[index]);
+		free(xt->shard), free(xt);
+		return;
+	}
+
+	/* retired memory goes back while the arena is still there */
+	htDestroyLocks(xt);
+	htFlushHits(xt);
+
+	if (xt->file) { /* everything else stays in the file */
+		/* a failed sync leaves the file dirty: errno says so */
+		int error = (htFileSync(xt)) ? 0 : errno;
+		htFileClose(xt->file);
+		free(xt->hitCounter), free(xt);
+		if (error) errno = error;
+		return;
+	}
+
+	size_t item = 0, length = xt->itemsMax; HashTableRecord target = NULL;
+	if (xt->arena) { /* the slabs go back in one sweep */
+		if (xt->adopted) for (item = 0; item < length; item++)
+			if ((target = xt->item[item])) htReleaseAdopted(xt, target);
+		htArenaReset(xt->arena, true);
+		free(xt->arena);
+	} else for (item = 0; item < length; item++) {
+		target = xt->item[item];
+		if (target) {
+			htFreeRecord(xt, target);
+		}
+	}
+	free(xt->hitCounter), free(xt->occupied);
+	if (xt->snapshot) munmap(xt->snapshot, xt->snapshotBytes);
+	free(xt->item), free(xt->released);
+	free(xt->slot), free(xt->rehashSlot), free(xt->control);
+	free(xt);
+	return;
+}
+
+void HashTableClear
+(
+	HashTable ht
+) {
+	htReturnVoidIfTableUninitialized(ht);
+	if (ht->shard) {
+		size_t index;
+		for (index = 0; index < ht->shardCount; index++)
+			HashTableClear(ht->shard[index]);
+		return;
+	}
+	htExclusiveScope(ht);
+	/* every record would have to be handed to the snapshot */
+	if (ht->view) { htReturnVoidUnsupportedFunction(); }
+	htFlushHits(ht);
+	htFileChanging(ht);
+	htLog(ht, HT_LOG_CLEAR, NULL, NULL);
+
+	if (ht->ordered) {
+		htOrderedScope(ht, true);
+		ht->ordered->levels = 0, ht->ordered->tail = NULL;
+		memset(ht->ordered->head, 0, sizeof(ht->ordered->head));
+	}
+
+	size_t item = 0, length = ht->itemsMax; HashTableRecord target = NULL;
+	/* lock free readers must not be able to reach what gets retired */
+	if (ht->epoch) for (item = 0; item < ht->slotCount; item++)
+		htPublish(ht->slot[item], NULL);
+	for (item = 0; item < length; item++) {
+		target = ht->item[item];
+		if (target) {
+			ht->impact -= htRecordImpact(target);
+			htVacate(ht, item);
+			htPublish(ht->item[item], NULL);
+			if (ht->epoch) htRetireRecord(ht, target);
+			else if (! ht->arena) htFreeRecord(ht, target);
+			else if (ht->adopted) htReleaseAdopted(ht, target);
+		}
+	}
+	if (ht->arena && ! ht->epoch) htArenaReset(ht->arena, false);
+
+	if (ht->rehashSlot) {
+		htArrayRelease(ht, ht->rehashSlot, ht->rehashSlotCount * sizeof(void*));
+		ht->impact -= ht->rehashSlotCount * sizeof(void*);
+		ht->rehashSlot = NULL, ht->rehashSlotCount = ht->rehashIndex = 0;
+	}
+	if (! ht->epoch) memset(ht->slot, 0, ht->slotCount * sizeof(void*));
+	if (htOpenAddressing(ht)) {
+		memset(ht->control, HT_PROBE_EMPTY, ht->slotCount);
+		ht->slotsDeleted = 0;
+	}
+	ht->itemsUsed = ht->itemsTotal = ht->releasedCount = 0;
+}
+
+/* stores every record's hash under the table's current function and seed */
+static void htRehashRecords (HashTable ht)
+{
+	size_t index = ht->itemsUsed;
+	HashTableRecord record;
+	while (index--) if ((record = ht->item[index]))
+		htRecordHash(record) = htCreateHash(ht, htRecordKeyLength(record),
+			record->key);
+}
+
+bool HashTableSetHashFunction
+(
+	HashTable ht,
+	HashTableHashFunction function,
+	size_t seed
+) {
+	htReturnIfTableUninitialized(ht);
+	/* rehashing would move items between shards and change references */
+	if (ht->shard) {
+		size_t index;
+		for (index = 0; index < ht->shardCount; index++)
+			if (ht->shard[index]->itemsTotal) {
+				errno = HT_ERROR_UNSUPPORTED_FUNCTION; return false;
+			}
+		ht->hashFunction = (function) ? function : HashTableJenkinsHash;
+		ht->seed = seed;
+		for (index = 0; index < ht->shardCount; index++)
+			HashTableSetHashFunction(ht->shard[index], function, seed);
+		return true;
+	}
+	htExclusiveScope(ht);
+	/* lock free readers may be hashing with the current function */
+	if (ht->epoch && ht->itemsTotal) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return false;
+	}
+	/* a file can only name a built in function */
+	if (ht->file && function) {
+		size_t hash = 0;
+		while (hash < htSnapshotHashes && htSnapshotHash[hash] != function)
+			hash++;
+		if (hash == htSnapshotHashes) {
+			errno = HT_ERROR_UNSUPPORTED_FUNCTION; return false;
+		}
+	}
+	HashTableHashFunction previous = ht->hashFunction;
+	size_t previousSeed = ht->seed;
+	ht->hashFunction = (function) ? function : HashTableJenkinsHash;
+	ht->seed = seed;
+	htRehashRecords(ht);
+	if (htRelinkAll(ht)) return true;
+	/* the old slots still stand: give them back the hashes they hold */
+	ht->hashFunction = previous, ht->seed = previousSeed;
+	htRehashRecords(ht);
+	errno = HT_ERROR_ALLOCATION_FAILURE; return false;
+}
+
+bool HashTableSetGrowthPolicy
+(
+	HashTable ht,
+	double maxLoadFactor,
+	double growthFactor
+) {
+	htReturnIfTableUninitialized(ht);
+	htExclusiveScope(ht);
+	if (maxLoadFactor < 0 || (maxLoadFactor > 0 && growthFactor <= 1.0)) {
+		errno = HT_ERROR_INVALID_TYPE_REQUEST; return false;
+	}
+	size_t index;
+	for (index = 0; index < ht->shardCount; index++)
+		HashTableSetGrowthPolicy(ht->shard[index], maxLoadFactor, growthFactor);
+	ht->maxLoadFactor = maxLoadFactor, ht->growthFactor = growthFactor;
+	return true;
+}
+
+/* lock free tables count exactly whatever is asked, since readers never do */
+bool HashTableSetHitCounting
+(
+	HashTable ht,
+	HashTableHitCounting counting
+) {
+	htReturnIfTableUninitialized(ht);
+	if (counting != HT_HITS_EXACT && counting != HT_HITS_OFF &&
+		counting != HT_HITS_SAMPLED && counting != HT_HITS_PER_THREAD) {
+		errno = HT_ERROR_INVALID_TYPE_REQUEST; return false;
+	}
+	htExclusiveScope(ht);
+	size_t index;
+	for (index = 0; index < ht->shardCount; index++)
+		HashTableSetHitCounting(ht->shard[index], counting);
+	if (ht->shard) { ht->hitCounting = counting; return true; }
+	htFlushHits(ht);
+	if (counting == HT_HITS_PER_THREAD && ! ht->hitCounter) {
+		ht->hitCounter = calloc(HT_HIT_THREADS, sizeof(size_t *));
+		htReturnIfAllocationFailure(ht->hitCounter, {});
+		ht->impact += HT_HIT_THREADS * sizeof(size_t *);
+	} else if (counting != HT_HITS_PER_THREAD && ht->hitCounter) {
+		free(ht->hitCounter), ht->hitCounter = NULL;
+		ht->impact -= HT_HIT_THREADS * sizeof(size_t *);
+	}
+	ht->hitCounting = counting;
+	return true;
+}
+
+/*
+ * On HT_OPTION_LOCK_FREE_READS tables, data and keys handed out between
+ * these two calls stay readable even if a writer replaces or deletes them.
+ */
+size_t HashTableReadBegin
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	if (! ht->epoch) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return HT_ERROR_SENTINEL;
+	}
+	size_t * active = htEpochEnter(ht->epoch), reader = ((char *) active
+		- (char *) ht->epoch->reader) / sizeof(uHashTableReaders);
+	return reader * 3 + (active - ht->epoch->reader[reader].active) + 1;
+}
+
+bool HashTableReadEnd
+(
+	HashTable ht,
+	size_t ticket
+) {
+	htReturnIfTableUninitialized(ht);
+	if (! ht->epoch) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return false;
+	}
+	if (! ticket || ticket > HT_EPOCH_READERS * 3) {
+		errno = HT_ERROR_INVALID_REFERENCE; return false;
+	}
+	ticket--;
+	htEpochLeave(&ht->epoch->reader[ticket / 3].active[ticket % 3]);
+	return true;
+}
+
+void HashTableRegisterEvents
+(
+	HashTable ht,
+	HashTableEvent withEvents,
+	HashTableEventHandler eventHandler
+) {
+	htReturnVoidIfTableUninitialized(ht);
+	htExclusiveScope(ht);
+	ht->events = withEvents;
+	if ( eventHandler ) ht->eventHandler = eventHandler;
+	size_t index;
+	for (index = 0; index < ht->shardCount; index++) HashTableRegisterEvents(
+		ht->shard[index], htShardEvents(withEvents), NULL
+	);
+}
+
+bool HashTableRegisterAsyncEvents
+(
+	HashTable ht,
+	HashTableEvent withEvents,
+	HashTableEventBatchHandler batchHandler,
+	size_t capacity,
+	HashTableEventDelivery delivery
+) {
+	htReturnIfTableUninitialized(ht);
+	HashTableEventQueue queue = NULL, previous = ht->queue;
+	if (htAsyncEvents(withEvents)) {
+		htReturnIfNoCallBackHandler(batchHandler);
+		queue = htCreateEventQueue(ht, withEvents, batchHandler, capacity,
+			(delivery & HT_DELIVER_ON_THREAD) ? true : false
+		);
+		if (! queue) return false;
+	}
+	htSetEventQueue(ht, queue);
+	if (previous) htCloseEventQueue(previous);
+	return true;
+}
+
+size_t HashTableDeliverEvents
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	HashTableEventQueue queue = htRead(ht->queue);
+	if (! queue) return 0;
+	pthread_mutex_lock(&queue->deliver);
+	size_t delivered = htDeliverEvents(queue);
+	pthread_mutex_unlock(&queue->deliver);
+	return delivered;
+}
+
+size_t HashTableItemsUsed
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	if (ht->shard) return htShardStatistic(ht, HashTableItemsUsed, false);
+	if (htViewing(ht)) return ht->viewing->itemsUsed;
+	return ht->itemsUsed;
+}
+
+size_t HashTableItemsTotal
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	if (ht->shard) return htShardStatistic(ht, HashTableItemsTotal, true);
+	if (htViewing(ht)) return ht->viewing->itemsTotal;
+	return ht->itemsTotal;
+}
+
+size_t HashTableItemsMax
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	if (ht->shard) return htShardStatistic(ht, HashTableItemsMax, false);
+	/* a snapshot's references are the table's */
+	if (htViewing(ht)) return HashTableItemsMax(ht->viewing->table);
+	return ht->itemsMax;
+}
+
+size_t HashTableSlotCount
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	if (ht->shard) return htShardStatistic(ht, HashTableSlotCount, true);
+	if (htViewing(ht)) return HashTableSlotCount(ht->viewing->table);
+	return ht->slotCount;
+}
+
+size_t HashTableSlotsUsed
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	if (ht->shard) return htShardStatistic(ht, HashTableSlotsUsed, true);
+	if (htViewing(ht)) return HashTableSlotsUsed(ht->viewing->table);
+	htSharedScope(ht);
+	size_t used = 0, index, max = htRead(ht->slotCount);
+	HashTableRecordList slot = htRead(ht->slot);
+	for (index = 0; index < max; index++) if (htRead(slot[index])) used++;
+	max = ht->rehashSlotCount;
+	for (index = ht->rehashIndex; index < max; index++)
+		if (ht->rehashSlot[index]) used++;
+	return used;
+}
+
+double HashTableLoadFactor
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	volatile double factor = (ht->shard || htViewing(ht)) ?
+		((double)HashTableItemsTotal(ht))/((double)HashTableSlotCount(ht)) :
+		(((double)ht->itemsTotal)/((double)ht->slotCount));
+	return htDblInfinity(factor) ? 0 : factor;
+}
+
+size_t HashTableImpact
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	if (ht->shard)
+		return ht->impact + htShardStatistic(ht, HashTableImpact, true);
+	return ht->impact;
+}
+
+/* the selection for a record found by a lookup, firing its event if any */
+static HashTableItem htGetFound
+(
+	HashTable ht,
+	HashTableRecord item,
+	HashTableEvent event
+) {
+
+	if (! event) return htRecordReference(item);
+
+	HashTableItem
+		currentSelection = htRecordReference(item),
+		selection = htAutoFireItemEvent(
+				ht, currentSelection, event, htRead(item->value)
+		)
+	;
+
+	/* lock free readers never write to the table */
+	if (selection == currentSelection && ! ht->epoch) htCountHit(ht, item);
+
+	return selection;
+
+}
+
+/*
+ * Lookups with an optional precomputed hash; sharded tables hash once to
+ * route and hand the hash on. Without one the hash is taken under the
+ * table lock, where the hash function cannot change. Only HT_EVENT_GET
+ * lookups fire events and count hits.
+ */
+static HashTableItem htGet
+(
+	HashTable ht,
+	size_t hash,
+	bool hashed,
+	size_t keyLength,
+	void * realKey,
+	HashTableEvent event
+) {
+
+	/* a snapshot hashes with the live table's function */
+	if (htViewing(ht)) return htViewGet(ht, keyLength, realKey, event);
+
+	htSharedScope(ht);
+	if (! hashed) hash = htCreateHash(ht, keyLength, realKey);
+	htStripeScope(ht, hash, false);
+	HashTableRecord item = htLookup(ht, hash, keyLength, realKey);
+
+	if (! item) {
+		if (event) errno = HT_ERROR_INVALID_REFERENCE;
+		return HT_ERROR_SENTINEL;
+	}
+
+	return htGetFound(ht, item, event);
+
+}
+
+/* as htGet, for the shard owning the key */
+static HashTableItem htShardGet
+(
+	HashTable ht,
+	size_t keyLength,
+	void * realKey,
+	HashTableEvent event
+) {
+	size_t hash = htCreateHash(ht, keyLength, realKey);
+	HashTable shard = htShardFor(ht, hash);
+	return htShardResult(shard,
+		htGet(shard, hash, true, keyLength, realKey, event)
+	);
+}
+
+HashTableItem HashTableHasKey
+(
+	HashTable ht,
+	size_t keyLength,
+	double key,
+	HashTableDataFlags hint
+) {
+	htReturnIfTableUninitialized(ht);
+	char * realKey = htRealKeyOrReturn(keyLength, key, hint);
+
+	if (ht->shard) return htShardGet(ht, keyLength, realKey, 0);
+	return htGet(ht, 0, false, keyLength, realKey, 0);
+}
+
+bool HashTableHasItem
+(
+	HashTable ht,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableHasItem);
+	if (htViewing(ht)) return htViewItem(ht, reference) != NULL;
+	htSharedScope(ht);
+	if ( ! (reference) || htRead(ht->itemsMax) <= --reference) return false;
+	return (htItem(ht, reference)) ? true : false;
+}
+
+size_t HashTableItemDistribution
+(
+	HashTable ht,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableItemDistribution);
+	htSharedScope(ht);
+	htReturnIfInvalidRecord(ht, reference, child);
+	size_t distribution = 0;
+	if (htOpenAddressing(ht)) { /* probe groups inspected to reach the item */
+		htVoidExpression htProbeFind(
+			ht, htRecordHash(child), htRecordKeyLength(child), child->key,
+			&distribution
+		);
+		return distribution;
+	}
+	child = *htRecordBucket(ht, child);
+	while (child) distribution++, child = child->successor;
+	return distribution;
+}
+
+size_t HashTableItemHits
+(
+	HashTable ht,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableItemHits);
+	htSharedScope(ht);
+	htReturnIfInvalidRecord(ht, reference, record);
+	size_t hits = __atomic_load_n(&record->hitCount, __ATOMIC_RELAXED),
+		slot, * counter;
+	if (ht->hitCounter) for (slot = 0; slot < HT_HIT_THREADS; slot++)
+		if ((counter = htRead(ht->hitCounter[slot])))
+			hits += __atomic_load_n(counter + reference - 1, __ATOMIC_RELAXED);
+	return hits;
+}
+
+size_t HashTableItemImpact
+(
+	HashTable ht,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableItemImpact);
+	htSharedScope(ht);
+	htReturnIfInvalidRecord(ht, reference, record);
+	htStripeScope(ht, htRecordHash(record), false);
+	return htRecordImpact(record);
+}
+
+bool HashTablePutPrivate
+(
+	HashTable ht,
+	void * private
+) {
+	htReturnIfTableUninitialized(ht);
+	htExclusiveScope(ht);
+	ht->private = private; return true;
+}
+
+void * HashTableGetPrivate
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	return ht->private;
+}
+
+/* the body of HashTablePut once the key is known and the table has room */
+static HashTableItem htPut
+(
+	HashTable ht,
+	size_t hash,
+	size_t keyLength,
+	char * realKey,
+	double key,
+	HashTableDataFlags keyHint,
+	size_t valueLength,
+	double value,
+	HashTableDataFlags valueHint
+) {
+
+	HashTableRecord current = htLookup(ht, hash, keyLength, realKey);
+
+	if ( current ) {
+
+		if (htRecordSettings(current) & HTI_NON_WRITABLE) {
+			htDiscardAdopted(ht, value, valueHint);
+			errno = HT_ERROR_NOT_WRITABLE_ITEM; return HT_ERROR_SENTINEL;
+		}
+
+		/* with no handler to see the value first, it goes straight in */
+		if (! (ht->eventHandler && htGetEventMask(ht, HT_EVENT_PUT))
+			&& htRecordWriteValue(ht, &current, valueLength, value, valueHint)
+		) {
+			htLog(ht, HT_LOG_PUT, current->key, current->value);
+			htCountHit(ht, current);
+			return htRecordReference(current);
+		}
+
+		HyperVariant varValue = (valueHint & htAdoptedHint) ? ptrval(value) :
+			htVarCreate(ht, valueLength, value, valueHint);
+		htReturnIfAllocationFailure(varValue, {});
+
+		HashTableItem
+			currentSelection = htRecordReference(current),
+			/* There is already a pair for this key; Update Value? */
+			selection = htAutoFireItemEvent(
+				ht, currentSelection, HT_EVENT_PUT, varValue
+			)
+		;
+
+		if (! selection) goto discardNewRecord;
+
+		if (selection == currentSelection) {
+			htReturnIfAllocationFailure(
+				current = htThaw(ht, current), htVarFree(ht, varValue)
+			);
+			htRecordSetValue(ht, current, varValue);
+			htLog(ht, HT_LOG_PUT, current->key, current->value);
+			htCountHit(ht, current);
+			return selection;
+		}
+
+		discardNewRecord:
+			htVarFree(ht, varValue);
+
+		return selection;
+
+	}
+
+	HashTableRecord thisRecord = htCreateRecord(
+		ht,
+		keyLength, realKey, key, keyHint,
+		valueLength, value, valueHint
+	);
+
+	if (thisRecord) {
+
+		htRecordHash(thisRecord) = hash;
+
+		HashTableItem
+			currentSelection = htRecordReference(thisRecord),
+			selection = htAutoFireItemEvent(
+				ht, currentSelection, HT_EVENT_PUT, thisRecord->value
+			)
+		;
+
+		if (selection == currentSelection) {
+			htLink(ht, thisRecord);
+			if (ht->ordered) htOrderedInsert(ht, thisRecord);
+			htLog(ht, HT_LOG_PUT, thisRecord->key, thisRecord->value);
+			return currentSelection;
+		}
+
+		discardThisRecord:
+			htLockItems(ht);
+			htVacate(ht, currentSelection - 1);
+			htPublish(ht->item[currentSelection - 1], NULL);
+			htReleaseReference(ht, currentSelection - 1, true);
+			htUnlockItems(ht);
+			htSubtract(ht, ht->itemsTotal, 1);
+			htSubtract(ht, ht->impact, htRecordImpact(thisRecord));
+			htDisposeRecord(ht, thisRecord);
+
+		return selection;
+
+	}
+
+	/* EAGAIN is retried with the same value */
+	if (errno != EAGAIN) htDiscardAdopted(ht, value, valueHint);
+
+	return HT_ERROR_SENTINEL;
+
+}
+
+/*
+ * Chained concurrent tables insert under the shared table lock and the
+ * key's stripe; only growing the slots or the item index takes the table
+ * exclusively, after which the put is retried. Lock free tables have a
+ * single writer at a time.
+ */
+static HashTableItem htConcurrentPut
+(
+	HashTable ht,
+	size_t hash,
+	bool hashed,
+	size_t keyLength,
+	char * realKey,
+	double key,
+	HashTableDataFlags keyHint,
+	size_t valueLength,
+	double value,
+	HashTableDataFlags valueHint
+) {
+
+	bool exclusive =
+		htOpenAddressing(ht) || ht->epoch || htOwnsTable(ht->locks);
+	int oldError = errno;
+
+	for (;;) {
+		htLockScope(htTableScope, htLockTable(ht, exclusive));
+		if (exclusive) {
+			htReturnIfAllocationFailure(
+				htAutoGrow(ht) && htReserveItems(ht, ht->itemsUsed + 1),
+				htDiscardAdopted(ht, value, valueHint)
+			);
+		} else if (htGrowthDue(ht)) {
+			exclusive = true;
+			continue;
+		}
+		if (! hashed) hash = htCreateHash(ht, keyLength, realKey);
+		htStripeScope(ht, hash, true);
+		/* only a fresh EAGAIN from htCreateRecord means try again */
+		errno = 0;
+		HashTableItem selection = htPut(
+			ht, hash, keyLength, realKey, key, keyHint,
+			valueLength, value, valueHint
+		);
+		if (selection || errno != EAGAIN) {
+			if (! errno) errno = oldError;
+			return selection;
+		}
+		exclusive = true;
+	}
+
+}
+
+/* every put once the key is decoded, with an optional precomputed hash */
+static HashTableItem htPutKey
+(
+	HashTable ht,
+	size_t hash,
+	bool hashed,
+	size_t keyLength,
+	char * realKey,
+	double key,
+	HashTableDataFlags keyHint,
+	size_t valueLength,
+	double value,
+	HashTableDataFlags valueHint
+) {
+
+	if (htViewing(ht)) {
+		htDiscardAdopted(ht, value, valueHint);
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return HT_ERROR_SENTINEL;
+	}
+
+	if (!valueLength) {
+		if (valueHint & HTI_UTF8) valueLength = strlen(ptrval(value));
+	}
+
+	if (ht->shard) {
+		if (! hashed) hash = htCreateHash(ht, keyLength, realKey);
+		HashTable shard = htShardFor(ht, hash);
+		return htShardResult(shard, htConcurrentPut(
+			shard, hash, true, keyLength, realKey, key, keyHint,
+			valueLength, value, valueHint
+		));
+	}
+
+	if (ht->locks) return htConcurrentPut(
+		ht, hash, hashed, keyLength, realKey, key, keyHint,
+		valueLength, value, valueHint
+	);
+
+	htReturnIfAllocationFailure(
+		htAutoGrow(ht), htDiscardAdopted(ht, value, valueHint)
+	);
+
+	if (! hashed) hash = htCreateHash(ht, keyLength, realKey);
+
+	return htPut(
+		ht, hash, keyLength, realKey, key, keyHint,
+		valueLength, value, valueHint
+	);
+
+}
+
+HashTableItem HashTablePut
+(
+	HashTable ht,
+	size_t keyLength,
+	double key,
+	HashTableDataFlags keyHint,
+	size_t valueLength,
+	double value,
+	HashTableDataFlags valueHint
+) {
+
+	htReturnIfTableUninitialized(ht);
+
+	char * realKey = htRealKeyOrReturn(keyLength, key, keyHint);
+
+	return htPutKey(
+		ht, 0, false, keyLength, realKey, key, keyHint,
+		valueLength, value, valueHint
+	);
+
+}
+
+HashTableItem HashTablePutItemByKey
+(
+	HashTable ht,
+	HashTableData realKey,
+	size_t valueLength,
+	double value,
+	HashTableDataFlags valueHint
+) {
+
+	if (! realKey) {
+		errno = HT_ERROR_ZERO_LENGTH_KEY; return HT_ERROR_SENTINEL;
+	}
+
+	return HashTablePut(ht,
+		varlength(realKey), (double)(size_t)realKey, vartype(realKey),
+		valueLength, value, valueHint
+	);
+
+}
+
+HashTableItem HashTablePutItemByKeyData
+(
+	HashTable ht,
+	HashTableData realKey,
+	HashTableData realData
+) {
+
+	if (! realKey) {
+		errno = HT_ERROR_ZERO_LENGTH_KEY; return HT_ERROR_SENTINEL;
+	}
+
+	if (! realData) {
+			errno = HT_ERROR_INVALID_REFERENCE; return HT_ERROR_SENTINEL;
+	}
+
+	return HashTablePut(ht,
+		varlength(realKey), (double)(size_t)realKey, vartype(realKey),
+		varlength(realData), (double)(size_t)realData, vartype(realData)
+	);
+
+}
+
+/* the releaser for HashTableUserData buffers */
+static void htFreeUserData (HashTableData data)
+{
+	free(varhead((char *) data));
+}
+
+/*
+ * Stores data, made by HashTableUserData or laid out the same way, as the
+ * value without copying it. The table owns data from here on, whether or not
+ * the put succeeds, and hands it to releaser (free for NULL) when the value
+ * is replaced, deleted or destroyed.
+ */
+HashTableItem HashTablePutData
+(
+	HashTable ht,
+	size_t keyLength,
+	double key,
+	HashTableDataFlags keyHint,
+	HashTableData data,
+	HashTableReleaser releaser
+) {
+
+	if (! data) {
+		errno = HT_ERROR_INVALID_REFERENCE; return HT_ERROR_SENTINEL;
+	}
+
+	HyperVariant var = (HyperVariant) data;
+	varprvt(var) = (void *) ((releaser) ? releaser : htFreeUserData);
+
+	if (! keyLength && (keyHint & HTI_UTF8)) keyLength = strlen(ptrval(key));
+	if (! ht || ! keyLength) {
+		htVarFree(ht, var);
+		errno = (ht) ? HT_ERROR_ZERO_LENGTH_KEY : HT_ERROR_TABLE_UNINITIALIZED;
+		return HT_ERROR_SENTINEL;
+	}
+
+	/* the data would not outlive the process with the rest of a file table */
+	if (ht->file) {
+		htVarFree(ht, var);
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return HT_ERROR_SENTINEL;
+	}
+
+	htAdopting(ht);
+
+	return HashTablePut(
+		ht, keyLength, key, keyHint, 0, dblval(var), htAdoptedHint
+	);
+
+}
+
+/*
+ * Bulk loading sizes the slots and the item index for the whole input once,
+ * hashes every key before taking the table, and links each new record by
+ * prepending it to its chain. Unique input skips the duplicate lookup. No
+ * HT_EVENT_PUT fires; duplicates update the value as a put would.
+ */
+typedef struct sHashTableBulkKey {
+	size_t hash;
+	size_t keyLength;
+} sHashTableBulkKey;
+
+typedef struct sHashTableBulkJob {
+	HashTable ht;
+	double * key;
+	HashTableDataFlags hint;
+	sHashTableBulkKey * entry;
+	size_t first;
+	size_t last;
+} sHashTableBulkJob;
+
+#define htBulkRealKey(key, hint)                                               \
+(((hint) & HTI_DOUBLE) ? (void *) &(key) : ptrval(key))
+
+static void * htBulkHash (void * private)
+{
+	sHashTableBulkJob * job = private;
+	size_t index;
+	for (index = job->first; index < job->last; index++) {
+		sHashTableBulkKey * entry = job->entry + index;
+		void * realKey = htBulkRealKey(job->key[index], job->hint);
+		if (! entry->keyLength && (job->hint & HTI_UTF8))
+			entry->keyLength = strlen(realKey);
+		if (entry->keyLength) entry->hash =
+			htCreateHash(job->ht, entry->keyLength, realKey);
+	}
+	return NULL;
+}
+
+/* zero key lengths mark the keys that cannot be loaded */
+static sHashTableBulkKey * htBulkHashKeys
+(
+	HashTable ht,
+	size_t count,
+	size_t keyLength[],
+	double key[],
+	HashTableDataFlags hint
+) {
+
+	sHashTableBulkKey * entry = malloc(count * sizeof(sHashTableBulkKey));
+	htReturnIfAllocationFailure(entry, {});
+
+	size_t index, threads = count / HT_BULK_MINIMUM;
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	if (processors > 0 && threads > (size_t) processors) threads = processors;
+	if (threads > HT_BULK_THREADS) threads = HT_BULK_THREADS;
+	if (! threads) threads = 1;
+
+	for (index = 0; index < count; index++)
+		entry[index].keyLength = (keyLength) ? keyLength[index] : 0;
+
+	sHashTableBulkJob job[HT_BULK_THREADS];
+	pthread_t thread[HT_BULK_THREADS];
+	bool started[HT_BULK_THREADS];
+
+	for (index = 0; index < threads; index++) {
+		job[index] = (sHashTableBulkJob) {
+			ht, key, hint, entry,
+			count * index / threads, count * (index + 1) / threads
+		};
+		/* the calling thread takes the first share, and any that fail */
+		started[index] = index && ! pthread_create(
+			thread + index, NULL, htBulkHash, job + index
+		);
+	}
+	for (index = 0; index < threads; index++)
+		if (! started[index]) htBulkHash(job + index);
+	for (index = 0; index < threads; index++)
+		if (started[index]) pthread_join(thread[index], NULL);
+
+	return entry;
+
+}
+
+/* room for count more items without growing; no rehash is left running */
+static bool htBulkReserve (HashTable ht, size_t count)
+{
+	size_t total = ht->itemsTotal + count;
+	if (! htReserveItems(ht, ht->itemsUsed + count)) return false;
+	if (htOpenAddressing(ht)) {
+		size_t slots = ht->slotCount;
+		if (total + ht->slotsDeleted < htProbeMaxLoad(ht, slots)) return true;
+		while (htProbeMaxLoad(ht, slots) <= total) slots <<= 1;
+		return htProbeResize(ht, slots);
+	}
+	bool reserved = true;
+	htRehashComplete(ht);
+	if (ht->maxLoadFactor > 0) {
+		size_t slots = (size_t)(total / ht->maxLoadFactor) + 1;
+		if (slots > ht->slotCount && (reserved = htRehashBegin(ht, slots)))
+			htRehashComplete(ht);
+	}
+	return reserved;
+}
+
+/* loads the keys at position[0..count), or the first count without one */
+static size_t htBulkLoad
+(
+	HashTable ht,
+	size_t count,
+	size_t * position,
+	sHashTableBulkKey * entry,
+	double key[],
+	HashTableDataFlags keyHint,
+	size_t valueLength[],
+	double value[],
+	HashTableDataFlags valueHint,
+	bool unique
+) {
+
+	htExclusiveScope(ht);
+
+	if (htViewing(ht)) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return HT_ERROR_SENTINEL;
+	}
+
+	htReturnIfAllocationFailure(htBulkReserve(ht, count), {});
+
+	size_t index, stored = 0;
+
+	for (index = 0; index < count; index++) {
+
+		size_t at = (position) ? position[index] : index,
+			length = (valueLength) ? valueLength[at] : 0;
+		sHashTableBulkKey * this = entry + at;
+
+		/* every hash is known, so buckets are fetched a window ahead */
+		if (index + HT_BATCH_WINDOW < count) {
+			sHashTableBulkKey * ahead = entry + ((position) ?
+				position[index + HT_BATCH_WINDOW] : index + HT_BATCH_WINDOW);
+			if (htOpenAddressing(ht)) __builtin_prefetch(
+				ht->control + htProbeHome(ht, ahead->hash) * HT_PROBE_GROUP
+			);
+			else __builtin_prefetch(htBucket(ht, ahead->hash), 1);
+		}
+
+		if (! this->keyLength) {
+			errno = HT_ERROR_ZERO_LENGTH_KEY;
+			continue;
+		}
+
+		HashTableRecord record = (unique) ? NULL : htLookup(
+			ht, this->hash, this->keyLength, htBulkRealKey(key[at], keyHint)
+		);
+
+		if (record) {
+			if (htRecordSettings(record) & HTI_NON_WRITABLE) {
+				errno = HT_ERROR_NOT_WRITABLE_ITEM;
+				continue;
+			}
+			if (htRecordWriteValue(ht, &record, length, value[at], valueHint)) {
+				htLog(ht, HT_LOG_PUT, record->key, record->value);
+				htCountHit(ht, record), stored++;
+				continue;
+			}
+			/* what is stored so far stays, as when a record fails below */
+			HyperVariant var = htVarCreate(ht, length, value[at], valueHint);
+			if (! var) {
+				errno = HT_ERROR_ALLOCATION_FAILURE; return stored;
+			}
+			if (! (record = htThaw(ht, record))) {
+				htVarFree(ht, var);
+				errno = HT_ERROR_ALLOCATION_FAILURE; return stored;
+			}
+			htRecordSetValue(ht, record, var);
+			htLog(ht, HT_LOG_PUT, record->key, record->value);
+			htCountHit(ht, record), stored++;
+			continue;
+		}
+
+		record = htCreateRecord(
+			ht, this->keyLength, htBulkRealKey(key[at], keyHint), key[at],
+			keyHint, length, value[at], valueHint
+		);
+		if (! record) return stored;
+		htRecordHash(record) = this->hash;
+
+		if (htOpenAddressing(ht)) htProbeInsert(ht, record);
+		else {
+			HashTableRecordList bucket = htBucket(ht, this->hash);
+			record->successor = *bucket, htPublish(*bucket, record);
+		}
+		if (ht->ordered) htOrderedInsert(ht, record);
+		htLog(ht, HT_LOG_PUT, record->key, record->value);
+		stored++;
+
+	}
+
+	return stored;
+
+}
+
+/* sharded tables hash with the parent, then load each shard's keys */
+static size_t htShardBulkLoad
+(
+	HashTable ht,
+	size_t count,
+	sHashTableBulkKey * entry,
+	double key[],
+	HashTableDataFlags keyHint,
+	size_t valueLength[],
+	double value[],
+	HashTableDataFlags valueHint,
+	bool unique
+) {
+
+	size_t * position = malloc(count * sizeof(size_t)),
+		* first = calloc(ht->shardCount + 1, sizeof(size_t));
+	htReturnIfAllocationFailure(position && first, free(position), free(first));
+
+	size_t index, stored = 0, shard;
+
+	for (index = 0; index < count; index++) {
+		shard = htShardFor(ht, entry[index].hash)->shardIndex;
+		first[shard + 1]++;
+	}
+	for (shard = 0; shard < ht->shardCount; shard++)
+		first[shard + 1] += first[shard];
+	for (index = 0; index < count; index++) {
+		shard = htShardFor(ht, entry[index].hash)->shardIndex;
+		position[first[shard]++] = index;
+	}
+
+	/* each cursor now sits at the start of the next shard's positions */
+	for (index = 0, shard = 0; shard < ht->shardCount; shard++) {
+		stored += htBulkLoad(
+			ht->shard[shard], first[shard] - index, position + index, entry,
+			key, keyHint, valueLength, value, valueHint, unique
+		);
+		index = first[shard];
+	}
+
+	free(position), free(first);
+
+	return stored;
+
+}
+
+size_t HashTableBulkLoad
+(
+	HashTable ht,
+	size_t count,
+	size_t keyLength[],
+	double key[],
+	HashTableDataFlags keyHint,
+	size_t valueLength[],
+	double value[],
+	HashTableDataFlags valueHint,
+	bool unique
+) {
+
+	htReturnIfTableUninitialized(ht);
+
+	if (! count) return 0;
+
+	sHashTableBulkKey * entry;
+	size_t stored;
+
+	if (ht->shard) {
+		entry = htBulkHashKeys(ht, count, keyLength, key, keyHint);
+		if (! entry) return HT_ERROR_SENTINEL;
+		stored = htShardBulkLoad(
+			ht, count, entry, key, keyHint, valueLength, value, valueHint,
+			unique
+		);
+		free(entry);
+		return stored;
+	}
+
+	/* hashed unlocked; a hash function changed meanwhile means once more */
+	HashTableHashFunction function = ht->hashFunction;
+	size_t seed = ht->seed;
+	entry = htBulkHashKeys(ht, count, keyLength, key, keyHint);
+	if (! entry) return HT_ERROR_SENTINEL;
+
+	htExclusiveScope(ht);
+
+	if (ht->hashFunction != function || ht->seed != seed) {
+		free(entry);
+		entry = htBulkHashKeys(ht, count, keyLength, key, keyHint);
+		if (! entry) return HT_ERROR_SENTINEL;
+	}
+
+	stored = htBulkLoad(
+		ht, count, NULL, entry, key, keyHint, valueLength, value, valueHint,
+		unique
+	);
+
+	free(entry);
+
+	return stored;
+
+}
+
+/*
+ * source fills up to count pairs per call and returns how many, 0 ending
+ * the load; count here is only the expected total, used to presize.
+ */
+size_t HashTableBulkLoadFrom
+(
+	HashTable ht,
+	size_t count,
+	HashTableBulkSource source,
+	HashTableDataFlags keyHint,
+	HashTableDataFlags valueHint,
+	bool unique,
+	void * private
+) {
+
+	htReturnIfTableUninitialized(ht);
+	htReturnIfNoCallBackHandler(source);
+
+	if (count && ht->shard) {
+		size_t shard, share = (count + ht->shardCount - 1) / ht->shardCount;
+		for (shard = 0; shard < ht->shardCount; shard++) {
+			htExclusiveScope(ht->shard[shard]);
+			htReturnIfAllocationFailure(
+				htBulkReserve(ht->shard[shard], share), {}
+			);
+		}
+	} else if (count) {
+		htExclusiveScope(ht);
+		htReturnIfAllocationFailure(htBulkReserve(ht, count), {});
+	}
+
+	size_t * keyLength = malloc(HT_BULK_CHUNK * sizeof(size_t) * 2);
+	double * key = malloc(HT_BULK_CHUNK * sizeof(double) * 2);
+	htReturnIfAllocationFailure(keyLength && key, free(keyLength), free(key));
+
+	size_t * valueLength = keyLength + HT_BULK_CHUNK, produced, stored = 0;
+	double * value = key + HT_BULK_CHUNK;
+
+	while ((produced = source(
+		ht, HT_BULK_CHUNK, keyLength, key, valueLength, value, private
+	))) {
+		if (produced > HT_BULK_CHUNK) produced = HT_BULK_CHUNK;
+		stored += HashTableBulkLoad(
+			ht, produced, keyLength, key, keyHint, valueLength, value,
+			valueHint, unique
+		);
+	}
+
+	free(keyLength), free(key);
+
+	return stored;
+
+}
+
+HashTableItem HashTableGetItemByKey
+(
+	HashTable ht,
+	HashTableData realKey
+) {
+	htReturnIfTableUninitialized(ht);
+
+	if (! realKey) {
+		errno = HT_ERROR_ZERO_LENGTH_KEY; return HT_ERROR_SENTINEL;
+	}
+
+	if (ht->shard) return htShardGet(
+		ht, varlength(realKey), (void*) realKey, HT_EVENT_GET
+	);
+	return htGet(
+		ht, 0, false, varlength(realKey), (void*) realKey, HT_EVENT_GET
+	);
+
+}
+
+HashTableItem HashTableGet
+(
+	HashTable ht,
+	size_t keyLength,
+	double key,
+	HashTableDataFlags hint
+) {
+
+	htReturnIfTableUninitialized(ht);
+	char * realKey = htRealKeyOrReturn(keyLength, key, hint);
+
+	if (ht->shard) return htShardGet(ht, keyLength, realKey, HT_EVENT_GET);
+	return htGet(ht, 0, false, keyLength, realKey, HT_EVENT_GET);
+
+}
+
+/*
+ * Keys as a plain pointer and byte count: nothing is decoded or measured,
+ * and the key is stored as an HTI_BLOCK. A UTF-8 key matches the same
+ * characters put with utf8var. The hashed forms take the hash from
+ * HashTableHashBytes, which stays valid until the hash function changes.
+ */
+#define htReturnIfNoBytes(key, keyLength)                                      \
+if ( ! (key) || ! (keyLength) ) {                                              \
+    errno = HT_ERROR_ZERO_LENGTH_KEY; return HT_ERROR_SENTINEL;                \
+}
+
+size_t HashTableHashBytes
+(
+	HashTable ht,
+	const void * key,
+	size_t keyLength
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfNoBytes(key, keyLength);
+	htSharedScope(ht);
+	return htCreateHash(ht, keyLength, key);
+}
+
+HashTableItem HashTableHasBytes
+(
+	HashTable ht,
+	const void * key,
+	size_t keyLength
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfNoBytes(key, keyLength);
+	if (ht->shard) return htShardGet(ht, keyLength, (void *) key, 0);
+	return htGet(ht, 0, false, keyLength, (void *) key, 0);
+}
+
+HashTableItem HashTableGetBytes
+(
+	HashTable ht,
+	const void * key,
+	size_t keyLength
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfNoBytes(key, keyLength);
+	if (ht->shard) return htShardGet(ht, keyLength, (void *) key, HT_EVENT_GET);
+	return htGet(ht, 0, false, keyLength, (void *) key, HT_EVENT_GET);
+}
+
+HashTableItem HashTablePutBytes
+(
+	HashTable ht,
+	const void * key,
+	size_t keyLength,
+	size_t valueLength,
+	double value,
+	HashTableDataFlags valueHint
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfNoBytes(key, keyLength);
+	return htPutKey(
+		ht, 0, false, keyLength, (char *) key, 0, HTI_BLOCK,
+		valueLength, value, valueHint
+	);
+}
+
+HashTableItem HashTableHasHashed
+(
+	HashTable ht,
+	size_t hash,
+	const void * key,
+	size_t keyLength
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfNoBytes(key, keyLength);
+	if (ht->shard) {
+		HashTable shard = htShardFor(ht, hash);
+		return htShardResult(shard,
+			htGet(shard, hash, true, keyLength, (void *) key, 0)
+		);
+	}
+	return htGet(ht, hash, true, keyLength, (void *) key, 0);
+}
+
+HashTableItem HashTableGetHashed
+(
+	HashTable ht,
+	size_t hash,
+	const void * key,
+	size_t keyLength
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfNoBytes(key, keyLength);
+	if (ht->shard) {
+		HashTable shard = htShardFor(ht, hash);
+		return htShardResult(shard,
+			htGet(shard, hash, true, keyLength, (void *) key, HT_EVENT_GET)
+		);
+	}
+	return htGet(ht, hash, true, keyLength, (void *) key, HT_EVENT_GET);
+}
+
+HashTableItem HashTablePutHashed
+(
+	HashTable ht,
+	size_t hash,
+	const void * key,
+	size_t keyLength,
+	size_t valueLength,
+	double value,
+	HashTableDataFlags valueHint
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfNoBytes(key, keyLength);
+	return htPutKey(
+		ht, hash, true, keyLength, (char *) key, 0, HTI_BLOCK,
+		valueLength, value, valueHint
+	);
+}
+
+/*
+ * Batched lookups overlap their cache misses: a window of keys is hashed
+ * and its buckets prefetched before any chain is read, then the chains are
+ * walked a node per lookup per round, each step prefetching the node or key
+ * it will look at next. Striped tables walk under each key's stripe, so
+ * they only get the prefetched buckets.
+ */
+typedef struct sHashTableLookup {
+	size_t position;
+	size_t hash;
+	size_t keyLength;
+	void * realKey;
+	HashTableRecord record;
+	bool compare;
+	bool found;
+} sHashTableLookup;
+
+/* leaves each lookup's record, or NULL for a miss, unless striped */
+static void htGetWindow
+(
+	HashTable ht,
+	sHashTableLookup * lookup,
+	size_t count,
+	bool striped
+) {
+
+	size_t index, pending = 0;
+
+	if (htOpenAddressing(ht)) {
+		for (index = 0; index < count; index++) {
+			size_t group = htProbeHome(ht, lookup[index].hash);
+			__builtin_prefetch(ht->control + group * HT_PROBE_GROUP);
+			__builtin_prefetch(ht->slot + group * HT_PROBE_GROUP);
+		}
+		for (index = 0; index < count; index++) {
+			HashTableRecordList entry = htProbeFind(
+				ht, lookup[index].hash, lookup[index].keyLength,
+				lookup[index].realKey, NULL
+			);
+			lookup[index].record = (entry) ? *entry : NULL;
+		}
+		return;
+	}
+
+	HashTableEpoch epoch = ht->epoch;
+	size_t generation = (epoch) ? htEpochGeneration(epoch) : 0;
+	HashTableRecordList bucket[HT_BATCH_WINDOW];
+
+	for (index = 0; index < count; index++)
+		__builtin_prefetch(bucket[index] = htBucket(ht, lookup[index].hash));
+
+	if (striped) return;
+
+	for (index = 0; index < count; index++) {
+		HashTableRecord record = htRead(*bucket[index]);
+		lookup[index].record = record;
+		lookup[index].compare = lookup[index].found = false;
+		if (record) __builtin_prefetch(record), pending++;
+	}
+
+	while (pending) for (index = 0; index < count; index++) {
+		sHashTableLookup * step = lookup + index;
+		HashTableRecord record = step->record;
+		if (! record || step->found) continue;
+		if (! step->compare) {
+			if (htRecordHash(record) == step->hash) {
+				__builtin_prefetch(record->key);
+				step->compare = true;
+				continue;
+			}
+		} else if (htCompareRecordToRealKey(
+			record, step->hash, step->keyLength, step->realKey
+		)) {
+			step->found = true, pending--;
+			continue;
+		}
+		step->compare = false;
+		step->record = htRead(record->successor);
+		if (step->record) __builtin_prefetch(step->record);
+		else pending--;
+	}
+
+	/* a miss during a migration reruns, as htLookup would */
+	for (index = 0; index < count; index++) if (! lookup[index].found) break;
+	if (index == count || ! epoch || ! htEpochRetry(epoch, &generation)) return;
+	for (; index < count; index++) if (! lookup[index].found)
+		lookup[index].record = htLookup(
+			ht, lookup[index].hash, lookup[index].keyLength,
+			lookup[index].realKey
+		);
+
+}
+
+/*
+ * As HashTableGet for each key, into the matching item; misses get 0. Events
+ * fire and hits count in key order. Returns how many keys were found.
+ */
+size_t HashTableGetMany
+(
+	HashTable ht,
+	size_t count,
+	size_t keyLength[],
+	double key[],
+	HashTableDataFlags hint,
+	HashTableItem item[]
+) {
+
+	htReturnIfTableUninitialized(ht);
+
+	sHashTableLookup lookup[HT_BATCH_WINDOW];
+	size_t position = 0, found = 0, index, window;
+
+	htSharedScope(ht);
+
+	bool striped = ht->locks && ! ht->epoch && ! htOpenAddressing(ht);
+
+	while (position < count) {
+
+		for (window = 0; window < HT_BATCH_WINDOW && position < count;
+			position++) {
+			sHashTableLookup * next = lookup + window;
+			next->position = position;
+			next->keyLength = (keyLength) ? keyLength[position] : 0;
+			next->realKey = (hint & HTI_DOUBLE) ?
+				(void *) &key[position] : ptrval(key[position]);
+			if (! next->keyLength && (hint & HTI_UTF8))
+				next->keyLength = strlen(next->realKey);
+			if (! next->keyLength) {
+				item[position] = HT_ERROR_SENTINEL;
+				errno = HT_ERROR_ZERO_LENGTH_KEY;
+				continue;
+			}
+			next->hash = htCreateHash(ht, next->keyLength, next->realKey);
+			window++;
+		}
+
+		if (htViewing(ht)) {
+			for (index = 0; index < window; index++)
+				if ((item[lookup[index].position] = htViewGet(
+					ht, lookup[index].keyLength, lookup[index].realKey,
+					HT_EVENT_GET
+				))) found++;
+			continue;
+		}
+
+		if (ht->shard) {
+			for (index = 0; index < window; index++) {
+				HashTable shard = htShardFor(ht, lookup[index].hash);
+				HashTableItem selection = htShardResult(shard, htGet(
+					shard, lookup[index].hash, true, lookup[index].keyLength,
+					lookup[index].realKey, HT_EVENT_GET
+				));
+				if ((item[lookup[index].position] = selection)) found++;
+			}
+			continue;
+		}
+
+		htGetWindow(ht, lookup, window, striped);
+
+		/* an unlocked table's handler may have changed it under the window */
+		bool refresh = false;
+
+		for (index = 0; index < window; index++) {
+			sHashTableLookup * next = lookup + index;
+			HashTableItem selection = HT_ERROR_SENTINEL;
+			if (striped) {
+				htStripeScope(ht, next->hash, false);
+				HashTableRecord record = htLookup(
+					ht, next->hash, next->keyLength, next->realKey
+				);
+				if (record) selection = htGetFound(ht, record, HT_EVENT_GET);
+				else errno = HT_ERROR_INVALID_REFERENCE;
+			} else {
+				if (refresh) next->record = htLookup(
+					ht, next->hash, next->keyLength, next->realKey
+				);
+				if (next->record)
+					selection = htGetFound(ht, next->record, HT_EVENT_GET);
+				else errno = HT_ERROR_INVALID_REFERENCE;
+				refresh = ! ht->locks && ht->eventHandler &&
+					htGetEventMask(ht, HT_EVENT_GET);
+			}
+			if ((item[next->position] = selection)) found++;
+		}
+
+	}
+
+	return found;
+
+}
+
+bool HashTableDeleteItem
+(
+	HashTable ht,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableDeleteItem);
+	htExclusiveScope(ht);
+	htReturnIfInvalidReference(ht, reference);
+	HashTableRecord item = ht->item[reference];
+	htReturnIfNotConfigurableItem(item);
+
+	HashTableItem
+		currentSelection = htRecordReference(item),
+		selection = htAutoFireItemEvent(
+				ht, currentSelection, HT_EVENT_DELETE, item->value
+		)
+	;
+
+	if (selection == currentSelection) {
+		bool kept = htViewSees(ht->view, item);
+		htReturnIfAllocationFailure(! kept || htViewKeep(ht, item), {});
+		htRehashStep(ht, HT_REHASH_STEPS);
+		htUnlink(ht, item);
+
+		htVacate(ht, reference),
+		htPublish(ht->item[reference], NULL),
+		ht->itemsTotal--,
+		ht->impact -= htRecordImpact(item);
+		htLog(ht, HT_LOG_DELETE, item->key, NULL);
+		if (! kept) { htDisposeRecord(ht, item); }
+		htReleaseReference(ht, reference, false);
+		return true;
+	}
+
+	return false;
+
+}
+
+HashTableData HashTableItemKey
+(
+	HashTable ht,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableItemKey);
+	htSharedScope(ht);
+	htReturnIfInvalidRecord(ht, reference, record);
+	return record->key;
+}
+
+/* the value may be replaced as soon as the stripe is let go */
+HashTableData HashTableItemData
+(
+	HashTable ht,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableItemData);
+	htSharedScope(ht);
+	htReturnIfInvalidRecord(ht, reference, record);
+	htStripeScope(ht, htRecordHash(record), false);
+	return htRead(record->value);
+}
+
+/* a copy stays whole whatever other threads put; returns the full length */
+size_t HashTableItemCopyData
+(
+	HashTable ht,
+	HashTableItem reference,
+	void * buffer,
+	size_t size
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableItemCopyData, buffer, size);
+	htSharedScope(ht);
+	htReturnIfInvalidRecord(ht, reference, record);
+	htStripeScope(ht, htRecordHash(record), false);
+	HyperVariant value = htRead(record->value);
+	size_t length = varlength(value);
+	memcpy(buffer, value, (length < size) ? length : size);
+	return length;
+}
+
+size_t HashTableDataLength
+(
+	HashTableData data
+) {
+	if (data) return varlength(data);
+	return HT_ERROR_SENTINEL;
+}
+
+HashTableDataFlags HashTableDataType
+(
+	HashTableData data
+) {
+	if (data) return (vartype(data) &
+		(HTI_NUMBER | HTI_DOUBLE | HTI_POINTER | HTI_BLOCK)
+	);
+	return HT_ERROR_SENTINEL;
+}
+
+HashTableDataFlags HashTableDataSettings
+(
+	HashTableData data
+) {
+	if (data) return vartype(data);
+	return HT_ERROR_SENTINEL;
+}
+
+bool HashTableItemGetEnumerable
+(
+	HashTable ht,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableItemGetEnumerable);
+	htSharedScope(ht);
+	htReturnIfInvalidRecord(ht, reference, record);
+	return (htRecordSettings(record) & HTI_NON_ENUMERABLE) == 0;
+}
+
+bool HashTableItemSetEnumerable
+(
+	HashTable ht,
+	HashTableItem reference,
+	bool value
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableItemSetEnumerable, value);
+	htExclusiveScope(ht);
+	htReturnIfInvalidReference(ht, reference);
+	HashTableRecord item = ht->item[reference];
+	htReturnIfNotConfigurableItem(item);
+	htReturnIfAllocationFailure(item = htThaw(ht, item), {});
+	if (! value) {
+		htRecordSettings(item) &= ~HTI_NON_ENUMERABLE;
+	} else {
+		htRecordSettings(item) |= HTI_NON_ENUMERABLE;
+	}
+	return true;
+}
+
+bool HashTableItemGetWritable
+(
+	HashTable ht,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableItemGetWritable);
+	htSharedScope(ht);
+	htReturnIfInvalidRecord(ht, reference, record);
+	return (htRecordSettings(record) & HTI_NON_WRITABLE) == 0;
+}
+
+bool HashTableItemSetWritable
+(
+	HashTable ht,
+	HashTableItem reference,
+	bool value
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableItemSetWritable, value);
+	htExclusiveScope(ht);
+	htReturnIfInvalidReference(ht, reference);
+	HashTableRecord item = ht->item[reference];
+	htReturnIfNotConfigurableItem(item);
+	htReturnIfAllocationFailure(item = htThaw(ht, item), {});
+	if (! value) {
+		htRecordSettings(item) &= ~HTI_NON_WRITABLE;
+	} else {
+		htRecordSettings(item) |= HTI_NON_WRITABLE;
+	}
+	return true;
+}
+
+bool HashTableItemGetConfigurable
+(
+	HashTable ht,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableItemGetConfigurable);
+	htSharedScope(ht);
+	htReturnIfInvalidRecord(ht, reference, record);
+	return (htRecordSettings(record) & HTI_NON_CONFIGURABLE) == 0;
+}
+
+bool HashTableItemSetConfigurable
+(
+	HashTable ht,
+	HashTableItem reference,
+	bool value
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfSharded(ht, reference, HashTableItemSetConfigurable, value);
+	htExclusiveScope(ht);
+	htReturnIfInvalidReference(ht, reference);
+	HashTableRecord item = ht->item[reference];
+	htReturnIfNotConfigurableItem(item);
+	htReturnIfAllocationFailure(item = htThaw(ht, item), {});
+	if (! value) {
+		htRecordSettings(item) &= ~HTI_NON_CONFIGURABLE;
+	} else {
+		htRecordSettings(item) |= HTI_NON_CONFIGURABLE;
+	}
+	return true;
+}
+
+void HashTableEnumerate
+(
+	HashTable ht,
+	HashTableEnumerateDirection direction,
+	HashTableEnumerationHandler handler,
+	void * private
+) {
+	htReturnVoidIfTableUninitialized(ht);
+	htReturnVoidIfNoCallBackHandler(handler);
+	if (ht->shard) {
+		sHashTableShardVisit visit = { ht, 0, handler, NULL, private, false };
+		size_t index, count = ht->shardCount;
+		for (index = 0; index < count && ! visit.stopped; index++) {
+			visit.shardIndex = (direction == HT_ENUMERATE_FORWARD) ?
+				index : count - index - 1;
+			HashTableEnumerate(ht->shard[visit.shardIndex], direction,
+				htShardEnumeration, &visit);
+		}
+		return;
+	}
+	/* writers carry on between the items of a snapshot */
+	if (htViewing(ht)) {
+		HashTableItem step = 0;
+		bool forward = (direction == HT_ENUMERATE_FORWARD);
+		while ((step = htViewStep(ht, step, forward))
+			&& handler(ht, direction, step, private));
+		return;
+	}
+	htExclusiveScope(ht);
+
+	/*
+	 * Items the handler puts past the end are not visited, though ones given
+	 * a reused reference ahead of the walk are.
+	 */
+	size_t maximum = ht->itemsUsed;
+	bool forward = (direction == HT_ENUMERATE_FORWARD);
+	HashTableItem reference = htOccupiedStep(ht, 0, forward), ahead;
+	HashTableRecord item;
+	while (reference) {
+		ahead = htOccupiedStep(ht, reference, forward);
+		if (ahead > maximum) ahead = 0;
+		if (ahead) __builtin_prefetch(ht->item[ahead - 1]);
+		item = ht->item[reference - 1];
+		if (! (htRecordSettings(item) & HTI_NON_ENUMERABLE)
+			&& ! handler(ht, direction, reference, private)) break;
+		/* the handler may have deleted what comes next */
+		if (ahead && ! ht->item[ahead - 1])
+			ahead = htOccupiedStep(ht, reference, forward);
+		reference = (ahead > maximum) ? 0 : ahead;
+	}
+}
+
+/*
+ * HashTableParallelEnumerate splits the items between up to threads workers,
+ * or one per processor for 0. The handler runs on all of them at once and
+ * may read the table, but not change it; items come in no particular order.
+ * Worker n hands partial[n] to the handler in place of private, and once all
+ * are done reduce sees each of the threads partials in turn. The workers
+ * share one chunk counter, so one that finishes early claims more of what
+ * is left.
+ */
+typedef struct sHashTableEnumerateJob {
+	HashTable ht;
+	HashTable parent;
+	HashTableEnumerationHandler handler;
+	void * private;
+	size_t * chunk;
+	size_t chunks;
+	size_t visited;
+	bool * stopped;
+} sHashTableEnumerateJob;
+
+static void * htEnumerateWork (void * private)
+{
+	sHashTableEnumerateJob * job = private;
+	HashTable ht = job->ht;
+	HashTableItem reference, ahead, last;
+	HashTableRecord item;
+	size_t chunk;
+	htHelping = ht->locks;
+	while (! __atomic_load_n(job->stopped, __ATOMIC_RELAXED) && (chunk =
+		__atomic_fetch_add(job->chunk, 1, __ATOMIC_RELAXED)) < job->chunks) {
+		last = (chunk + 1) * HT_ENUMERATE_CHUNK;
+		if (htViewing(ht)) {
+			reference = chunk * HT_ENUMERATE_CHUNK;
+			while ((reference = htViewStep(ht, reference, true))
+				&& reference <= last) {
+				job->visited++;
+				if (job->handler(job->parent, HT_ENUMERATE_FORWARD,
+					reference, job->private)) continue;
+				__atomic_store_n(job->stopped, true, __ATOMIC_RELAXED);
+				break;
+			}
+			continue;
+		}
+		reference = htOccupiedNext(ht, chunk * HT_ENUMERATE_CHUNK, last);
+		while (reference) {
+			ahead = htOccupiedNext(ht, reference, last);
+			if (ahead) __builtin_prefetch(ht->item[ahead - 1]);
+			item = ht->item[reference - 1];
+			if (! (htRecordSettings(item) & HTI_NON_ENUMERABLE)) {
+				job->visited++;
+				if (! job->handler(job->parent, HT_ENUMERATE_FORWARD,
+					(ht->parent) ? htShardResult(ht, reference) : reference,
+					job->private
+				)) {
+					__atomic_store_n(job->stopped, true, __ATOMIC_RELAXED);
+					break;
+				}
+			}
+			reference = ahead;
+		}
+	}
+	htHelping = NULL;
+	return NULL;
+}
+
+/* one table; sharded tables come here a shard at a time */
+static size_t htEnumerateParallel
+(
+	HashTable ht,
+	HashTable parent,
+	size_t threads,
+	HashTableEnumerationHandler handler,
+	void * partial[],
+	void * private,
+	bool * stopped
+) {
+	htExclusiveScope(ht);
+	size_t index, visited = 0, chunk = 0,
+		used = (htViewing(ht)) ? ht->viewing->itemsUsed : ht->itemsUsed,
+		chunks = (used + HT_ENUMERATE_CHUNK - 1) / HT_ENUMERATE_CHUNK;
+	if (threads > chunks) threads = chunks;
+
+	sHashTableEnumerateJob job[HT_ENUMERATE_THREADS];
+	pthread_t thread[HT_ENUMERATE_THREADS];
+	bool started[HT_ENUMERATE_THREADS];
+
+	for (index = 0; index < threads; index++) {
+		job[index] = (sHashTableEnumerateJob) {
+			ht, parent, handler, (partial) ? partial[index] : private,
+			&chunk, chunks, 0, stopped
+		};
+		/* the calling thread takes the first share, and any that fail */
+		started[index] = index && ! pthread_create(
+			thread + index, NULL, htEnumerateWork, job + index
+		);
+	}
+	for (index = 0; index < threads; index++)
+		if (! started[index]) htEnumerateWork(job + index);
+	for (index = 0; index < threads; index++) {
+		if (started[index]) pthread_join(thread[index], NULL);
+		visited += job[index].visited;
+	}
+	return visited;
+}
+
+size_t HashTableParallelEnumerate
+(
+	HashTable ht,
+	size_t threads,
+	HashTableEnumerationHandler handler,
+	void * partial[],
+	HashTableReductionHandler reduce,
+	void * private
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfNoCallBackHandler(handler);
+	/* every partial belongs to the worker of the same index */
+	if (partial && ! threads) {
+		errno = HT_ERROR_INVALID_TYPE_REQUEST; return HT_ERROR_SENTINEL;
+	}
+	size_t index, visited = 0, workers = threads;
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	if (! workers || (processors > 0 && workers > (size_t) processors))
+		workers = (processors > 0) ? processors : 1;
+	if (workers > HT_ENUMERATE_THREADS) workers = HT_ENUMERATE_THREADS;
+
+	bool stopped = false;
+	if (ht->shard) for (index = 0; index < ht->shardCount && ! stopped; index++)
+		visited += htEnumerateParallel(ht->shard[index], ht, workers,
+			handler, partial, private, &stopped);
+	else visited = htEnumerateParallel(
+		ht, ht, workers, handler, partial, private, &stopped
+	);
+
+	if (reduce && partial) for (index = 0; index < threads; index++)
+		reduce(ht, partial[index], private);
+	return visited;
+}
+
+/*
+ * A HashTableCursor walks in reference order and can be put aside and
+ * resumed; deleting its item is allowed. Its item is 0 once it runs off
+ * either end, from where next starts over at the first item and previous
+ * at the last.
+ *
+ * The enumerable item at or past reference in one table, stepping over
+ * holes with the occupancy bitmap; 0 for the end.
+ */
+static HashTableItem htCursorStep
+(
+	HashTable ht,
+	HashTableItem reference,
+	bool forward,
+	bool inclusive
+) {
+	if (htViewing(ht)) return htViewStep(ht, (! inclusive) ? reference :
+		(forward) ? reference - 1 : reference + 1, forward);
+	htSharedScope(ht);
+	HashTableRecord item;
+	if (! inclusive) reference = htOccupiedStep(ht, reference, forward);
+	while (reference) {
+		item = (reference <= htRead(ht->itemsMax)) ?
+			htItem(ht, reference - 1) : NULL;
+		if (item && ! (htRecordSettings(item) & HTI_NON_ENUMERABLE))
+			return reference;
+		reference = htOccupiedStep(ht, reference, forward);
+	}
+	return HT_ERROR_SENTINEL;
+}
+
+/*
+ * Sharded references interleave the shards, so the step is the nearest of
+ * each shard's own step past the same position.
+ */
+static HashTableItem htCursorMove
+(
+	HashTable ht,
+	HashTableItem reference,
+	bool forward,
+	bool inclusive
+) {
+	if (! ht->shard) return htCursorStep(ht, reference, forward, inclusive);
+	size_t index, count = ht->shardCount, shard = 0, local = 0;
+	HashTableItem found = 0, candidate, bound;
+	if (reference) {
+		shard = (reference - 1) % count, local = (reference - 1) / count + 1;
+		if (inclusive && (candidate = htCursorStep(
+			ht->shard[shard], local, forward, true
+		)) == local) return reference;
+	}
+	for (index = 0; index < count; index++) {
+		/* local itself is still to come in shards beyond this one */
+		bound = (! reference) ? 0 : (forward) ?
+			((index > shard) ? local - 1 : local) :
+			((index < shard) ? local + 1 : local);
+		candidate = htShardReference(ht, index,
+			htCursorStep(ht->shard[index], bound, forward, false));
+		if (candidate && (! found || ((forward) ?
+			candidate < found : candidate > found))) found = candidate;
+	}
+	return found;
+}
+
+HashTableItem HashTableCursorBegin
+(
+	HashTable ht,
+	HashTableEnumerateDirection direction,
+	HashTableCursor * cursor
+) {
+	htReturnIfTableUninitialized(ht);
+	if (! cursor) {
+		errno = HT_ERROR_INVALID_REFERENCE; return HT_ERROR_SENTINEL;
+	}
+	cursor->hashTable = ht, cursor->direction = direction;
+	return cursor->item = htCursorMove(
+		ht, 0, direction == HT_ENUMERATE_FORWARD, false
+	);
+}
+
+HashTableItem HashTableCursorNext
+(
+	HashTableCursor * cursor
+) {
+	htReturnIfTableUninitialized((cursor) ? cursor->hashTable : 0);
+	return cursor->item = htCursorMove(cursor->hashTable, cursor->item,
+		cursor->direction == HT_ENUMERATE_FORWARD, false
+	);
+}
+
+HashTableItem HashTableCursorPrevious
+(
+	HashTableCursor * cursor
+) {
+	htReturnIfTableUninitialized((cursor) ? cursor->hashTable : 0);
+	return cursor->item = htCursorMove(cursor->hashTable, cursor->item,
+		cursor->direction != HT_ENUMERATE_FORWARD, false
+	);
+}
+
+HashTableItem HashTableCursorSeek
+(
+	HashTableCursor * cursor,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized((cursor) ? cursor->hashTable : 0);
+	return cursor->item = htCursorMove(cursor->hashTable, reference,
+		cursor->direction == HT_ENUMERATE_FORWARD, reference != 0
+	);
+}
+
+/*
+ * Sorts are stable merge sorts over references. A handler answering with
+ * secondary puts it ahead of primary, and an answer of 0 stops the sort with
+ * whatever order it has reached. The items stay put until the sort is done,
+ * so every reference handed to the handler is still the item it was.
+ * HT_SORT_PARALLEL sorts runs on several threads and merges them pairwise;
+ * its handler must be safe to call from all of them at once, and may read
+ * the table the sort holds.
+ */
+typedef struct sHashTableSortJob {
+	HashTable ht;
+	HashTableSortType type;
+	HashTableSortDirection direction;
+	HashTableSortHandler handler;
+	void * private;
+	HashTableItem * item;
+	HashTableItem * buffer;
+	size_t first;
+	size_t middle;
+	size_t last;
+	bool * stopped;
+} sHashTableSortJob;
+
+/* true when secondary belongs ahead of primary */
+static bool htSortAhead
+(
+	sHashTableSortJob * job,
+	HashTableItem primary,
+	HashTableItem secondary
+) {
+	if (__atomic_load_n(job->stopped, __ATOMIC_RELAXED)) return false;
+	HashTableItem selection = job->handler(
+		job->ht, job->type, job->direction, primary, secondary, job->private
+	);
+	if (! selection) __atomic_store_n(job->stopped, true, __ATOMIC_RELAXED);
+	return selection == secondary;
+}
+
+static void htSortMerge
+(
+	sHashTableSortJob * job,
+	size_t first,
+	size_t middle,
+	size_t last
+) {
+	HashTableItem * item = job->item, * buffer = job->buffer;
+	size_t left = first, right = middle, index = first;
+	if (! htSortAhead(job, item[middle - 1], item[middle])) return;
+	while (left < middle && right < last)
+		if (htSortAhead(job, item[left], item[right]))
+			buffer[index++] = item[right++];
+		else buffer[index++] = item[left++];
+	/* what is left of the right run is already in place */
+	memmove(item + index, item + left, (middle - left) * sizeof(*item));
+	memcpy(item + first, buffer + first, (index - first) * sizeof(*item));
+}
+
+static void htSortRange (sHashTableSortJob * job, size_t first, size_t last)
+{
+	if (last - first < 2) return;
+	size_t middle = first + (last - first) / 2;
+	htSortRange(job, first, middle), htSortRange(job, middle, last);
+	htSortMerge(job, first, middle, last);
+}
+
+static void * htSortWork (void * private)
+{
+	sHashTableSortJob * job = private;
+	htHelping = job->ht->locks;
+	if (job->middle) htSortMerge(job, job->first, job->middle, job->last);
+	else htSortRange(job, job->first, job->last);
+	htHelping = NULL;
+	return NULL;
+}
+
+static void htSortJobs (sHashTableSortJob job[], size_t count)
+{
+	pthread_t thread[HT_SORT_THREADS];
+	bool started[HT_SORT_THREADS];
+	size_t index;
+	/* the calling thread takes the first job, and any that fail to start */
+	for (index = 0; index < count; index++) started[index] = index &&
+		! pthread_create(thread + index, NULL, htSortWork, job + index);
+	for (index = 0; index < count; index++)
+		if (! started[index]) htSortWork(job + index);
+	for (index = 0; index < count; index++)
+		if (started[index]) pthread_join(thread[index], NULL);
+}
+
+/* sorts the references from sort->first to sort->last */
+static void htSortReferences (sHashTableSortJob * sort)
+{
+	size_t count = sort->last - sort->first, threads = count / HT_SORT_MINIMUM;
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	if (processors > 0 && threads > (size_t) processors) threads = processors;
+	if (threads > HT_SORT_THREADS) threads = HT_SORT_THREADS;
+	if (! threads || ! (sort->type & HT_SORT_PARALLEL)) threads = 1;
+
+	sHashTableSortJob job[HT_SORT_THREADS];
+	size_t bound[HT_SORT_THREADS + 1], index, width, jobs;
+	for (index = 0; index <= threads; index++)
+		bound[index] = sort->first + count * index / threads;
+
+	for (index = 0; index < threads; index++) job[index] = *sort,
+		job[index].first = bound[index], job[index].middle = 0,
+		job[index].last = bound[index + 1];
+	htSortJobs(job, threads);
+
+	for (width = 1; width < threads; width <<= 1) {
+		for (jobs = 0, index = 0; index + width < threads; index += width << 1)
+			job[jobs] = *sort, job[jobs].first = bound[index],
+			job[jobs].middle = bound[index + width],
+			job[jobs++].last = bound[(index + (width << 1) < threads) ?
+				index + (width << 1) : threads];
+		htSortJobs(job, jobs);
+	}
+}
+
+void HashTableSortItems
+(
+	HashTable ht,
+	HashTableSortType type,
+	HashTableSortDirection direction,
+	HashTableSortHandler sortHandler,
+	void * private
+) {
+	htReturnVoidIfTableUninitialized(ht);
+	htReturnVoidIfNoCallBackHandler(sortHandler);
+	htExclusiveScope(ht);
+	/* sharded references cannot move between shards */
+	if (ht->epoch || ht->shard || ht->view) {
+		htReturnVoidUnsupportedFunction();
+	}
+
+	if (ht->itemsUsed < 2) return;
+
+	/* sort handlers may well compare hits */
+	htFlushHits(ht);
+	htFileChanging(ht);
+
+	size_t maximum = ht->itemsUsed, count = 0, index;
+	HashTableItem * sorted = malloc(maximum * 2 * sizeof(HashTableItem));
+	htReturnVoidIfAllocationFailure(sorted, {});
+	HashTableRecordItems record = malloc(maximum * sizeof(HashTableRecord));
+	htReturnVoidIfAllocationFailure(record, free(sorted));
+
+	/* unsorted empty items go last */
+	for (index = 0; index < maximum; index++)
+		if (ht->item[index] || type & HT_SORT_EMPTY_ITEMS)
+			sorted[count++] = index + 1;
+
+	bool stopped = false;
+	sHashTableSortJob sort = {
+		ht, type, direction, sortHandler, private,
+		sorted, sorted + maximum, 0, 0, count, &stopped
+	};
+	htSortReferences(&sort);
+
+	for (index = 0; index < count; index++)
+		record[index] = ht->item[sorted[index] - 1];
+	while (index < maximum) record[index++] = NULL;
+	memcpy(ht->item, record, maximum * sizeof(HashTableRecord));
+	free(sorted), free(record);
+
+	for(index = 0; index < maximum;) {
+		HashTableRecord primaryRecord = ht->item[index++];
+		if (primaryRecord) htRecordReference(primaryRecord) = index;
+	}
+	htRebuildReleasedReferences(ht);
+	htRebuildOccupancy(ht);
+
+}
+
+void HashTableSortItemHash
+(
+	HashTable ht,
+	HashTableItem reference,
+	HashTableSortType type,
+	HashTableSortDirection direction,
+	HashTableSortHandler sortHandler,
+	void * private
+) {
+
+	htReturnVoidIfTableUninitialized(ht);
+	htReturnVoidIfNoCallBackHandler(sortHandler);
+	if (ht->shard) {
+		sHashTableShardVisit visit = {
+			ht, 0, NULL, sortHandler, private, false
+		};
+		HashTable shard = htShardItem(ht, &reference);
+		visit.shardIndex = shard->shardIndex;
+		HashTableSortItemHash(
+			shard, reference, type, direction, htShardSort, &visit
+		);
+		return;
+	}
+	htExclusiveScope(ht);
+	htReturnVoidIfInvalidReference(ht, reference);
+	htReturnVoidIfNoCallBackHandler(sortHandler);
+	if (htOpenAddressing(ht) || ht->epoch) {
+		htReturnVoidUnsupportedFunction();
+	}
+
+	HashTableRecord item = ht->item[reference];
+	size_t maximum = 0, index = 0;
+	HashTableRecordList bucket = htRecordBucket(ht, item);
+	item = *bucket;
+	while (item) maximum++, item = item->successor;
+	HashTableItem sorted[maximum * 2];
+	item = *bucket;
+	while (item)
+		sorted[index++] = htRecordReference(item), item = item->successor;
+
+	bool stopped = false;
+	sHashTableSortJob sort = {
+		ht, type, direction, sortHandler, private,
+		sorted, sorted + maximum, 0, 0, maximum, &stopped
+	};
+	htSortRange(&sort, 0, maximum);
+
+MakeLinkedList:
+
+	for (index = 0; index < maximum; index++)
+		ht->item[sorted[index] - 1]->successor = (index + 1 < maximum) ?
+			ht->item[sorted[index + 1] - 1] : NULL;
+	*bucket = ht->item[sorted[0] - 1];
+
+}
+
+void HashTableEnumerateItemHash
+(
+	HashTable ht,
+	HashTableItem reference,
+	HashTableEnumerateDirection direction,
+	HashTableEnumerationHandler handler,
+	void * private
+) {
+	htReturnVoidIfTableUninitialized(ht);
+	htReturnVoidIfNoCallBackHandler(handler);
+	if (ht->shard) {
+		sHashTableShardVisit visit = { ht, 0, handler, NULL, private, false };
+		HashTable shard = htShardItem(ht, &reference);
+		visit.shardIndex = shard->shardIndex;
+		HashTableEnumerateItemHash(
+			shard, reference, direction, htShardEnumeration, &visit
+		);
+		return;
+	}
+	htExclusiveScope(ht);
+	htReturnVoidIfInvalidReference(ht, reference);
+	htReturnVoidIfNoCallBackHandler(handler);
+	if (htOpenAddressing(ht)) { htReturnVoidUnsupportedFunction(); }
+
+	HashTableRecord item = ht->item[reference];
+	size_t maximum = 0, index = 0;
+	HashTableRecordList bucket = htRecordBucket(ht, item);
+	item = *bucket;
+	while (item) maximum++, item = item->successor;
+	HashTableRecord array[maximum];
+	item = *bucket;
+	while (item) array[index++] = item, item = item->successor;
+
+	if (direction == HT_ENUMERATE_FORWARD) {
+		for (index = 0; index < maximum; index++) {
+			item = array[index];
+			if (! (htRecordSettings(item) & HTI_NON_ENUMERABLE)) {
+				if ( ! handler(ht, direction, htRecordReference(item), private))
+					break;
+			}
+		}
+	} else {
+		index = maximum;
+		while (--index) {
+			item = array[index];
+			if (! (htRecordSettings(item) & HTI_NON_ENUMERABLE)) {
+				if ( ! handler(
+					ht, direction, htRecordReference(item), private)
+				) break;
+			}
+		}
+		/* manually enumerate the last item (0) */
+		item = array[0];
+		if (! (htRecordSettings(item) & HTI_NON_ENUMERABLE)) {
+			handler(ht, direction, htRecordReference(item), private);
+		}
+	}
+}
+
+/*
+ * Ordered queries hold every table they read at once, shards in order, so
+ * nodes from different shards can be compared. Sharded tables merge their
+ * shards' lists as they go.
+ */
+static void htOrderedHold
+(
+	HashTable table[], size_t tables, sHashTableLockScope scope[]
+) {
+	size_t index;
+	for (index = 0; index < tables; index++)
+		scope[index << 1] = htLockTable(table[index], false),
+		scope[(index << 1) + 1] = htLockOrdered(table[index], false);
+}
+
+static void htOrderedRelease
+(
+	size_t tables, sHashTableLockScope scope[]
+) {
+	size_t index = tables << 1;
+	while (index--) htUnlockScope(scope + index);
+}
+
+#define htOrderedTables(ht) ((ht->shard) ? ht->shard : &ht)
+#define htOrderedTableCount(ht) ((ht->shard) ? ht->shardCount : 1)
+#define htOrderedResult(table, node)                                           \
+((table->parent) ? htShardResult(table, htRecordReference(node->record))      \
+    : htRecordReference(node->record))
+
+/* true when node belongs ahead of other in the given direction */
+htVirtualImmediateFunction (bool) htOrderedAhead
+(
+	HashTableOrderedNode node, HashTableOrderedNode other, bool reverse
+) {
+	int order = htOrderedCompare(node->record,
+		htRecordKeyLength(other->record), other->record->key
+	);
+	return (reverse) ? order > 0 : order < 0;
+}
+
+#define htOrderedFirst 0
+#define htOrderedLast 1
+#define htOrderedAtOrAfter 2
+#define htOrderedAfter 3
+#define htOrderedBefore 4
+
+static HashTableOrderedNode htOrderedFind
+(
+	HashTable ht, int sense, size_t keyLength, const void * realKey
+) {
+	HashTableOrdered index = ht->ordered;
+	HashTableOrderedNode node;
+	switch (sense) {
+		case htOrderedFirst: return index->head[0];
+		case htOrderedLast: return index->tail;
+		case htOrderedBefore:
+			node = htOrderedSeek(
+				index, htOrderedCompare, keyLength, realKey, true, NULL
+			);
+			return (node) ? node->predecessor : index->tail;
+		default: return htOrderedSeek(index, htOrderedCompare,
+			keyLength, realKey, sense == htOrderedAtOrAfter, NULL
+		);
+	}
+}
+
+/*
+ * The item nearest the key in the given sense. With a reference instead of
+ * a key, its neighbour: the very next node on a plain table, the nearest
+ * over every shard on a sharded one.
+ */
+static HashTableItem htOrderedNearest
+(
+	HashTable ht,
+	int sense,
+	HashTableItem reference,
+	size_t keyLength,
+	const void * realKey
+) {
+	HashTable * table = htOrderedTables(ht);
+	size_t tables = htOrderedTableCount(ht), index, owner = 0;
+	if (! table[0]->ordered) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return HT_ERROR_SENTINEL;
+	}
+	sHashTableLockScope scope[tables << 1];
+	htOrderedHold(table, tables, scope);
+
+	HashTableOrderedNode node = NULL, best = NULL;
+	bool reverse = (sense == htOrderedLast || sense == htOrderedBefore);
+	if (reference) {
+		HashTable holder = (ht->shard) ? htShardItem(ht, &reference) : ht;
+		HashTableRecord record = (reference && reference <= holder->itemsMax)
+			? htItem(holder, reference - 1) : NULL;
+		if (! record) {
+			htOrderedRelease(tables, scope);
+			errno = HT_ERROR_INVALID_REFERENCE; return HT_ERROR_SENTINEL;
+		}
+		node = htRecordNode(record);
+		if (! ht->shard)
+			best = (reverse) ? node->predecessor : node->successor[0];
+		keyLength = htRecordKeyLength(record), realKey = record->key;
+	}
+	if (! reference || ht->shard) for (index = 0; index < tables; index++) {
+		node = htOrderedFind(table[index], sense, keyLength, realKey);
+		if (node && (! best || htOrderedAhead(node, best, reverse)))
+			best = node, owner = index;
+	}
+
+	HashTableItem result = (best) ? htOrderedResult(table[owner], best) : 0;
+	htOrderedRelease(tables, scope);
+	if (! result) errno = HT_ERROR_KEY_NOT_FOUND;
+	return result;
+}
+
+typedef struct sHashTableOrderedCursor {
+	HashTableOrderedNode node;
+	HashTableOrderedNode stop;
+} sHashTableOrderedCursor;
+
+/*
+ * Hands the handler every enumerable item from the first node at or after
+ * low up to the first node at or after high by the high comparison, in the
+ * given direction. Returns how many it was handed.
+ */
+static size_t htOrderedWalk
+(
+	HashTable ht,
+	size_t lowLength, const void * low,
+	HashTableOrderedComparison highCompare, bool highInclusive,
+	size_t highLength, const void * high,
+	HashTableEnumerateDirection direction,
+	HashTableEnumerationHandler handler,
+	void * private
+) {
+	HashTable * table = htOrderedTables(ht);
+	size_t tables = htOrderedTableCount(ht), index, count = 0;
+	if (! table[0]->ordered) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return HT_ERROR_SENTINEL;
+	}
+	sHashTableLockScope scope[tables << 1];
+	sHashTableOrderedCursor cursor[tables];
+	bool reverse = (direction == HT_ENUMERATE_REVERSE);
+	htOrderedHold(table, tables, scope);
+
+	for (index = 0; index < tables; index++) {
+		HashTableOrdered ordered = table[index]->ordered;
+		HashTableOrderedNode
+			first = htOrderedSeek(
+				ordered, htOrderedCompare, lowLength, low, true, NULL
+			),
+			end = htOrderedSeek(
+				ordered, highCompare, highLength, high, highInclusive, NULL
+			);
+		if (! first || first == end)
+			cursor[index].node = cursor[index].stop = NULL;
+		else if (reverse) cursor[index].stop = first->predecessor,
+			cursor[index].node = (end) ? end->predecessor : ordered->tail;
+		else cursor[index].node = first, cursor[index].stop = end;
+	}
+
+	HashTableOrderedNode node;
+	size_t best;
+	for (;;) {
+		for (best = tables, index = 0; index < tables; index++)
+			if (cursor[index].node != cursor[index].stop && (best == tables ||
+				htOrderedAhead(cursor[index].node, cursor[best].node, reverse)
+			)) best = index;
+		if (best == tables) break;
+		node = cursor[best].node;
+		cursor[best].node = (reverse) ? node->predecessor : node->successor[0];
+		if (htRecordSettings(node->record) & HTI_NON_ENUMERABLE) continue;
+		count++;
+		if (! handler(
+			ht, direction, htOrderedResult(table[best], node), private
+		)) break;
+	}
+
+	htOrderedRelease(tables, scope);
+	return count;
+}
+
+HashTableItem HashTableFirstItem
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	return htOrderedNearest(ht, htOrderedFirst, 0, 0, NULL);
+}
+
+HashTableItem HashTableLastItem
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	return htOrderedNearest(ht, htOrderedLast, 0, 0, NULL);
+}
+
+HashTableItem HashTableLowerBound
+(
+	HashTable ht,
+	size_t keyLength,
+	double key,
+	HashTableDataFlags hint
+) {
+	htReturnIfTableUninitialized(ht);
+	char * realKey = htRealKeyOrReturn(keyLength, key, hint);
+	return htOrderedNearest(ht, htOrderedAtOrAfter, 0, keyLength, realKey);
+}
+
+HashTableItem HashTableUpperBound
+(
+	HashTable ht,
+	size_t keyLength,
+	double key,
+	HashTableDataFlags hint
+) {
+	htReturnIfTableUninitialized(ht);
+	char * realKey = htRealKeyOrReturn(keyLength, key, hint);
+	return htOrderedNearest(ht, htOrderedAfter, 0, keyLength, realKey);
+}
+
+HashTableItem HashTableNextItem
+(
+	HashTable ht,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized(ht);
+	if (! reference) {
+		errno = HT_ERROR_INVALID_REFERENCE; return HT_ERROR_SENTINEL;
+	}
+	return htOrderedNearest(ht, htOrderedAfter, reference, 0, NULL);
+}
+
+HashTableItem HashTablePreviousItem
+(
+	HashTable ht,
+	HashTableItem reference
+) {
+	htReturnIfTableUninitialized(ht);
+	if (! reference) {
+		errno = HT_ERROR_INVALID_REFERENCE; return HT_ERROR_SENTINEL;
+	}
+	return htOrderedNearest(ht, htOrderedBefore, reference, 0, NULL);
+}
+
+/* keys from low up to but not including high */
+size_t HashTableEnumerateRange
+(
+	HashTable ht,
+	size_t lowLength,
+	double low,
+	HashTableDataFlags lowHint,
+	size_t highLength,
+	double high,
+	HashTableDataFlags highHint,
+	HashTableEnumerateDirection direction,
+	HashTableEnumerationHandler handler,
+	void * private
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfNoCallBackHandler(handler);
+	char * lowKey = htRealKeyOrReturn(lowLength, low, lowHint);
+	char * highKey = htRealKeyOrReturn(highLength, high, highHint);
+	if (htOrderedKeys(lowLength, lowKey, highLength, highKey) >= 0) return 0;
+	return htOrderedWalk(
+		ht, lowLength, lowKey, htOrderedCompare, true, highLength, highKey,
+		direction, handler, private
+	);
+}
+
+size_t HashTableEnumeratePrefix
+(
+	HashTable ht,
+	size_t prefixLength,
+	double prefix,
+	HashTableDataFlags hint,
+	HashTableEnumerateDirection direction,
+	HashTableEnumerationHandler handler,
+	void * private
+) {
+	htReturnIfTableUninitialized(ht);
+	htReturnIfNoCallBackHandler(handler);
+	char * realPrefix = htRealKeyOrReturn(prefixLength, prefix, hint);
+	return htOrderedWalk(
+		ht, prefixLength, realPrefix, htOrderedPrefix, false,
+		prefixLength, realPrefix, direction, handler, private
+	);
+}
+
+/*
+ * A snapshot is the header, the item index, the slot array, the control
+ * bytes of an open addressing table and then every record in item order,
+ * each one block with its key and value inline. Pointers are written as
+ * they would be with the file mapped at base, and only need relocating
+ * when the mapping lands elsewhere. layout guards against files from
+ * another byte order, word size or record layout.
+ *
+ * Mapped records are never freed; the mapping is private, so the table
+ * changes like any other without touching the file. Adopted values are
+ * copied in, pointer values are kept as they are, and the ordered index
+ * and hit counting mode are not kept.
+ */
+#define HT_SNAPSHOT_MAGIC "HTSNAP\0\1"
+#define HT_SNAPSHOT_ORDER ((size_t) 0x0102030405060708ULL)
+
+typedef struct sHashTableSnapshot {
+	char magic[8];
+	size_t layout[4];
+	size_t base;
+	size_t bytes;
+	size_t options;
+	size_t hashFunction;
+	size_t seed;
+	double maxLoadFactor;
+	double growthFactor;
+	size_t itemsUsed;
+	size_t itemsTotal;
+	size_t slotCount;
+	size_t slotsDeleted;
+	size_t records;
+	size_t item;
+	size_t slot;
+	size_t control;
+	size_t record;
+} sHashTableSnapshot;
+
+#define htSnapshotLayout(header)                                               \
+((header)->layout[0] == HT_SNAPSHOT_ORDER &&                                   \
+    (header)->layout[1] == sizeof(size_t) &&                                   \
+    (header)->layout[2] == HashTableRecordSize &&                              \
+    (header)->layout[3] == HashTableVariantSize)
+
+/* a variant as it is written: head and data, rounded up */
+#define htSnapshotVariantBytes(v) (HashTableVariantSize + htAlign(varbytes(v)))
+
+#define htSnapshotRecordBytes(r) (HashTableRecordSize +                        \
+    htSnapshotVariantBytes(r->key) + htSnapshotVariantBytes(r->value))
+
+/* where the record behind an item, slot or successor is mapped */
+#define htSnapshotAddress(base, offset, record)                                \
+((record) ? (base) + (offset)[htRecordReference(record) - 1] : 0)
+
+static bool htSnapshotWrite (FILE * file, const void * data, size_t bytes)
+{
+	return fwrite(data, 1, bytes, file) == bytes;
+}
+
+/* one record into block, which has room for it */
+static size_t htSnapshotRecord
+(
+	HashTableRecord record,
+	size_t base,
+	size_t * offset,
+	char * block
+) {
+	size_t at = base + offset[htRecordReference(record) - 1],
+		keyBytes = htSnapshotVariantBytes(record->key),
+		valueBytes = htSnapshotVariantBytes(record->value),
+		bytes = HashTableRecordSize + keyBytes + valueBytes;
+	sHashTableRecord * copy = (void *) block;
+	sHashTableVariant * key = (void *) (copy + 1),
+		* value = (void *) ((char *) key + keyBytes);
+	memset(block, 0, bytes);
+	memcpy(key, varhead(record->key), HashTableVariantSize +
+		varbytes(record->key));
+	memcpy(value, varhead(record->value), HashTableVariantSize +
+		varbytes(record->value));
+	key->private = value->private = NULL;
+	*copy = *record;
+	copy->key = (void *) (at + ((char *) key->data - block));
+	copy->value = (void *) (at + ((char *) value->data - block));
+	copy->successor = (void *)
+		htSnapshotAddress(base, offset, record->successor);
+	copy->extent = bytes, copy->capacity = htAlign(varbytes(record->value));
+	return bytes;
+}
+
+bool HashTableSaveSnapshot
+(
+	HashTable ht,
+	const char * path
+) {
+	htReturnIfTableUninitialized(ht);
+	size_t index, hash = 0;
+	while (hash < htSnapshotHashes && htSnapshotHash[hash] != ht->hashFunction)
+		hash++;
+	/* shards and custom hash functions cannot be put back together */
+	if (ht->shard || hash == htSnapshotHashes) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return false;
+	}
+	htExclusiveScope(ht);
+	htRehashComplete(ht);
+	htFlushHits(ht);
+
+	size_t slots = ht->slotCount, control =
+		(htOpenAddressing(ht)) ? htAlign(slots) : 0,
+		largest = 0, bytes;
+	sHashTableSnapshot header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, HT_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.layout[0] = HT_SNAPSHOT_ORDER,
+	header.layout[1] = sizeof(size_t),
+	header.layout[2] = HashTableRecordSize,
+	header.layout[3] = HashTableVariantSize;
+	/* somewhere a mapping is likely to fit, so it need not move */
+	header.base = ((size_t) 1 << 45) + ((htRandom() & 0xFFFF) << 30);
+	header.options = ht->options & ~HT_OPTION_ORDERED_INDEX,
+	header.hashFunction = hash, header.seed = ht->seed,
+	header.maxLoadFactor = ht->maxLoadFactor,
+	header.growthFactor = ht->growthFactor,
+	header.itemsUsed = ht->itemsUsed, header.itemsTotal = ht->itemsTotal,
+	header.slotCount = slots, header.slotsDeleted = ht->slotsDeleted;
+	header.item = sizeof(header);
+	header.slot = header.item + ht->itemsUsed * sizeof(size_t);
+	header.control = (control) ? header.slot + slots * sizeof(void*) : 0;
+	header.record = header.slot + slots * sizeof(void*) + control;
+
+	size_t * offset = malloc((ht->itemsUsed + 1) * sizeof(size_t));
+	htReturnIfAllocationFailure(offset, {});
+	for (index = 0, bytes = header.record; index < ht->itemsUsed; index++) {
+		HashTableRecord record = ht->item[index];
+		if (! record) continue;
+		size_t size = htSnapshotRecordBytes(record);
+		offset[index] = bytes, bytes += size, header.records += size;
+		if (size > largest) largest = size;
+	}
+	header.bytes = bytes;
+
+	char * block = malloc(largest + 1);
+	FILE * file = (block) ? fopen(path, "wb") : NULL;
+	if (! file) {
+		if (! block) errno = HT_ERROR_ALLOCATION_FAILURE;
+		free(offset), free(block);
+		return false;
+	}
+
+	bool written = htSnapshotWrite(file, &header, sizeof(header));
+	size_t address;
+	for (index = 0; written && index < ht->itemsUsed; index++)
+		address = htSnapshotAddress(header.base, offset, ht->item[index]),
+		written = htSnapshotWrite(file, &address, sizeof(address));
+	for (index = 0; written && index < slots; index++)
+		address = htSnapshotAddress(header.base, offset, ht->slot[index]),
+		written = htSnapshotWrite(file, &address, sizeof(address));
+	if (written && control) {
+		written = htSnapshotWrite(file, ht->control, slots);
+		for (index = slots, address = 0; written && index < control; index++)
+			written = htSnapshotWrite(file, &address, 1);
+	}
+	for (index = 0; written && index < ht->itemsUsed; index++)
+		if (ht->item[index]) written = htSnapshotWrite(file, block,
+			htSnapshotRecord(ht->item[index], header.base, offset, block));
+
+	free(offset), free(block);
+	/* errno is left as the failing call set it */
+	if (fclose(file) || ! written) return false;
+	return true;
+}
+
+static HashTable htMapSnapshot
+(
+	sHashTableSnapshot * header,
+	char * map,
+	HashTableEvent withEvents,
+	HashTableEventHandler eventHandler,
+	void * private
+) {
+	size_t index, delta = (size_t) map - header->base,
+		* item = (size_t *) (map + header->item),
+		* slot = (size_t *) (map + header->slot);
+	HashTableRecord record;
+
+	HashTable ht = NewHashTableWithOptions(header->slotCount,
+		header->options, withEvents, eventHandler, private);
+	if (! ht) return NULL;
+	if (ht->slotCount != header->slotCount) {
+		DestroyHashTable(&ht);
+		errno = HT_ERROR_INVALID_TYPE_REQUEST; return NULL;
+	}
+	if (! htReserveItems(ht, header->itemsUsed)) {
+		DestroyHashTable(&ht);
+		errno = HT_ERROR_ALLOCATION_FAILURE; return NULL;
+	}
+
+	/* the table owns the mapping from here on */
+	ht->snapshot = map, ht->snapshotBytes = header->bytes;
+	for (index = 0; index < header->itemsUsed; index++) {
+		if (! item[index]) continue;
+		record = (void *) (item[index] + delta);
+		if (delta) {
+			record->key = (char *) record->key + delta;
+			record->value = (char *) record->value + delta;
+			if (record->successor) record->successor =
+				(void *) ((char *) record->successor + delta);
+		}
+		ht->item[index] = record, htOccupy(ht, index);
+	}
+	for (index = 0; index < header->slotCount; index++)
+		ht->slot[index] = (slot[index]) ? (void *) (slot[index] + delta) : 0;
+	if (header->control)
+		memcpy(ht->control, map + header->control, header->slotCount);
+
+	ht->itemsUsed = header->itemsUsed, ht->itemsTotal = header->itemsTotal;
+	ht->slotsDeleted = header->slotsDeleted;
+	ht->hashFunction = htSnapshotHash[header->hashFunction];
+	ht->seed = header->seed;
+	ht->maxLoadFactor = header->maxLoadFactor;
+	ht->growthFactor = header->growthFactor;
+	ht->impact += header->records;
+	htRebuildReleasedReferences(ht);
+	return ht;
+}
+
+HashTable HashTableMapSnapshot
+(
+	const char * path,
+	HashTableEvent withEvents,
+	HashTableEventHandler eventHandler,
+	void * private
+) {
+	sHashTableSnapshot header;
+	struct stat status;
+	int file = open(path, O_RDONLY);
+	if (file < 0) return NULL;
+	if (fstat(file, &status) ||
+		pread(file, &header, sizeof(header), 0) != sizeof(header)) {
+		close(file); errno = HT_ERROR_INVALID_TYPE_REQUEST; return NULL;
+	}
+
+	size_t items = header.itemsUsed * sizeof(size_t),
+		slots = header.slotCount * sizeof(void*);
+	if (memcmp(header.magic, HT_SNAPSHOT_MAGIC, sizeof(header.magic))
+		|| ! htSnapshotLayout(&header)
+		|| header.bytes != (size_t) status.st_size
+		|| header.hashFunction >= htSnapshotHashes
+		|| header.item != sizeof(header) || header.slot != header.item + items
+		|| header.record > header.bytes || header.record < header.slot + slots
+		|| (header.control && header.control + header.slotCount > header.bytes)
+		|| header.options & HT_OPTION_ORDERED_INDEX) {
+		close(file); errno = HT_ERROR_INVALID_TYPE_REQUEST; return NULL;
+	}
+
+	/* at base nothing needs relocating; elsewhere is fine too */
+	char * map = mmap((void *) header.base, header.bytes,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+	close(file);
+	if (map == MAP_FAILED) return NULL;
+
+	HashTable ht = htMapSnapshot(
+		&header, map, withEvents, eventHandler, private
+	);
+	if (! ht) munmap(map, header.bytes);
+	return ht;
+}
+
+/*
+ * A file table survives its process only as it was at the last flush, which
+ * HashTableFlush makes and DestroyHashTable makes on the way out: the heap
+ * goes to disk first and then the header, with clean set. The first change
+ * afterwards takes clean back off on disk before going ahead, so a file
+ * whose process went away in between is refused rather than trusted, and
+ * HashTableSalvageFile is left to get back what it held at that flush. Flag
+ * and hit count changes to existing items do not count as changes.
+ *
+ * An existing file keeps the options it was created with, except for
+ * HT_OPTION_CONCURRENT, which is up to each open. Lock free reads and the
+ * ordered index keep state outside the heap and are not available; neither
+ * are HashTablePutData and flushing with a custom hash function. Pointer
+ * values are kept as they are.
+ */
+#define HT_FILE_MAGIC "HTHEAP\0\1"
+
+/* adds delta to a pointer into the heap, unless it is NULL */
+#define htFileRelocate(pointer, delta)                                         \
+((pointer) = (pointer) ? (void *) ((char *) (pointer) + (delta)) : NULL)
+
+/* everything in the heap and its header that points into the heap */
+static void htFileRelocateHeap (sHashTableHeap * heap, size_t delta)
+{
+	size_t index;
+	void ** link;
+	HashTableRecord record;
+	for (index = 0; index < HT_FILE_CLASSES; index++)
+		for (link = &heap->available[index]; *link; link = *link)
+			htFileRelocate(*link, delta);
+	htFileRelocate(heap->item, delta), htFileRelocate(heap->occupied, delta);
+	htFileRelocate(heap->released, delta), htFileRelocate(heap->slot, delta);
+	htFileRelocate(heap->control, delta);
+	for (index = 0; index < heap->itemsUsed; index++) {
+		htFileRelocate(heap->item[index], delta);
+		if (! (record = heap->item[index])) continue;
+		htFileRelocate(record->key, delta);
+		htFileRelocate(record->value, delta);
+		htFileRelocate(record->successor, delta);
+	}
+	for (index = 0; index < heap->slotCount; index++)
+		htFileRelocate(heap->slot[index], delta);
+	heap->base += delta;
+}
+
+static bool htFileSync (HashTable ht)
+{
+	HashTableFile file = ht->file;
+	sHashTableHeap * heap = file->heap;
+	size_t hash = 0;
+	while (hash < htSnapshotHashes && htSnapshotHash[hash] != ht->hashFunction)
+		hash++;
+	if (hash == htSnapshotHashes) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return false;
+	}
+	htRehashComplete(ht);
+	htFlushHits(ht);
+
+	heap->options = ht->options & ~HT_OPTION_CONCURRENT,
+	heap->hashFunction = hash, heap->seed = ht->seed,
+	heap->maxLoadFactor = ht->maxLoadFactor,
+	heap->growthFactor = ht->growthFactor,
+	heap->item = ht->item, heap->itemsUsed = ht->itemsUsed,
+	heap->itemsTotal = ht->itemsTotal, heap->itemsMax = ht->itemsMax,
+	heap->occupied = ht->occupied, heap->released = ht->released,
+	heap->releasedCount = ht->releasedCount,
+	heap->releasedMax = ht->releasedMax,
+	heap->slot = ht->slot, heap->slotCount = ht->slotCount,
+	heap->control = ht->control, heap->slotsDeleted = ht->slotsDeleted,
+	heap->impact = ht->impact;
+	if (msync(heap, heap->bytes, MS_SYNC)) return false;
+	heap->clean = true;
+	if (msync(heap, sizeof(sHashTableHeap), MS_SYNC)) return false;
+	__atomic_store_n(&file->dirty, false, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void htFileClose (HashTableFile file)
+{
+	if (file->heap) munmap(file->heap, file->reserved);
+	close(file->descriptor);
+	pthread_mutex_destroy(&file->lock);
+	free(file);
+}
+
+/* maps the file into freshly reserved address space, preferably at base */
+static bool htFileMap (HashTableFile file, sHashTableHeap * header)
+{
+	file->reserved = (header->bytes > HT_FILE_RESERVE) ?
+		header->bytes : HT_FILE_RESERVE;
+	char * region = mmap((void *) header->base, file->reserved, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (region == MAP_FAILED) return false;
+	if (mmap(region, header->bytes, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_FIXED, file->descriptor, 0) == MAP_FAILED) {
+		munmap(region, file->reserved);
+		return false;
+	}
+	file->heap = (sHashTableHeap *) region;
+	return true;
+}
+
+/*
+ * Opens the table kept in path, or makes a new one there of size slots when
+ * the file is missing or empty. The file is the table's memory: nothing is
+ * read up front, and only what gets used is paged in.
+ */
+HashTable HashTableOpenFile
+(
+	const char * path,
+	size_t size,
+	HashTableOption options,
+	HashTableEvent withEvents,
+	HashTableEventHandler eventHandler,
+	void * private
+) {
+	if (options & (HT_OPTION_LOCK_FREE_READS | HT_OPTION_ORDERED_INDEX)) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return HT_ERROR_SENTINEL;
+	}
+	HashTableFile file = calloc(1, sizeof(sHashTableFile));
+	htReturnIfAllocationFailure(file, {});
+	pthread_mutex_init(&file->lock, NULL);
+	sHashTableHeap header;
+	struct stat status;
+	if ((file->descriptor = open(path, O_RDWR | O_CREAT, 0644)) < 0
+		|| fstat(file->descriptor, &status)) {
+		if (file->descriptor >= 0) close(file->descriptor);
+		pthread_mutex_destroy(&file->lock), free(file);
+		return HT_ERROR_SENTINEL;
+	}
+	/* one table per file, in this process or any other */
+	if (flock(file->descriptor, LOCK_EX | LOCK_NB)) {
+		if (errno == EWOULDBLOCK) errno = HT_ERROR_UNSUPPORTED_FUNCTION;
+		close(file->descriptor);
+		pthread_mutex_destroy(&file->lock), free(file);
+		return HT_ERROR_SENTINEL;
+	}
+
+	bool created = ! status.st_size, valid = true;
+	if (created) {
+		size_t page = (size_t) sysconf(_SC_PAGESIZE);
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, HT_FILE_MAGIC, sizeof(header.magic));
+		header.layout[0] = HT_SNAPSHOT_ORDER,
+		header.layout[1] = sizeof(size_t),
+		header.layout[2] = HashTableRecordSize,
+		header.layout[3] = HashTableVariantSize;
+		/* as for snapshots, somewhere the file is likely to fit next time */
+		header.base = ((size_t) 1 << 45) + ((htRandom() & 0x3F) << 40);
+		header.bytes = (HT_FILE_INITIAL + page - 1) & ~(page - 1);
+		header.top = (sizeof(header) + 63) & ~(size_t) 63;
+		header.clean = true;
+		valid = ! ftruncate(file->descriptor, header.bytes);
+	} else if (pread(file->descriptor, &header, sizeof(header), 0)
+		!= sizeof(header)
+		|| memcmp(header.magic, HT_FILE_MAGIC, sizeof(header.magic))
+		|| ! htSnapshotLayout(&header)
+		|| header.bytes != (size_t) status.st_size
+		|| header.top > header.bytes
+		|| header.hashFunction >= htSnapshotHashes
+		|| header.options &
+			(HT_OPTION_LOCK_FREE_READS | HT_OPTION_ORDERED_INDEX)
+		|| ! header.clean) {
+		errno = HT_ERROR_INVALID_TYPE_REQUEST, valid = false;
+	}
+	if (! valid || ! htFileMap(file, &header)) {
+		htFileClose(file);
+		return HT_ERROR_SENTINEL;
+	}
+
+	sHashTableHeap * heap = file->heap;
+	if (created) *heap = header, heap->base = (size_t) heap;
+	else {
+		options = header.options | (options & HT_OPTION_CONCURRENT);
+		if ((char *) heap != (char *) header.base) {
+			htFileDirty(file);
+			htFileRelocateHeap(heap, (size_t) heap - header.base);
+		}
+	}
+
+	/* the heap takes the arena's place */
+	HashTable ht = htNewTable(size, options & ~HT_OPTION_ARENA, withEvents,
+		eventHandler, private, file);
+	if (! ht) {
+		htFileClose(file);
+		return HT_ERROR_SENTINEL;
+	}
+	if (! created) ht->hashFunction = htSnapshotHash[heap->hashFunction];
+	return ht;
+}
+
+bool HashTableFlush
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	if (! ht->file) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return false;
+	}
+	htExclusiveScope(ht);
+	return htFileSync(ht);
+}
+
+/*
+ * A log file is a header laid out like a snapshot's magic and layout, then
+ * entries. Replaying applies them in order through the public calls, so
+ * handlers hear of them, and stops at the first that is cut short or fails
+ * its check; the file is cut back to there. Replaying a log over a table
+ * that already has some of its changes does no harm, which is why a
+ * checkpoint can make its image before it empties the log.
+ *
+ * Values are logged as they are stored: pointer values as they were, and
+ * adopted data copied. Item flags are logged with each put but changing
+ * them afterwards is not.
+ */
+#define HT_LOG_MAGIC "HTLOG\0\0\1"
+
+typedef struct sHashTableLogHeader {
+	char magic[8];
+	size_t layout[4];
+} sHashTableLogHeader;
+
+/* the length and value HashTablePut takes to make this data again */
+#define htLogLength(type, bytes)                                               \
+((bytes) - (((type) & (HTI_UTF8 | HTI_UTF16 | HTI_UTF32)) >> 5))
+
+static double htLogValue (size_t type, char * data)
+{
+	if (type & HTI_DOUBLE) return vardouble(data);
+	if (type & (HTI_NUMBER | HTI_POINTER)) return dblval(varptr(data));
+	return dblval(data);
+}
+
+static void htLogApply (HashTable ht, sHashTableLogEntry * entry)
+{
+	char * key = (char *) (entry + 1),
+		* value = key + htAlign(entry->keyBytes);
+	size_t keyLength = htLogLength(entry->keyType, entry->keyBytes);
+	HashTableItem reference;
+	if (entry->operation == HT_LOG_PUT) htVoidExpression HashTablePut(
+		ht, keyLength, htLogValue(entry->keyType, key), entry->keyType,
+		htLogLength(entry->valueType, entry->valueBytes),
+		htLogValue(entry->valueType, value), entry->valueType
+	);
+	else if (entry->operation == HT_LOG_DELETE) {
+		reference = HashTableHasKey(ht, keyLength,
+			htLogValue(entry->keyType, key), entry->keyType);
+		if (reference) htVoidExpression HashTableDeleteItem(ht, reference);
+	} else if (entry->operation == HT_LOG_CLEAR)
+		HashTableClear((ht->shard && entry->keyType < ht->shardCount) ?
+			ht->shard[entry->keyType] : ht);
+}
+
+/* applies every whole entry and returns where the last one ends */
+static size_t htLogReplay (HashTable ht, int file, size_t bytes)
+{
+	size_t position = sizeof(sHashTableLogHeader), size;
+	char * map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, file, 0);
+	sHashTableLogEntry * entry;
+	if (map == MAP_FAILED) return 0;
+	while (position + sizeof(sHashTableLogEntry) <= bytes) {
+		entry = (sHashTableLogEntry *) (map + position);
+		size = bytes - position - sizeof(sHashTableLogEntry);
+		if (entry->keyBytes > size || entry->valueBytes > size
+			|| htLogEntryBytes(entry) > bytes - position
+			|| entry->check != htLogCheck(entry, entry + 1,
+				(char *) (entry + 1) + htAlign(entry->keyBytes)))
+			break;
+		htLogApply(ht, entry);
+		position += htLogEntryBytes(entry);
+	}
+	munmap(map, bytes);
+	return position;
+}
+
+/*
+ * Replays the log at path into the table, then logs every put, delete and
+ * clear to it, committing once batch entries are waiting or milliseconds
+ * have passed; 0 takes HT_LOG_BATCH or HT_LOG_LATENCY. Writes never wait
+ * for their commit, so a crash loses every write the last commit had not
+ * reached, even one that has long returned. Call HashTableCommitLog after
+ * any write that must survive a crash; it returns once that write is synced.
+ */
+bool HashTableAttachLog
+(
+	HashTable ht,
+	const char * path,
+	size_t batch,
+	size_t milliseconds
+) {
+	htReturnIfTableUninitialized(ht);
+	if (ht->parent || ht->log) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return false;
+	}
+	sHashTableLogHeader header = {
+		HT_LOG_MAGIC,
+		{ HT_SNAPSHOT_ORDER, sizeof(size_t), HashTableRecordSize,
+			HashTableVariantSize }
+	}, found;
+	struct stat status;
+	size_t end = sizeof(header), index;
+	int file = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (file < 0) return false;
+	if (fstat(file, &status)) { close(file); return false; }
+	if (! status.st_size) {
+		if (write(file, &header, sizeof(header)) != sizeof(header)
+			|| fdatasync(file)) { close(file); return false; }
+	} else if (pread(file, &found, sizeof(found), 0) != sizeof(found)
+		|| memcmp(found.magic, HT_LOG_MAGIC, sizeof(found.magic))
+		|| ! htSnapshotLayout(&found)) {
+		close(file); errno = HT_ERROR_INVALID_TYPE_REQUEST; return false;
+	} else if ((end = htLogReplay(ht, file, status.st_size)) <
+		sizeof(header) || (end < (size_t) status.st_size &&
+		(ftruncate(file, end) || fdatasync(file)))) {
+		close(file); return false;
+	}
+
+	HashTableLog log = calloc(1, sizeof(sHashTableLog));
+	htReturnIfAllocationFailure(log, close(file));
+	log->descriptor = file;
+	log->batch = (batch) ? batch : HT_LOG_BATCH;
+	log->latency = (milliseconds) ? milliseconds : HT_LOG_LATENCY;
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_mutex_init(&log->commit, NULL);
+	pthread_cond_init(&log->wake, NULL);
+	if (pthread_create(&log->thread, NULL, htLogThread, log)) {
+		pthread_cond_destroy(&log->wake);
+		pthread_mutex_destroy(&log->commit);
+		pthread_mutex_destroy(&log->lock);
+		free(log), close(file);
+		errno = HT_ERROR_ALLOCATION_FAILURE; return false;
+	}
+	for (index = 0; index < ht->shardCount; index++) {
+		htExclusiveScope(ht->shard[index]);
+		ht->shard[index]->log = log;
+	}
+	htExclusiveScope(ht);
+	ht->log = log;
+	return true;
+}
+
+/* returns once everything logged so far is on disk */
+bool HashTableCommitLog
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	if (! ht->log) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return false;
+	}
+	if (htLogCommit(ht->log)) return true;
+	errno = ht->log->error; return false;
+}
+
+/*
+ * Makes the table durable without the log, then empties it: the table is
+ * saved as a snapshot to a temporary file that replaces the one at snapshot
+ * once it is synced. Recovery maps that snapshot and attaches the log. A
+ * file table still needs a snapshot, since the first put after a flush
+ * would leave the file dirty and so unopenable after a crash; all
+ * HashTableSalvageFile gets back from it is the last flush. Sharded tables
+ * have no snapshots and so no checkpoints.
+ */
+bool HashTableCheckpoint
+(
+	HashTable ht,
+	const char * snapshot
+) {
+	htReturnIfTableUninitialized(ht);
+	HashTableLog log = ht->log;
+	if (! log || ht->shard || ! snapshot) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return false;
+	}
+	htExclusiveScope(ht);
+	if (! htLogCommit(log)) { errno = log->error; return false; }
+
+	size_t length = strlen(snapshot);
+	char * partial = malloc(length + sizeof(".partial"));
+	htReturnIfAllocationFailure(partial, {});
+	memcpy(partial, snapshot, length);
+	memcpy(partial + length, ".partial", sizeof(".partial"));
+	int file = -1;
+	bool saved = HashTableSaveSnapshot(ht, partial)
+		&& (file = open(partial, O_RDONLY)) >= 0 && ! fsync(file)
+		&& ! rename(partial, snapshot);
+	if (file >= 0) close(file);
+	if (! saved) unlink(partial);
+	free(partial);
+	if (! saved) return false;
+
+	pthread_mutex_lock(&log->commit);
+	if (ftruncate(log->descriptor, sizeof(sHashTableLogHeader))
+		|| fdatasync(log->descriptor)) log->error = errno;
+	pthread_mutex_unlock(&log->commit);
+	if (log->error) { errno = log->error; return false; }
+	return true;
+}
+
+/* where bytes at address in a file's heap are in map, if they are there */
+static char * htSalvageAt
+(
+	char * map, sHashTableHeap * header, const void * address, size_t bytes
+) {
+	size_t offset = (size_t) address - header->base;
+	if (! address || offset < sizeof(sHashTableHeap)
+		|| offset > header->bytes || bytes > header->bytes - offset)
+		return NULL;
+	return map + offset;
+}
+
+/* a key or value variant, all of it inside the heap, or NULL */
+static char * htSalvageVariant
+(
+	char * map, sHashTableHeap * header, const void * address
+) {
+	char * head = htSalvageAt(map, header, (char *) address
+		- HashTableVariantSize, HashTableVariantSize);
+	if (! head) return NULL;
+	return htSalvageAt(map, header, address,
+		((sHashTableVariant *) head)->bytes);
+}
+
+/*
+ * The way back from a file table that HashTableOpenFile refuses as dirty:
+ * puts every item the file at path held at its last flush into ht, which
+ * may be a new file table, and leaves the file as it was. The file is only
+ * read, and only once no process has it open. Records that have since been
+ * freed or reused are skipped when they do not lie wholly inside the file
+ * or their key no longer gives their hash, but a value changed in place
+ * comes back changed, and an item put into a deleted one's reference comes
+ * back too. Attaching the log afterwards brings back what it kept. Returns
+ * the number of items put.
+ */
+size_t HashTableSalvageFile
+(
+	HashTable ht,
+	const char * path
+) {
+	htReturnIfTableUninitialized(ht);
+	sHashTableHeap header;
+	struct stat status;
+	int file = open(path, O_RDONLY);
+	if (file < 0) return HT_ERROR_SENTINEL;
+	if (flock(file, LOCK_SH | LOCK_NB)) {
+		if (errno == EWOULDBLOCK) errno = HT_ERROR_UNSUPPORTED_FUNCTION;
+		close(file);
+		return HT_ERROR_SENTINEL;
+	}
+	/* a dirty file may have grown since its header last went to disk */
+	if (fstat(file, &status)
+		|| pread(file, &header, sizeof(header), 0) != sizeof(header)
+		|| memcmp(header.magic, HT_FILE_MAGIC, sizeof(header.magic))
+		|| ! htSnapshotLayout(&header)
+		|| header.hashFunction >= htSnapshotHashes
+		|| header.itemsUsed > (size_t) status.st_size / sizeof(void *)) {
+		errno = HT_ERROR_INVALID_TYPE_REQUEST;
+		close(file);
+		return HT_ERROR_SENTINEL;
+	}
+	header.bytes = (size_t) status.st_size;
+	char * map = mmap(NULL, header.bytes, PROT_READ, MAP_PRIVATE, file, 0);
+	if (map == MAP_FAILED) { close(file); return HT_ERROR_SENTINEL; }
+
+	HashTableHashFunction hash = htSnapshotHash[header.hashFunction];
+	HashTableRecord * item = (HashTableRecord *) htSalvageAt(map, &header,
+		header.item, header.itemsUsed * sizeof(void *));
+	HashTableRecord record;
+	size_t index, keyType, valueType, count = 0;
+	char * key, * value;
+	for (index = 0; item && index < header.itemsUsed; index++) {
+		record = (HashTableRecord) htSalvageAt(map, &header, item[index],
+			HashTableRecordSize);
+		if (! record || (size_t) record & (sizeof(void *) - 1)
+			|| ! (key = htSalvageVariant(map, &header, record->key))
+			|| ! (value = htSalvageVariant(map, &header, record->value))
+			|| hash(key, varlength(key) - varpadding(key), header.seed)
+				!= record->hash)
+			continue;
+		keyType = vartype(key), valueType = vartype(value);
+		if (HashTablePut(
+			ht, htLogLength(keyType, varbytes(key)),
+			htLogValue(keyType, key), keyType,
+			htLogLength(valueType, varbytes(value)),
+			htLogValue(valueType, value), valueType
+		)) count++;
+	}
+	munmap(map, header.bytes);
+	close(file);
+	if (! item && header.itemsUsed) errno = HT_ERROR_INVALID_TYPE_REQUEST;
+	return count;
+}
+
+/*
+ * HashTableSnapshot returns a read only handle on the table as it stands, for
+ * the price of a moment's exclusive lock and a pointer per HT_VIEW_CHUNK
+ * items. Lookups, item reads, enumeration and cursors on the handle see the
+ * items as they were while the table goes on changing, and each change made
+ * meanwhile costs at most a chunk and a record. Hit counts, slot figures and
+ * the reference limit are the table's. Puts to the handle fail, and so do
+ * Clear, Optimize, Compact and Sort on the table until the handle is
+ * destroyed, and so does DestroyHashTable, which leaves the table as it was.
+ * A table has one snapshot open at a time; sharded and ordered tables have
+ * none.
+ */
+HashTable HashTableSnapshot
+(
+	HashTable ht
+) {
+	htReturnIfTableUninitialized(ht);
+	if (ht->shard || ht->ordered || htViewing(ht)) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return HT_ERROR_SENTINEL;
+	}
+	htExclusiveScope(ht);
+	if (ht->view) {
+		errno = HT_ERROR_UNSUPPORTED_FUNCTION; return HT_ERROR_SENTINEL;
+	}
+
+	size_t chunks = (ht->itemsUsed + HT_VIEW_CHUNK - 1) / HT_VIEW_CHUNK;
+	HashTableView view = calloc(1, sizeof(sHashTableView));
+	HashTableRecordItems * chunk = calloc(chunks + 1, sizeof(void *));
+	htReturnIfAllocationFailure(view && chunk, free(view), free(chunk));
+	HashTable handle = NewHashTableWithOptions(0, 0, 0, NULL, NULL);
+	htReturnIfAllocationFailure(handle, free(view), free(chunk));
+
+	view->table = ht, view->chunk = chunk;
+	view->itemsUsed = ht->itemsUsed, view->itemsTotal = ht->itemsTotal;
+	handle->impact += sizeof(sHashTableView) + (chunks + 1) * sizeof(void *);
+	handle->viewing = ht->view = view;
+	return handle;
+}
+
+/* records only the view could still see go back to the table */
+static void htCloseView (HashTableView view)
+{
+	HashTable ht = view->table;
+	HashTableRecord record;
+	size_t chunk, index, first, count,
+		chunks = (view->itemsUsed + HT_VIEW_CHUNK - 1) / HT_VIEW_CHUNK;
+	htExclusiveScope(ht);
+	for (chunk = 0; chunk < chunks; chunk++) {
+		if (! view->chunk[chunk]) continue;
+		htFileChanging(ht);
+		first = chunk * HT_VIEW_CHUNK, count = view->itemsUsed - first;
+		if (count > HT_VIEW_CHUNK) count = HT_VIEW_CHUNK;
+		for (index = 0; index < count; index++) {
+			record = view->chunk[chunk][index];
+			if (record && record != ht->item[first + index]) {
+				htDisposeRecord(ht, record);
+			}
 		}
+		free(view->chunk[chunk]);
 	}
+	ht->view = NULL;
+	free(view->removed), free(view->chunk), free(view);
 }
 
 const char * HashTableErrorMessage
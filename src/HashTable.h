@@ -72,6 +72,20 @@ typedef HashTableItem (*HashTableEventHandler)
 	void * private
 );
 
+typedef enum eHashTableEventDelivery {
+	HT_DELIVER_ON_DEMAND = 0,
+	HT_DELIVER_ON_THREAD = HashTableBitFlag(1)
+} HashTableEventDelivery;
+
+typedef void (*HashTableEventBatchHandler)
+(
+	void * hashTable,
+	size_t count,
+	const HashTableEvent event[],
+	const HashTableItem reference[],
+	void * private
+);
+
 typedef enum eHashTableEnumerateDirection {
 	HT_ENUMERATE_FORWARD = 0,
 	HT_ENUMERATE_REVERSE = 1
@@ -85,10 +99,24 @@ typedef bool (*HashTableEnumerationHandler)
 	void * private
 );
 
+typedef void (*HashTableReductionHandler)
+(
+	void * hashTable,
+	void * partial,
+	void * private
+);
+
+typedef struct sHashTableCursor {
+	void * hashTable;
+	HashTableEnumerateDirection direction;
+	HashTableItem item;
+} HashTableCursor;
+
 typedef enum eHashTableSortType {
 	HT_SORT_NUMERIC     = HashTableBitFlag(1),
 	HT_SORT_ALPHA       = HashTableBitFlag(2),
-	HT_SORT_EMPTY_ITEMS = HashTableBitFlag(3)
+	HT_SORT_EMPTY_ITEMS = HashTableBitFlag(3),
+	HT_SORT_PARALLEL    = HashTableBitFlag(4)
 } HashTableSortType;
 
 typedef enum eHashTableSortDirection {
@@ -106,8 +134,50 @@ typedef HashTableItem (*HashTableSortHandler)
 	void * private
 );
 
+typedef enum eHashTableOption {
+	HT_OPTION_OPEN_ADDRESSING  = HashTableBitFlag(1),
+	HT_OPTION_ARENA            = HashTableBitFlag(2),
+	HT_OPTION_REUSE_REFERENCES = HashTableBitFlag(3),
+	HT_OPTION_WYHASH           = HashTableBitFlag(4),
+	HT_OPTION_INTEGER_HASH     = HashTableBitFlag(5),
+	HT_OPTION_RANDOM_SEED      = HashTableBitFlag(6),
+	HT_OPTION_CONCURRENT       = HashTableBitFlag(7),
+	HT_OPTION_LOCK_FREE_READS  = HashTableBitFlag(8),
+	HT_OPTION_ORDERED_INDEX    = HashTableBitFlag(9)
+} HashTableOption;
+
+typedef enum eHashTableHitCounting {
+	HT_HITS_EXACT      = 0,
+	HT_HITS_OFF        = HashTableBitFlag(1),
+	HT_HITS_SAMPLED    = HashTableBitFlag(2),
+	HT_HITS_PER_THREAD = HashTableBitFlag(3)
+} HashTableHitCounting;
+
+typedef size_t (*HashTableHashFunction)
+(
+	const void * key,
+	size_t length,
+	size_t seed
+);
+
+typedef size_t (*HashTableBulkSource)
+(
+	void * hashTable,
+	size_t count,
+	size_t keyLength[],
+	double key[],
+	size_t valueLength[],
+	double value[],
+	void * private
+);
+
 typedef const void * HashTableData;
 
+typedef void (*HashTableReleaser)
+(
+	HashTableData data
+);
+
 typedef enum eHashTableDataFlags {
 	HTI_NUMBER = 1 << 1,
 	HTI_DOUBLE = 1 << 2,
@@ -166,6 +236,25 @@ extern HashTable NewHashTable
 	void * userData
 );
 
+extern HashTable NewHashTableWithOptions
+(
+	size_t size,
+	HashTableOption options,
+	HashTableEvent withEvents,
+	HashTableEventHandler eventHandler,
+	void * userData
+);
+
+extern HashTable NewShardedHashTable
+(
+	size_t shards,
+	size_t size,
+	HashTableOption options,
+	HashTableEvent withEvents,
+	HashTableEventHandler eventHandler,
+	void * userData
+);
+
 extern void OptimizeHashTable
 (
 	HashTable hashTable,
@@ -173,11 +262,74 @@ extern void OptimizeHashTable
 	size_t references
 );
 
+extern size_t CompactHashTable
+(
+	HashTable hashTable,
+	size_t references
+);
+
 void DestroyHashTable
 (
 	HashTable * ht
 );
 
+void HashTableClear
+(
+	HashTable hashTable
+);
+
+size_t HashTableJenkinsHash
+(
+	const void * key,
+	size_t length,
+	size_t seed
+);
+
+size_t HashTableWyHash
+(
+	const void * key,
+	size_t length,
+	size_t seed
+);
+
+size_t HashTableIntegerHash
+(
+	const void * key,
+	size_t length,
+	size_t seed
+);
+
+bool HashTableSetHashFunction
+(
+	HashTable hashTable,
+	HashTableHashFunction function,
+	size_t seed
+);
+
+bool HashTableSetGrowthPolicy
+(
+	HashTable hashTable,
+	double maxLoadFactor,
+	double growthFactor
+);
+
+bool HashTableSetHitCounting
+(
+	HashTable hashTable,
+	HashTableHitCounting counting
+);
+
+size_t HashTableReadBegin
+(
+	HashTable hashTable
+);
+
+bool HashTableReadEnd
+(
+	HashTable hashTable,
+	size_t ticket
+);
+
 void HashTableRegisterEvents
 (
 	HashTable hashTable,
@@ -185,6 +337,20 @@ void HashTableRegisterEvents
 	HashTableEventHandler eventHandler
 );
 
+bool HashTableRegisterAsyncEvents
+(
+	HashTable hashTable,
+	HashTableEvent withEvents,
+	HashTableEventBatchHandler batchHandler,
+	size_t capacity,
+	HashTableEventDelivery delivery
+);
+
+size_t HashTableDeliverEvents
+(
+	HashTable hashTable
+);
+
 /* Statistics */
 // =============================================================================
 
@@ -296,6 +462,40 @@ HashTableItem HashTablePutItemByKeyData
 	HashTableData realData
 );
 
+HashTableItem HashTablePutData
+(
+	HashTable hashTable,
+	size_t keyLength,
+	double key,
+	HashTableDataFlags keyHint,
+	HashTableData data,
+	HashTableReleaser releaser
+);
+
+size_t HashTableBulkLoad
+(
+	HashTable hashTable,
+	size_t count,
+	size_t keyLength[],
+	double key[],
+	HashTableDataFlags keyHint,
+	size_t valueLength[],
+	double value[],
+	HashTableDataFlags valueHint,
+	bool unique
+);
+
+size_t HashTableBulkLoadFrom
+(
+	HashTable hashTable,
+	size_t count,
+	HashTableBulkSource source,
+	HashTableDataFlags keyHint,
+	HashTableDataFlags valueHint,
+	bool unique,
+	void * userData
+);
+
 HashTableItem HashTableGetItemByKey
 (
 	HashTable hashTable,
@@ -310,6 +510,74 @@ HashTableItem HashTableGet
 	HashTableDataFlags hint
 );
 
+size_t HashTableGetMany
+(
+	HashTable hashTable,
+	size_t count,
+	size_t keyLength[],
+	double key[],
+	HashTableDataFlags hint,
+	HashTableItem item[]
+);
+
+size_t HashTableHashBytes
+(
+	HashTable hashTable,
+	const void * key,
+	size_t keyLength
+);
+
+HashTableItem HashTableHasBytes
+(
+	HashTable hashTable,
+	const void * key,
+	size_t keyLength
+);
+
+HashTableItem HashTableGetBytes
+(
+	HashTable hashTable,
+	const void * key,
+	size_t keyLength
+);
+
+HashTableItem HashTablePutBytes
+(
+	HashTable hashTable,
+	const void * key,
+	size_t keyLength,
+	size_t valueLength,
+	double value,
+	HashTableDataFlags valueHint
+);
+
+HashTableItem HashTableHasHashed
+(
+	HashTable hashTable,
+	size_t hash,
+	const void * key,
+	size_t keyLength
+);
+
+HashTableItem HashTableGetHashed
+(
+	HashTable hashTable,
+	size_t hash,
+	const void * key,
+	size_t keyLength
+);
+
+HashTableItem HashTablePutHashed
+(
+	HashTable hashTable,
+	size_t hash,
+	const void * key,
+	size_t keyLength,
+	size_t valueLength,
+	double value,
+	HashTableDataFlags valueHint
+);
+
 bool HashTableDeleteItem
 (
 	HashTable hashTable,
@@ -328,6 +596,14 @@ HashTableData HashTableItemData
 	HashTableItem reference
 );
 
+size_t HashTableItemCopyData
+(
+	HashTable hashTable,
+	HashTableItem reference,
+	void * buffer,
+	size_t size
+);
+
 size_t HashTableDataLength
 (
 	HashTableData data
@@ -393,6 +669,16 @@ void HashTableEnumerate
 	void * private
 );
 
+size_t HashTableParallelEnumerate
+(
+	HashTable hashTable,
+	size_t threads,
+	HashTableEnumerationHandler handler,
+	void * partial[],
+	HashTableReductionHandler reduce,
+	void * private
+);
+
 void HashTableSortItems
 (
 	HashTable hashTable,
@@ -421,6 +707,169 @@ void HashTableEnumerateItemHash
 	void * private
 );
 
+/* Cursors */
+// =============================================================================
+
+HashTableItem HashTableCursorBegin
+(
+	HashTable hashTable,
+	HashTableEnumerateDirection direction,
+	HashTableCursor * cursor
+);
+
+HashTableItem HashTableCursorNext
+(
+	HashTableCursor * cursor
+);
+
+HashTableItem HashTableCursorPrevious
+(
+	HashTableCursor * cursor
+);
+
+HashTableItem HashTableCursorSeek
+(
+	HashTableCursor * cursor,
+	HashTableItem reference
+);
+
+/* Ordered Index */
+// =============================================================================
+
+HashTableItem HashTableFirstItem
+(
+	HashTable hashTable
+);
+
+HashTableItem HashTableLastItem
+(
+	HashTable hashTable
+);
+
+HashTableItem HashTableLowerBound
+(
+	HashTable hashTable,
+	size_t keyLength,
+	double key,
+	HashTableDataFlags hint
+);
+
+HashTableItem HashTableUpperBound
+(
+	HashTable hashTable,
+	size_t keyLength,
+	double key,
+	HashTableDataFlags hint
+);
+
+HashTableItem HashTableNextItem
+(
+	HashTable hashTable,
+	HashTableItem reference
+);
+
+HashTableItem HashTablePreviousItem
+(
+	HashTable hashTable,
+	HashTableItem reference
+);
+
+size_t HashTableEnumerateRange
+(
+	HashTable hashTable,
+	size_t lowLength,
+	double low,
+	HashTableDataFlags lowHint,
+	size_t highLength,
+	double high,
+	HashTableDataFlags highHint,
+	HashTableEnumerateDirection direction,
+	HashTableEnumerationHandler handler,
+	void * private
+);
+
+size_t HashTableEnumeratePrefix
+(
+	HashTable hashTable,
+	size_t prefixLength,
+	double prefix,
+	HashTableDataFlags hint,
+	HashTableEnumerateDirection direction,
+	HashTableEnumerationHandler handler,
+	void * private
+);
+
+/* Snapshots */
+// =============================================================================
+
+bool HashTableSaveSnapshot
+(
+	HashTable hashTable,
+	const char * path
+);
+
+HashTable HashTableMapSnapshot
+(
+	const char * path,
+	HashTableEvent withEvents,
+	HashTableEventHandler eventHandler,
+	void * private
+);
+
+/* File Backed Tables */
+// =============================================================================
+
+HashTable HashTableOpenFile
+(
+	const char * path,
+	size_t size,
+	HashTableOption options,
+	HashTableEvent withEvents,
+	HashTableEventHandler eventHandler,
+	void * private
+);
+
+bool HashTableFlush
+(
+	HashTable hashTable
+);
+
+size_t HashTableSalvageFile
+(
+	HashTable hashTable,
+	const char * path
+);
+
+/* Write Ahead Logs */
+// =============================================================================
+
+bool HashTableAttachLog
+(
+	HashTable hashTable,
+	const char * path,
+	size_t batch,
+	size_t milliseconds
+);
+
+bool HashTableCommitLog
+(
+	HashTable hashTable
+);
+
+bool HashTableCheckpoint
+(
+	HashTable hashTable,
+	const char * snapshot
+);
+
+/* Snapshot Views */
+// =============================================================================
+
+HashTable HashTableSnapshot
+(
+	HashTable hashTable
+);
+
 const char * HashTableErrorMessage
 (
 	void
@@ -0,0 +1,116 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Adopts value buffers into every kind of table and counts what comes back
+ * through the releaser: each buffer exactly once, whether its value is
+ * replaced, deleted, cleared, destroyed with the table or refused by a put
+ * handler, and never while the table still holds it.
+ */
+
+#define KEYS 2000
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-adopt: " __VA_ARGS__), fputc('\n', stderr);          \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][24];
+static int released[KEYS];
+static size_t releases;
+
+/* every adopted buffer starts with the index of its key */
+static void release(HashTableData data)
+{
+	size_t index = strtoul(data, NULL, 10);
+	check(index < KEYS && ! released[index]++, "buffer %zu released twice",
+		index);
+	releases++;
+	FreeHashTableUserData(&data);
+}
+
+static HashTableData adopt(size_t index)
+{
+	char value[48];
+	sprintf(value, "%zu, adopted for %s", index, key[index]);
+	HashTableData data = HashTableUserData(utf8var(value));
+	check(data, "no buffer for %s", key[index]);
+	return data;
+}
+
+/* puts of the vetoed key are refused */
+static HashTableItem onPut
+(
+	void * ht, HashTableEvent event, HashTableItem item, void * private
+) {
+	return (strcmp(HashTableItemKey(ht, item), key[0])) ? item : 0;
+}
+
+static void run(HashTableOption options, const char * name)
+{
+	HashTable ht = NewHashTableWithOptions(0, options, HT_EVENT_PUT, onPut,
+		NULL);
+	size_t index;
+	check(ht, "%s: no table", name);
+	memset(released, 0, sizeof(released)), releases = 0;
+
+	/* lock free tables hand it back once no reader can be holding it */
+	check(! HashTablePutData(ht, utf8var(key[0]), adopt(0), release),
+		"%s: a vetoed put was stored", name);
+	if (! (options & HT_OPTION_LOCK_FREE_READS))
+		check(releases == 1, "%s: a vetoed buffer was kept", name);
+	for (index = 1; index < KEYS; index++) {
+		HashTableData data = adopt(index);
+		/* even buffers go back to free */
+		HashTableItem item = HashTablePutData(ht, utf8var(key[index]), data,
+			(index & 1) ? release : NULL);
+		check(item, "%s: adopt %s failed", name, key[index]);
+		check(HashTableItemData(ht, item) == data,
+			"%s: %s was copied, not adopted", name, key[index]);
+	}
+	check(releases == (size_t) released[0], "%s: %zu buffers released "
+		"while still held", name, releases);
+
+	/* replaced and deleted values go back at once but for lock free reads */
+	for (index = 1; index < KEYS; index += 4)
+		check(HashTablePut(ht, utf8var(key[index]), utf8var("copied")),
+			"%s: replace %s failed", name, key[index]);
+	for (index = 3; index < KEYS; index += 4)
+		check(HashTableDeleteItem(ht, HashTableGet(ht, utf8var(key[index]))),
+			"%s: delete %s failed", name, key[index]);
+	if (! (options & HT_OPTION_LOCK_FREE_READS))
+		check(releases == 1 + KEYS / 2, "%s: %zu of %d replaced or deleted "
+			"buffers released", name, releases - 1, KEYS / 2);
+
+	/* what is left goes back with the clear */
+	HashTableClear(ht);
+	check(released[0] == 1, "%s: the vetoed buffer was kept", name);
+	for (index = 1; index < KEYS; index += 2)
+		check(released[index] == 1, "%s: buffer %zu not released", name,
+			index);
+
+	/* and with the table */
+	check(HashTablePutData(ht, utf8var(key[1]), adopt(1), release),
+		"%s: adopt after clearing failed", name);
+	released[1] = 0;
+	DestroyHashTable(&ht);
+	check(released[1] == 1, "%s: buffer 1 outlived its table", name);
+	printf("%s: ok, %zu buffers released\n", name, releases);
+}
+
+int main ( int argc, char **argv )
+{
+	size_t index;
+	for (index = 0; index < KEYS; index++)
+		sprintf(key[index], "key %zu", index);
+	run(0, "chained");
+	run(HT_OPTION_OPEN_ADDRESSING, "open addressing");
+	run(HT_OPTION_ARENA, "arena");
+	run(HT_OPTION_CONCURRENT, "concurrent");
+	run(HT_OPTION_LOCK_FREE_READS, "lock free");
+	return 0;
+}
@@ -0,0 +1,152 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Punches holes in the item index and closes them, all at once with
+ * OptimizeHashTable and a few at a time with CompactHashTable. Afterwards
+ * there must be no holes, every key must find its item at the reference it
+ * now has, and puts, including those reusing released references, must go
+ * on working. Tables whose references others still hold, lock free ones
+ * and those under a snapshot, refuse to be compacted.
+ */
+
+#define KEYS 20000
+#define STEP 500
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-compact: " __VA_ARGS__), fputc('\n', stderr);        \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][16];
+static bool live[KEYS];
+
+/* sharded references interleave the shards, so only the shards are dense */
+static bool sharded;
+
+static void fill(HashTable ht, const char * name)
+{
+	size_t index;
+	for (index = 0; index < KEYS; index++) {
+		check(HashTablePut(ht, utf8var(key[index]), utf8var(key[index])),
+			"%s: put %s failed", name, key[index]);
+		live[index] = true;
+	}
+	/* a solid run of holes and scattered ones */
+	for (index = 0; index < KEYS; index++) {
+		if ((index < 4000 || index % 3) && index < KEYS - 2000) continue;
+		check(HashTableDeleteItem(ht, HashTableGet(ht, utf8var(key[index]))),
+			"%s: delete %s failed", name, key[index]);
+		live[index] = false;
+	}
+}
+
+/* no holes, and every key at a reference that names it */
+static void verify(HashTable ht, const char * name)
+{
+	size_t index, count = 0;
+	for (index = 0; index < KEYS; index++) {
+		HashTableItem item = HashTableGet(ht, utf8var(key[index]));
+		check(!! item == live[index], "%s: %s is %s", name, key[index],
+			(item) ? "present" : "missing");
+		if (! item) continue;
+		count++;
+		check((sharded || item <= HashTableItemsTotal(ht))
+			&& ! strcmp(HashTableItemKey(ht, item), key[index])
+			&& ! strcmp(HashTableItemData(ht, item), key[index]),
+			"%s: %s is lost at %zu", name, key[index], item);
+	}
+	check(count == HashTableItemsTotal(ht), "%s: %zu items counted as %zu",
+		name, count, HashTableItemsTotal(ht));
+	check(sharded || HashTableItemsUsed(ht) == count, "%s: %zu used for %zu "
+		"items", name, HashTableItemsUsed(ht), count);
+}
+
+/* puts after the holes are gone, some into released references */
+static void refill(HashTable ht, const char * name)
+{
+	size_t index;
+	for (index = 0; index < KEYS; index += 2) {
+		if (live[index]) continue;
+		check(HashTablePut(ht, utf8var(key[index]), utf8var(key[index])),
+			"%s: put %s again failed", name, key[index]);
+		live[index] = true;
+	}
+	verify(ht, name);
+}
+
+static void run(HashTable ht, const char * name)
+{
+	size_t holes, calls = 0;
+	check(ht, "%s: no table", name);
+	fill(ht, name);
+	OptimizeHashTable(ht, 0, 0);
+	verify(ht, name);
+	refill(ht, name);
+
+	/* padded out, with slots to spare */
+	fill(ht, name);
+	OptimizeHashTable(ht, 3 * KEYS, KEYS);
+	verify(ht, name);
+	refill(ht, name);
+
+	/* a step at a time, never more than a step's worth of items moved */
+	fill(ht, name);
+	size_t before = CompactHashTable(ht, 0);
+	while ((holes = CompactHashTable(ht, STEP))) {
+		check(holes < before && before - holes <= STEP, "%s: %zu holes "
+			"after %zu", name, holes, before);
+		before = holes, calls++;
+	}
+	verify(ht, name);
+	check(calls > 1, "%s: compacted in %zu steps", name, calls);
+	refill(ht, name);
+	DestroyHashTable(&ht);
+	printf("%s: ok, %zu compaction steps\n", name, calls);
+}
+
+int main ( int argc, char **argv )
+{
+	size_t index;
+	for (index = 0; index < KEYS; index++)
+		sprintf(key[index], "key %zu", index);
+	run(NewHashTable(0, 0, NULL, NULL), "plain");
+	run(NewHashTableWithOptions(0, HT_OPTION_OPEN_ADDRESSING, 0, NULL, NULL),
+		"open addressing");
+	run(NewHashTableWithOptions(0, HT_OPTION_REUSE_REFERENCES
+		| HT_OPTION_ARENA, 0, NULL, NULL), "reuse");
+	run(NewHashTableWithOptions(0, HT_OPTION_CONCURRENT
+		| HT_OPTION_REUSE_REFERENCES, 0, NULL, NULL), "concurrent");
+	sharded = true;
+	run(NewShardedHashTable(4, 0, 0, 0, NULL, NULL), "sharded");
+
+	HashTable ht = NewHashTableWithOptions(0, HT_OPTION_LOCK_FREE_READS, 0,
+		NULL, NULL);
+	errno = 0;
+	check(CompactHashTable(ht, STEP) == (size_t) -1
+		&& errno == HT_ERROR_UNSUPPORTED_FUNCTION,
+		"a lock free table was compacted");
+	DestroyHashTable(&ht);
+
+	/* nor one under a snapshot, which still names the old references */
+	sharded = false;
+	ht = NewHashTable(0, 0, NULL, NULL);
+	fill(ht, "snapshot");
+	HashTable view = HashTableSnapshot(ht);
+	errno = 0;
+	check(CompactHashTable(ht, STEP) == (size_t) -1
+		&& errno == HT_ERROR_UNSUPPORTED_FUNCTION,
+		"a table was compacted under its snapshot");
+	check(CompactHashTable(view, STEP) == (size_t) -1,
+		"a snapshot was compacted");
+	DestroyHashTable(&view);
+	check(CompactHashTable(ht, KEYS) == 0, "holes left after the snapshot");
+	verify(ht, "snapshot");
+	DestroyHashTable(&ht);
+	return 0;
+}
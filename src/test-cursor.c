@@ -0,0 +1,116 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Walks tables with long runs of deleted items by cursor, forward and in
+ * reverse, deleting as it goes, putting a cursor aside and resuming it, and
+ * seeking onto deleted items. Every walk must meet exactly the items
+ * HashTableHasItem knows of, in reference order.
+ */
+
+#define KEYS 6000
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-cursor: " __VA_ARGS__), fputc('\n', stderr);         \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][16];
+static HashTableItem highest;
+
+/* the first item at or beyond reference in the direction, 0 for none */
+static HashTableItem expect(HashTable ht, HashTableItem reference,
+	bool forward)
+{
+	while (reference && reference <= highest
+		&& ! HashTableHasItem(ht, reference))
+		reference = (forward) ? reference + 1 : reference - 1;
+	return (reference <= highest) ? reference : 0;
+}
+
+static void walk(HashTable ht, HashTableEnumerateDirection direction,
+	const char * name)
+{
+	bool forward = direction == HT_ENUMERATE_FORWARD;
+	HashTableCursor cursor, aside;
+	HashTableItem item, wanted = expect(ht, (forward) ? 1 : highest, forward);
+	size_t count = 0;
+	for (item = HashTableCursorBegin(ht, direction, &cursor); item;
+		item = HashTableCursorNext(&cursor)) {
+		check(item == wanted, "%s: the cursor met %zu, not %zu", name, item,
+			wanted);
+		/* half way, walk a copy to the end and come back to this one */
+		if (++count == 1000) {
+			aside = cursor;
+			while (HashTableCursorNext(&aside));
+		}
+		wanted = expect(ht, (forward) ? item + 1 : item - 1, forward);
+	}
+	check(! wanted, "%s: the cursor stopped short of %zu", name, wanted);
+	check(HashTableCursorNext(&cursor) == expect(ht, (forward) ? 1 : highest,
+		forward), "%s: a finished cursor does not start over", name);
+}
+
+static void run(HashTable ht, const char * name)
+{
+	size_t index;
+	HashTableCursor cursor;
+	HashTableItem item, reference[KEYS];
+	check(ht, "%s: no table", name);
+	highest = 0;
+	for (index = 0; index < KEYS; index++) {
+		reference[index] = HashTablePut(ht, utf8var(key[index]), utf8var("x"));
+		check(reference[index], "%s: put %s failed", name, key[index]);
+		if (reference[index] > highest) highest = reference[index];
+	}
+	/* a long run of holes, and holes scattered everywhere */
+	for (index = 500; index < 1700; index++)
+		HashTableDeleteItem(ht, reference[index]);
+	for (index = 0; index < KEYS; index += 7)
+		HashTableDeleteItem(ht, reference[index]);
+	walk(ht, HT_ENUMERATE_FORWARD, name);
+	walk(ht, HT_ENUMERATE_REVERSE, name);
+
+	/* deleting the cursor's own item does not lose its place */
+	size_t left = HashTableItemsTotal(ht), met = 0;
+	for (item = HashTableCursorBegin(ht, HT_ENUMERATE_FORWARD, &cursor); item;
+		item = HashTableCursorNext(&cursor)) {
+		met++;
+		if (item & 1) check(HashTableDeleteItem(ht, item),
+			"%s: delete %zu failed", name, item);
+	}
+	check(met == left, "%s: met %zu of %zu items while deleting", name, met,
+		left);
+	walk(ht, HT_ENUMERATE_FORWARD, name);
+
+	/* seeking onto a hole lands on the next item in the direction */
+	HashTableCursorBegin(ht, HT_ENUMERATE_REVERSE, &cursor);
+	check(HashTableCursorSeek(&cursor, reference[1000])
+		== expect(ht, reference[1000], false), "%s: reverse seek", name);
+	item = cursor.item;
+	check(HashTableCursorPrevious(&cursor) == expect(ht, item + 1, true),
+		"%s: step back", name);
+	HashTableCursorBegin(ht, HT_ENUMERATE_FORWARD, &cursor);
+	check(HashTableCursorSeek(&cursor, reference[1000])
+		== expect(ht, reference[1000], true), "%s: forward seek", name);
+	DestroyHashTable(&ht);
+	printf("%s: ok\n", name);
+}
+
+int main ( int argc, char **argv )
+{
+	size_t index;
+	for (index = 0; index < KEYS; index++)
+		sprintf(key[index], "key %zu", index);
+	run(NewHashTable(0, 0, NULL, NULL), "plain");
+	run(NewHashTableWithOptions(0, HT_OPTION_CONCURRENT, 0, NULL, NULL),
+		"concurrent");
+	run(NewHashTableWithOptions(0, HT_OPTION_LOCK_FREE_READS, 0, NULL, NULL),
+		"lock free");
+	run(NewShardedHashTable(4, 0, 0, 0, NULL, NULL), "sharded");
+	return 0;
+}
@@ -0,0 +1,136 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Queues put, get and delete events through a ring far smaller than the
+ * work, delivered on demand and by the delivery thread, and checks that
+ * every event arrives once, in order for a single producer, with the
+ * reference the call returned, and that a vetoed put is never queued.
+ */
+
+#define WRITERS 4
+#define KEYS 3000
+#define RING 64
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-events: " __VA_ARGS__), fputc('\n', stderr);         \
+    exit(1);                                                                   \
+}
+
+static char key[WRITERS][KEYS][24];
+static HashTableEvent queued[3 * KEYS];
+static HashTableItem reference[3 * KEYS], expected[3 * KEYS];
+static size_t count, total;
+static HashTable table;
+
+/* the delivery thread and inline deliveries never overlap */
+static void onBatch
+(
+	void * ht, size_t events, const HashTableEvent event[],
+	const HashTableItem item[], void * private
+) {
+	size_t index;
+	/* batches run up to HT_EVENT_BATCH, 256 unless built otherwise */
+	check(events && events <= 256, "a batch of %zu events", events);
+	for (index = 0; index < events; index++) {
+		if (count < 3 * KEYS)
+			queued[count] = event[index], reference[count] = item[index];
+		count++;
+	}
+	__atomic_add_fetch(&total, events, __ATOMIC_RELAXED);
+}
+
+/* the last key is refused */
+static HashTableItem onPut
+(
+	void * ht, HashTableEvent event, HashTableItem item, void * private
+) {
+	return (strcmp(HashTableItemKey(ht, item), key[0][KEYS - 1])) ? item : 0;
+}
+
+static void ordered(HashTable ht, const char * name)
+{
+	size_t index, events = 0;
+	check(ht && HashTableRegisterAsyncEvents(ht,
+		HT_EVENT_PUT | HT_EVENT_GET | HT_EVENT_DELETE, onBatch, RING,
+		HT_DELIVER_ON_DEMAND), "%s: no table", name);
+	count = total = 0;
+	for (index = 0; index < KEYS - 1; index++) {
+		expected[events++] =
+			HashTablePut(ht, utf8var(key[0][index]), utf8var(key[0][index]));
+		check(expected[events - 1], "%s: put %s failed", name,
+			key[0][index]);
+	}
+	check(! HashTablePut(ht, utf8var(key[0][KEYS - 1]), utf8var("refused")),
+		"%s: the veto was ignored", name);
+	for (index = 0; index < KEYS - 1; index++)
+		expected[events++] = HashTableGet(ht, utf8var(key[0][index]));
+	for (index = 0; index < KEYS - 1; index += 2) {
+		HashTableItem item = HashTableGet(ht, utf8var(key[0][index]));
+		check(HashTableDeleteItem(ht, item), "%s: delete %s failed", name,
+			key[0][index]);
+		expected[events++] = item, expected[events++] = item;
+	}
+	/* a ring this small must have filled and delivered inline */
+	check(count > 0, "%s: nothing delivered before the ring filled", name);
+	HashTableDeliverEvents(ht);
+	check(count == events, "%s: %zu of %zu events delivered", name, count,
+		events);
+	for (index = 0; index < events; index++) {
+		HashTableEvent event = (index < KEYS - 1) ? HT_EVENT_PUT
+			: (index < 2 * (KEYS - 1)) ? HT_EVENT_GET
+			: ((index - 2 * (KEYS - 1)) & 1) ? HT_EVENT_DELETE : HT_EVENT_GET;
+		check(queued[index] == event && reference[index] == expected[index],
+			"%s: event %zu is %d on %zu, not %d on %zu", name, index,
+			queued[index], reference[index], event, expected[index]);
+	}
+	DestroyHashTable(&ht);
+	printf("%s: ok, %zu events\n", name, events);
+}
+
+static void * writer(void * private)
+{
+	size_t index, self = (size_t) private;
+	for (index = 0; index < KEYS; index++)
+		check(HashTablePut(table, utf8var(key[self][index]), utf8var("x")),
+			"put %s failed", key[self][index]);
+	return NULL;
+}
+
+/* events from every thread reach the delivery thread, or the destroy */
+static void threaded(HashTableOption options, const char * name)
+{
+	pthread_t thread[WRITERS];
+	size_t index;
+	table = NewHashTableWithOptions(0, options, 0, NULL, NULL);
+	check(table && HashTableRegisterAsyncEvents(table, HT_EVENT_PUT, onBatch,
+		RING, HT_DELIVER_ON_THREAD), "%s: no table", name);
+	count = total = 0;
+	for (index = 0; index < WRITERS; index++)
+		pthread_create(thread + index, NULL, writer, (void *) index);
+	for (index = 0; index < WRITERS; index++)
+		pthread_join(thread[index], NULL);
+	DestroyHashTable(&table);
+	check(total == WRITERS * KEYS, "%s: %zu of %d events delivered", name,
+		total, WRITERS * KEYS);
+	printf("%s: ok, %zu events\n", name, total);
+}
+
+int main ( int argc, char **argv )
+{
+	size_t self, index;
+	for (self = 0; self < WRITERS; self++)
+		for (index = 0; index < KEYS; index++)
+			sprintf(key[self][index], "w%zu-%zu", self, index);
+	ordered(NewHashTable(0, HT_EVENT_PUT, onPut, NULL), "on demand");
+	ordered(NewShardedHashTable(4, 0, 0, HT_EVENT_PUT, onPut, NULL),
+		"sharded");
+	threaded(HT_OPTION_CONCURRENT, "delivery thread");
+	threaded(HT_OPTION_LOCK_FREE_READS, "lock free delivery thread");
+	return 0;
+}
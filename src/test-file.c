@@ -0,0 +1,206 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * Fills a file table well past its initial size, closes it and opens it
+ * again, first where it was and then with its base taken, so that it has to
+ * move. A file left open by a process that died must be refused, and so
+ * must a second open of a file in use, but salvaging it must give back
+ * every item it held when last flushed.
+ */
+
+#define KEYS 30000
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-file: " __VA_ARGS__), fputc('\n', stderr);           \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][24], value[KEYS][80];
+static HashTableItem reference[KEYS];
+
+static void verify(HashTable ht, const char * name)
+{
+	size_t index, live = 0;
+	for (index = 0; index < KEYS; index++) {
+		HashTableItem item = HashTableGet(ht, utf8var(key[index]));
+		check(item == reference[index], "%s: %s is at %zu, not %zu", name,
+			key[index], (size_t) item, (size_t) reference[index]);
+		if (! item) continue;
+		live++;
+		check(! strcmp(HashTableItemKey(ht, item), key[index])
+			&& ! strcmp(HashTableItemData(ht, item), value[index]),
+			"%s: %s does not read back", name, key[index]);
+	}
+	check(HashTableItemsTotal(ht) == live, "%s: %zu items, not %zu", name,
+		HashTableItemsTotal(ht), live);
+}
+
+static size_t fileSize(const char * path)
+{
+	struct stat status;
+	check(! stat(path, &status), "cannot stat %s", path);
+	return (size_t) status.st_size;
+}
+
+/* the base a file would like to be mapped at, as its header records it */
+static size_t fileBase(const char * path)
+{
+	size_t base = 0;
+	int file = open(path, O_RDONLY);
+	check(file >= 0 && pread(file, &base, sizeof(base), 8 + 4 * sizeof(size_t))
+		== sizeof(base), "cannot read the header of %s", path);
+	close(file);
+	return base;
+}
+
+static size_t mine(const void * key, size_t length, size_t seed)
+{
+	return length ^ seed;
+}
+
+/* a dirty file gives up what it held at its last flush, into a new one */
+static void salvage(const char * path, const char * name)
+{
+	size_t index, live = 0, count;
+	char saved[80];
+	sprintf(saved, "%s.saved", path);
+	unlink(saved);
+	HashTable ht = HashTableOpenFile(saved, 0, 0, 0, NULL, NULL);
+	check(ht, "%s: no table to salvage into", name);
+	for (index = 0; index < KEYS; index++) live += !! reference[index];
+	count = HashTableSalvageFile(ht, path);
+	DestroyHashTable(&ht);
+
+	ht = HashTableOpenFile(saved, 0, 0, 0, NULL, NULL);
+	check(ht, "%s: the salvaged file does not open", name);
+	for (index = 0; index < KEYS; index++) {
+		HashTableItem item = HashTableGet(ht, utf8var(key[index]));
+		check(!! item == !! reference[index], "%s: %s was %s", name,
+			key[index], (item) ? "brought back" : "not salvaged");
+		if (item) check(! strcmp(HashTableItemData(ht, item), value[index]),
+			"%s: %s was salvaged wrong", name, key[index]);
+	}
+	/* the crashed put may have gone into a deleted item's reference */
+	HashTableItem crash = HashTableGet(ht, utf8var("crash"));
+	check(! crash || ! strcmp(HashTableItemData(ht, crash), "lost"),
+		"%s: the crashed put was salvaged wrong", name);
+	check(count == live + !! crash && HashTableItemsTotal(ht) == count,
+		"%s: salvaged %zu items, not %zu", name, count, live);
+	DestroyHashTable(&ht);
+	unlink(saved);
+}
+
+static void run(HashTableOption options, const char * path, const char * name)
+{
+	size_t index;
+	unlink(path);
+	HashTable ht = HashTableOpenFile(path, 0, options, 0, NULL, NULL);
+	check(ht, "%s: create failed", name);
+	size_t initial = fileSize(path);
+	errno = 0;
+	check(! HashTableOpenFile(path, 0, options, 0, NULL, NULL)
+		&& errno == HT_ERROR_UNSUPPORTED_FUNCTION,
+		"%s: a file in use opened twice", name);
+	HashTable spare = NewHashTable(0, 0, NULL, NULL);
+	errno = 0;
+	check(! HashTableSalvageFile(spare, path)
+		&& errno == HT_ERROR_UNSUPPORTED_FUNCTION,
+		"%s: a file in use was salvaged", name);
+	DestroyHashTable(&spare);
+	check(! HashTableSetHashFunction(ht, mine, 0),
+		"%s: a file took a hash function it cannot name", name);
+	for (index = 0; index < KEYS; index++) {
+		sprintf(key[index], "key %zu", index * 7919 % 100003);
+		sprintf(value[index], "value %zu %.*s", index, (int) (index % 40),
+			"........................................");
+		reference[index] =
+			HashTablePut(ht, utf8var(key[index]), utf8var(value[index]));
+		check(reference[index], "%s: put %s failed", name, key[index]);
+	}
+	for (index = 0; index < KEYS; index += 3) {
+		HashTableDeleteItem(ht, reference[index]);
+		reference[index] = 0;
+	}
+	verify(ht, name);
+	DestroyHashTable(&ht);
+	check(fileSize(path) > initial, "%s: the file never grew past %zu bytes",
+		name, initial);
+
+	ht = HashTableOpenFile(path, 0, options, 0, NULL, NULL);
+	check(ht, "%s: reopen failed", name);
+	verify(ht, name);
+	const char * where = HashTableItemKey(ht, reference[1]);
+	for (index = 0; index < KEYS; index += 3) {
+		sprintf(value[index], "%s, put after reopening", key[index]);
+		reference[index] =
+			HashTablePut(ht, utf8var(key[index]), utf8var(value[index]));
+		check(reference[index], "%s: put %s failed", name, key[index]);
+	}
+	DestroyHashTable(&ht);
+
+	/* with something else at its base, the file has to move */
+	size_t base = fileBase(path), page = (size_t) sysconf(_SC_PAGESIZE);
+	void * hold = mmap((void *) base, page, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	check(hold == (void *) base, "%s: cannot take the base %zx", name, base);
+	ht = HashTableOpenFile(path, 0, options, 0, NULL, NULL);
+	check(ht, "%s: relocated reopen failed", name);
+	check(HashTableItemKey(ht, reference[1]) != where,
+		"%s: the file did not move", name);
+	verify(ht, name);
+	for (index = 1; index < KEYS; index += 4) {
+		if (! reference[index]) continue;
+		check(HashTableDeleteItem(ht, reference[index]),
+			"%s: delete %s failed", name, key[index]);
+		reference[index] = 0;
+	}
+	DestroyHashTable(&ht);
+	munmap(hold, page);
+
+	ht = HashTableOpenFile(path, 0, options, 0, NULL, NULL);
+	check(ht, "%s: reopen after moving failed", name);
+	verify(ht, name);
+	DestroyHashTable(&ht);
+
+	/* a process that dies with the file open leaves it dirty */
+	fflush(stdout);
+	pid_t child = fork();
+	if (! child) {
+		ht = HashTableOpenFile(path, 0, options, 0, NULL, NULL);
+		_exit(! ht || ! HashTablePut(ht, utf8var("crash"), utf8var("lost")));
+	}
+	int status;
+	check(child > 0 && waitpid(child, &status, 0) == child
+		&& WIFEXITED(status) && ! WEXITSTATUS(status),
+		"%s: the crashing child did not get to write", name);
+	errno = 0;
+	check(! HashTableOpenFile(path, 0, options, 0, NULL, NULL)
+		&& errno == HT_ERROR_INVALID_TYPE_REQUEST,
+		"%s: a dirty file was opened", name);
+	salvage(path, name);
+	unlink(path);
+	printf("%s: ok\n", name);
+}
+
+int main ( int argc, char **argv )
+{
+	char directory[] = "/tmp/test-file-XXXXXX", path[64];
+	check(mkdtemp(directory), "no temporary directory");
+	sprintf(path, "%s/table", directory);
+	run(0, path, "chained");
+	run(HT_OPTION_OPEN_ADDRESSING | HT_OPTION_WYHASH, path, "open addressing");
+	run(HT_OPTION_REUSE_REFERENCES | HT_OPTION_CONCURRENT, path, "concurrent");
+	rmdir(directory);
+	return 0;
+}
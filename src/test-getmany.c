@@ -0,0 +1,83 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Looks up a batch of keys, a third of them missing, on every kind of table
+ * and holds the result to what HashTableGet says key by key: the same items,
+ * the same count, a hit on each item found and get events in key order.
+ */
+
+#define KEYS 3000
+#define BATCH 1000
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-getmany: " __VA_ARGS__), fputc('\n', stderr);        \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][24];
+static HashTableItem event[BATCH];
+static size_t events;
+
+static HashTableItem onGet
+(
+	void * ht, HashTableEvent type, HashTableItem item, void * private
+) {
+	if (events < BATCH) event[events] = item;
+	events++;
+	return item;
+}
+
+static void run(HashTable ht, const char * name)
+{
+	size_t index, found, expected = 0;
+	double batch[BATCH];
+	HashTableItem item[BATCH];
+	check(ht, "%s: no table", name);
+	for (index = 0; index < KEYS; index++) {
+		sprintf(key[index], "key %zu", index);
+		if (index / 3 % 3 == 2) continue;
+		check(HashTablePut(ht, utf8var(key[index]), utf8var(key[index])),
+			"%s: put %s failed", name, key[index]);
+	}
+	/* every third key of the batch is missing, spread over the table */
+	for (index = 0; index < BATCH; index++)
+		batch[index] = dblval(key[index * KEYS / BATCH]);
+
+	events = 0;
+	found = HashTableGetMany(ht, BATCH, NULL, batch, HTI_UTF8, item);
+	check(events == found, "%s: %zu get events for %zu items", name, events,
+		found);
+	events = BATCH; /* the single gets below are not recorded */
+	for (index = 0; index < BATCH; index++) {
+		const char * wanted = key[index * KEYS / BATCH];
+		HashTableItem single = HashTableGet(ht, utf8var(wanted));
+		check(item[index] == single, "%s: %s is %zu, not %zu", name,
+			wanted, item[index], single);
+		if (! single) continue;
+		check(event[expected] == single, "%s: the get event for %s came out "
+			"of order", name, wanted);
+		check(HashTableItemHits(ht, single) == 2, "%s: %s was hit %zu times",
+			name, wanted, HashTableItemHits(ht, single));
+		expected++;
+	}
+	check(found == expected, "%s: %zu found, not %zu", name, found, expected);
+	check(found && found < BATCH, "%s: found %zu of %d", name, found, BATCH);
+	DestroyHashTable(&ht);
+	printf("%s: ok, %zu of %d found\n", name, found, BATCH);
+}
+
+int main ( int argc, char **argv )
+{
+	run(NewHashTable(0, HT_EVENT_GET, onGet, NULL), "chained");
+	run(NewHashTableWithOptions(0, HT_OPTION_OPEN_ADDRESSING, HT_EVENT_GET,
+		onGet, NULL), "open addressing");
+	run(NewHashTableWithOptions(0, HT_OPTION_CONCURRENT, HT_EVENT_GET, onGet,
+		NULL), "concurrent");
+	run(NewShardedHashTable(4, 0, 0, HT_EVENT_GET, onGet, NULL), "sharded");
+	return 0;
+}
@@ -0,0 +1,106 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Counts hits in every mode: exact and per thread counts must come out
+ * exact, even with threads counting at once and the table growing under
+ * them; sampled counts must come out close; and no count at all must stay
+ * where it was.
+ */
+
+#define THREADS 4
+#define KEYS 64
+#define LOOKUPS 19200
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-hits: " __VA_ARGS__), fputc('\n', stderr);           \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][16];
+static HashTableItem reference[KEYS];
+static HashTable table;
+
+static void * lookup(void * private)
+{
+	size_t index;
+	for (index = 0; index < LOOKUPS; index++)
+		check(HashTableGet(table, utf8var(key[index % KEYS]))
+			== reference[index % KEYS], "lost %s", key[index % KEYS]);
+	return NULL;
+}
+
+/* every thread looks every key up LOOKUPS / KEYS times */
+static size_t lookups(size_t threads)
+{
+	pthread_t thread[THREADS];
+	size_t index;
+	for (index = 0; index < threads; index++)
+		pthread_create(thread + index, NULL, lookup, NULL);
+	for (index = 0; index < threads; index++)
+		pthread_join(thread[index], NULL);
+	return threads * (LOOKUPS / KEYS);
+}
+
+static void run(HashTableOption options, HashTableHitCounting counting,
+	size_t threads, const char * name)
+{
+	size_t index, hits[KEYS], expected;
+	char filler[32];
+	table = NewHashTableWithOptions(0, options, 0, NULL, NULL);
+	check(table && HashTableSetHitCounting(table, counting),
+		"%s: no table", name);
+	for (index = 0; index < KEYS; index++) {
+		sprintf(key[index], "key %zu", index);
+		reference[index] = HashTablePut(table, utf8var(key[index]),
+			utf8var(key[index]));
+		check(reference[index], "%s: put %s failed", name, key[index]);
+		hits[index] = HashTableItemHits(table, reference[index]);
+	}
+	expected = lookups(threads);
+	/* growth moves the item index, which folds any per thread counts */
+	for (index = 0; index < 20000; index++) {
+		sprintf(filler, "filler %zu", index);
+		check(HashTablePut(table, utf8var(filler), utf8var(filler)),
+			"%s: put %s failed", name, filler);
+	}
+	expected += lookups(threads);
+	for (index = 0; index < KEYS; index++) {
+		size_t counted = HashTableItemHits(table, reference[index])
+			- hits[index];
+		/* sampled hits come 64 at a time */
+		bool fine = (counting == HT_HITS_OFF) ? ! counted
+			: (counting == HT_HITS_SAMPLED) ?
+				counted % 64 == 0 && counted <= 3 * expected
+			: counted == expected;
+		check(fine, "%s: %s counted %zu of %zu hits", name, key[index],
+			counted, expected);
+		hits[index] = counted;
+	}
+	if (counting == HT_HITS_SAMPLED) { /* close over all the keys */
+		size_t total = 0;
+		for (index = 0; index < KEYS; index++) total += hits[index];
+		check(total > KEYS * expected / 2 && total < KEYS * expected * 2,
+			"%s: sampled %zu of %zu hits", name, total, KEYS * expected);
+	}
+	DestroyHashTable(&table);
+	printf("%s: ok\n", name);
+}
+
+int main ( int argc, char **argv )
+{
+	run(0, HT_HITS_EXACT, 1, "exact");
+	run(0, HT_HITS_OFF, 1, "off");
+	run(0, HT_HITS_SAMPLED, 1, "sampled");
+	run(0, HT_HITS_PER_THREAD, 1, "per thread");
+	run(HT_OPTION_CONCURRENT, HT_HITS_EXACT, THREADS, "concurrent exact");
+	run(HT_OPTION_CONCURRENT, HT_HITS_SAMPLED, THREADS, "concurrent sampled");
+	run(HT_OPTION_CONCURRENT, HT_HITS_PER_THREAD, THREADS,
+		"concurrent per thread");
+	return 0;
+}
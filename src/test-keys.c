@@ -0,0 +1,98 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Puts binary keys with embedded zeros by pointer and length, and by a hash
+ * taken beforehand, and finds each of them every way there is. A UTF-8 key
+ * is the same key as its bytes without the terminator.
+ */
+
+#define KEYS 3000
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-keys: " __VA_ARGS__), fputc('\n', stderr);           \
+    exit(1);                                                                   \
+}
+
+static unsigned char key[KEYS][12];
+static HashTableItem reference[KEYS];
+
+#define keyLength(index) (4 + (index) % 7)
+
+/* a zero at the front, so these would all be one key if measured by strlen */
+static size_t makeKey(size_t index)
+{
+	key[index][0] = 0, key[index][1] = 0x55;
+	key[index][2] = index >> 8, key[index][3] = index;
+	memset(key[index] + 4, 0xAA, index % 7);
+	return keyLength(index);
+}
+
+static void run(HashTable ht, const char * name)
+{
+	size_t index, length, hash;
+	check(ht, "%s: no table", name);
+	for (index = 0; index < KEYS; index++) {
+		length = makeKey(index);
+		if (index & 1) reference[index] =
+			HashTablePutBytes(ht, key[index], length, utf8var("by bytes"));
+		else {
+			hash = HashTableHashBytes(ht, key[index], length);
+			reference[index] = HashTablePutHashed(ht, hash, key[index], length,
+				utf8var("by hash"));
+		}
+		check(reference[index], "%s: put %zu failed", name, index);
+	}
+	check(HashTableItemsTotal(ht) == KEYS, "%s: %zu items, not %d", name,
+		HashTableItemsTotal(ht), KEYS);
+	for (index = 0; index < KEYS; index++) {
+		length = keyLength(index);
+		hash = HashTableHashBytes(ht, key[index], length);
+		check(HashTableHasBytes(ht, key[index], length) == reference[index]
+			&& HashTableGetBytes(ht, key[index], length) == reference[index]
+			&& HashTableHasHashed(ht, hash, key[index], length)
+				== reference[index]
+			&& HashTableGetHashed(ht, hash, key[index], length)
+				== reference[index], "%s: key %zu is lost", name, index);
+		HashTableData stored = HashTableItemKey(ht, reference[index]);
+		check(HashTableDataLength(stored) == length
+			&& ! memcmp(stored, key[index], length),
+			"%s: key %zu is stored as %zu other bytes", name, index,
+			HashTableDataLength(stored));
+		/* one byte short is another key */
+		check(! HashTableHasBytes(ht, key[index], length - 1),
+			"%s: key %zu is found by its prefix", name, index);
+	}
+	/* a replace through the hash keeps the item */
+	hash = HashTableHashBytes(ht, key[7], keyLength(7));
+	check(HashTablePutHashed(ht, hash, key[7], keyLength(7),
+		utf8var("replaced")) == reference[7]
+		&& ! strcmp(HashTableItemData(ht, reference[7]), "replaced"),
+		"%s: replace by hash failed", name);
+
+	/* utf8 keys and their bytes are one key */
+	HashTableItem text = HashTablePut(ht, utf8var("plain text"),
+		utf8var("text"));
+	check(text && HashTableGetBytes(ht, "plain text", 10) == text
+		&& HashTablePutBytes(ht, "plain text", 10, utf8var("bytes")) == text
+		&& HashTableGet(ht, utf8var("plain text")) == text
+		&& ! strcmp(HashTableItemData(ht, text), "bytes"),
+		"%s: a utf8 key and its bytes differ", name);
+	DestroyHashTable(&ht);
+	printf("%s: ok\n", name);
+}
+
+int main ( int argc, char **argv )
+{
+	run(NewHashTable(0, 0, NULL, NULL), "chained");
+	run(NewHashTableWithOptions(0, HT_OPTION_OPEN_ADDRESSING | HT_OPTION_WYHASH,
+		0, NULL, NULL), "open addressing");
+	run(NewHashTableWithOptions(0, HT_OPTION_CONCURRENT, 0, NULL, NULL),
+		"concurrent");
+	run(NewShardedHashTable(4, 0, 0, 0, NULL, NULL), "sharded");
+	return 0;
+}
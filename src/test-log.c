@@ -0,0 +1,156 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * Puts, deletes and clears through a write ahead log, then replays it into
+ * a fresh table; replays a log whose last entry was torn; and recovers from
+ * a checkpoint plus the log a process left behind when it died.
+ */
+
+#define KEYS 4000
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-log: " __VA_ARGS__), fputc('\n', stderr);            \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][24], value[KEYS][80];
+static bool live[KEYS];
+
+static void verify(HashTable ht, const char * name)
+{
+	size_t index, count = 0;
+	for (index = 0; index < KEYS; index++) {
+		HashTableItem item = HashTableGet(ht, utf8var(key[index]));
+		check(!! item == live[index], "%s: %s is %s", name, key[index],
+			(item) ? "present" : "missing");
+		if (! item) continue;
+		count++;
+		check(! strcmp(HashTableItemData(ht, item), value[index]),
+			"%s: %s does not read back", name, key[index]);
+	}
+	check(HashTableItemsTotal(ht) == count, "%s: %zu items, not %zu", name,
+		HashTableItemsTotal(ht), count);
+}
+
+static void put(HashTable ht, size_t index, const char * how)
+{
+	sprintf(value[index], "%s %s", key[index], how);
+	check(HashTablePut(ht, utf8var(key[index]), utf8var(value[index])),
+		"put %s failed", key[index]);
+	live[index] = true;
+}
+
+/* puts everything from first to last, deletes a third and replaces some */
+static void work(HashTable ht, size_t first, size_t last)
+{
+	size_t index;
+	for (index = first; index < last; index++) put(ht, index, "put");
+	for (index = first; index < last; index += 3) {
+		check(HashTableDeleteItem(ht, HashTableGet(ht, utf8var(key[index]))),
+			"delete %s failed", key[index]);
+		live[index] = false;
+	}
+	for (index = first + 1; index < last; index += 7)
+		if (live[index]) put(ht, index, "replaced with a longer value");
+}
+
+static HashTable replay(const char * log, const char * name)
+{
+	HashTable ht = NewHashTable(0, 0, NULL, NULL);
+	check(HashTableAttachLog(ht, log, 0, 0), "%s: replay failed", name);
+	verify(ht, name);
+	return ht;
+}
+
+static size_t fileSize(const char * path)
+{
+	struct stat status;
+	check(! stat(path, &status), "cannot stat %s", path);
+	return (size_t) status.st_size;
+}
+
+int main ( int argc, char **argv )
+{
+	char directory[] = "/tmp/test-log-XXXXXX", log[64], snapshot[64];
+	size_t index, size;
+	check(mkdtemp(directory), "no temporary directory");
+	sprintf(log, "%s/log", directory), sprintf(snapshot, "%s/snapshot",
+		directory);
+	for (index = 0; index < KEYS; index++)
+		sprintf(key[index], "key %zu", index);
+
+	/* every put, delete and clear comes back */
+	HashTable ht = NewHashTable(0, 0, NULL, NULL);
+	check(HashTableAttachLog(ht, log, 64, 5), "attach failed");
+	check(! HashTableAttachLog(ht, log, 64, 5), "attached twice");
+	work(ht, 0, KEYS / 2);
+	HashTableClear(ht);
+	memset(live, 0, sizeof(live));
+	work(ht, KEYS / 4, KEYS);
+	check(HashTableCommitLog(ht), "commit failed");
+	DestroyHashTable(&ht);
+	ht = replay(log, "round trip");
+	DestroyHashTable(&ht);
+	printf("round trip: ok\n");
+
+	/* a torn last entry is cut off, and what follows it is kept */
+	ht = replay(log, "torn tail");
+	put(ht, 0, "written last");
+	DestroyHashTable(&ht);
+	size = fileSize(log);
+	check(! truncate(log, size - 5), "cannot tear the log");
+	live[0] = false;
+	ht = replay(log, "torn tail");
+	check(fileSize(log) < size - 5, "the torn entry was not cut off");
+	put(ht, 1, "written after the tear");
+	DestroyHashTable(&ht);
+	ht = replay(log, "after the tear");
+	DestroyHashTable(&ht);
+	printf("torn tail: ok\n");
+
+	/* a checkpoint and the log after it are all a crash leaves */
+	unlink(log);
+	fflush(stdout);
+	pid_t child = fork();
+	if (! child) {
+		ht = NewHashTable(0, 0, NULL, NULL);
+		check(HashTableAttachLog(ht, log, 0, 0), "attach failed");
+		work(ht, 0, KEYS / 2);
+		errno = 0;
+		check(! HashTableCheckpoint(ht, NULL)
+			&& errno == HT_ERROR_UNSUPPORTED_FUNCTION,
+			"checkpointed without a snapshot");
+		check(HashTableCheckpoint(ht, snapshot), "checkpoint failed");
+		check(fileSize(log) < 64, "the checkpoint left %zu bytes of log",
+			fileSize(log));
+		work(ht, KEYS / 2, KEYS);
+		_exit(! HashTableCommitLog(ht));
+	}
+	int status;
+	check(child > 0 && waitpid(child, &status, 0) == child
+		&& WIFEXITED(status) && ! WEXITSTATUS(status),
+		"the crashing child did not get to commit");
+	/* the same work on a table of our own says what the child left */
+	memset(live, 0, sizeof(live));
+	ht = NewHashTable(0, 0, NULL, NULL);
+	work(ht, 0, KEYS / 2), work(ht, KEYS / 2, KEYS);
+	DestroyHashTable(&ht);
+	ht = HashTableMapSnapshot(snapshot, 0, NULL, NULL);
+	check(ht, "the checkpoint cannot be mapped");
+	check(HashTableAttachLog(ht, log, 0, 0), "recovery replay failed");
+	verify(ht, "checkpoint");
+	DestroyHashTable(&ht);
+	printf("checkpoint: ok\n");
+
+	unlink(log), unlink(snapshot), rmdir(directory);
+	return 0;
+}
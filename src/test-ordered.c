@@ -0,0 +1,161 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Puts keys in a scrambled order, deletes some, and walks the ordered index
+ * every way it can be walked, checking each answer against the keys that
+ * should be left, in order: first and last, next and previous, bounds,
+ * ranges and prefixes, forward and in reverse.
+ */
+
+#define KEYS 5000
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-ordered: " __VA_ARGS__), fputc('\n', stderr);        \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][16];
+static bool live[KEYS];
+
+typedef struct sWalk {
+	size_t next;
+	const char * name;
+} sWalk;
+
+/* the key number of an item */
+static size_t number(HashTable ht, HashTableItem item)
+{
+	const char * name = HashTableItemKey(ht, item);
+	check(name, "item %zu has no key", item);
+	return strtoul(name + 1, NULL, 10);
+}
+
+/* the first live key at or after index, going up or down; KEYS for none */
+static size_t seek(size_t index, bool reverse)
+{
+	while (index < KEYS && ! live[index])
+		index = (reverse) ? index - 1 : index + 1;
+	return index;
+}
+
+static bool visit
+(
+	void * ht, HashTableEnumerateDirection direction, HashTableItem item,
+	void * private
+) {
+	sWalk * walk = private;
+	size_t found = number(ht, item);
+	check(found == walk->next, "%s: walked to %s, not %s", walk->name,
+		key[found], (walk->next < KEYS) ? key[walk->next] : "the end");
+	walk->next = seek((direction == HT_ENUMERATE_REVERSE) ? found - 1
+		: found + 1, direction == HT_ENUMERATE_REVERSE);
+	return true;
+}
+
+static size_t liveBetween(size_t first, size_t last)
+{
+	size_t count = 0;
+	for (; first < last; first++) count += live[first];
+	return count;
+}
+
+static void run(HashTable ht, const char * name)
+{
+	size_t index, count;
+	HashTableItem item;
+	sWalk walk = { 0, name };
+	check(ht, "%s: no table", name);
+	for (index = 0; index < KEYS; index++) {
+		size_t scrambled = index * 7919 % KEYS;
+		check(HashTablePut(ht, utf8var(key[scrambled]), utf8var("x")),
+			"%s: put %s failed", name, key[scrambled]);
+		live[scrambled] = true;
+	}
+	for (index = 0; index < KEYS; index += 3) {
+		check(HashTableDeleteItem(ht, HashTableGet(ht, utf8var(key[index]))),
+			"%s: delete %s failed", name, key[index]);
+		live[index] = false;
+	}
+
+	/* next and previous from each end */
+	item = HashTableFirstItem(ht);
+	for (index = seek(0, false); index < KEYS; index = seek(index + 1, false)) {
+		check(item && number(ht, item) == index, "%s: next reached %zu, not "
+			"%s", name, (item) ? number(ht, item) : 0, key[index]);
+		item = HashTableNextItem(ht, item);
+	}
+	check(! item, "%s: next went past the last key", name);
+	item = HashTableLastItem(ht);
+	for (index = seek(KEYS - 1, true); index < KEYS;
+		index = seek(index - 1, true)) {
+		check(item && number(ht, item) == index, "%s: previous reached %zu, "
+			"not %s", name, (item) ? number(ht, item) : 0, key[index]);
+		item = HashTablePreviousItem(ht, item);
+	}
+	check(! item, "%s: previous went past the first key", name);
+
+	/* a deleted key is bounded by the live key after it */
+	check(number(ht, HashTableLowerBound(ht, utf8var(key[300])))
+		== seek(300, false) && number(ht, HashTableLowerBound(ht,
+		utf8var(key[301]))) == 301 && number(ht, HashTableUpperBound(ht,
+		utf8var(key[301]))) == seek(302, false),
+		"%s: bounds are off", name);
+	errno = 0;
+	check(! HashTableLowerBound(ht, utf8var("l")) && errno
+		== HT_ERROR_KEY_NOT_FOUND, "%s: a bound past the end", name);
+
+	/* ranges and prefixes, both ways */
+	walk.next = seek(1000, false);
+	count = HashTableEnumerateRange(ht, utf8var(key[1000]), utf8var(key[2000]),
+		HT_ENUMERATE_FORWARD, visit, &walk);
+	check(count == liveBetween(1000, 2000) && walk.next == seek(2000, false),
+		"%s: range of %zu", name, count);
+	walk.next = seek(1999, true);
+	count = HashTableEnumerateRange(ht, utf8var(key[1000]), utf8var(key[2000]),
+		HT_ENUMERATE_REVERSE, visit, &walk);
+	check(count == liveBetween(1000, 2000), "%s: reverse range of %zu", name,
+		count);
+	walk.next = seek(1200, false);
+	count = HashTableEnumeratePrefix(ht, utf8var("k012"), HT_ENUMERATE_FORWARD,
+		visit, &walk);
+	check(count == liveBetween(1200, 1300), "%s: prefix of %zu", name, count);
+	walk.next = seek(1299, true);
+	count = HashTableEnumeratePrefix(ht, utf8var("k012"), HT_ENUMERATE_REVERSE,
+		visit, &walk);
+	check(count == liveBetween(1200, 1300), "%s: reverse prefix of %zu", name,
+		count);
+
+	/* a clear empties the index */
+	HashTableClear(ht);
+	check(! HashTableFirstItem(ht), "%s: the index outlived a clear", name);
+	DestroyHashTable(&ht);
+	printf("%s: ok\n", name);
+}
+
+int main ( int argc, char **argv )
+{
+	size_t index;
+	for (index = 0; index < KEYS; index++)
+		sprintf(key[index], "k%05zu", index);
+	run(NewHashTableWithOptions(0, HT_OPTION_ORDERED_INDEX, 0, NULL, NULL),
+		"plain");
+	run(NewHashTableWithOptions(0, HT_OPTION_ORDERED_INDEX
+		| HT_OPTION_CONCURRENT, 0, NULL, NULL), "concurrent");
+	run(NewHashTableWithOptions(0, HT_OPTION_ORDERED_INDEX
+		| HT_OPTION_LOCK_FREE_READS, 0, NULL, NULL), "lock free");
+	run(NewShardedHashTable(4, 0, HT_OPTION_ORDERED_INDEX, 0, NULL, NULL),
+		"sharded");
+
+	HashTable ht = NewHashTable(0, 0, NULL, NULL);
+	errno = 0;
+	check(! HashTableFirstItem(ht) && errno == HT_ERROR_UNSUPPORTED_FUNCTION,
+		"a table without the index answered");
+	DestroyHashTable(&ht);
+	return 0;
+}
@@ -0,0 +1,98 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Sums the values of a table with holes in parallel, through per worker
+ * partials folded by reduce, and checks the sum and that every item was
+ * visited exactly once. A handler saying stop must stop the walk.
+ */
+
+#define KEYS 50000
+#define THREADS 4
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-parallel: " __VA_ARGS__), fputc('\n', stderr);       \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][16];
+static unsigned char visits[KEYS];
+
+typedef struct sPartial {
+	size_t sum;
+	size_t count;
+} sPartial;
+
+static bool add
+(
+	void * ht, HashTableEnumerateDirection direction, HashTableItem item,
+	void * private
+) {
+	sPartial * partial = private;
+	size_t value = strtoul(HashTableItemData(ht, item), NULL, 10);
+	__atomic_add_fetch(visits + value, 1, __ATOMIC_RELAXED);
+	partial->sum += value, partial->count++;
+	return true;
+}
+
+static bool stop
+(
+	void * ht, HashTableEnumerateDirection direction, HashTableItem item,
+	void * private
+) {
+	return false;
+}
+
+static void reduce(void * ht, void * partial, void * private)
+{
+	sPartial * total = private, * part = partial;
+	total->sum += part->sum, total->count += part->count;
+}
+
+static void run(HashTable ht, const char * name)
+{
+	size_t index, sum = 0, count = 0, visited;
+	char value[16];
+	sPartial part[THREADS], total = { 0, 0 };
+	void * partial[THREADS];
+	check(ht, "%s: no table", name);
+	for (index = 0; index < KEYS; index++) {
+		sprintf(value, "%zu", index);
+		check(HashTablePut(ht, utf8var(key[index]), utf8var(value)),
+			"%s: put %s failed", name, key[index]);
+	}
+	for (index = 0; index < KEYS; index++)
+		if (index % 5 == 0)
+			HashTableDeleteItem(ht, HashTableGet(ht, utf8var(key[index])));
+		else sum += index, count++;
+	memset(part, 0, sizeof(part)), memset(visits, 0, sizeof(visits));
+	for (index = 0; index < THREADS; index++) partial[index] = part + index;
+	visited = HashTableParallelEnumerate(ht, THREADS, add, partial, reduce,
+		&total);
+	check(visited == count && total.count == count && total.sum == sum,
+		"%s: visited %zu summing %zu, not %zu summing %zu", name, visited,
+		total.sum, count, sum);
+	for (index = 0; index < KEYS; index++)
+		check(visits[index] == (index % 5 != 0),
+			"%s: %s visited %d times", name, key[index], visits[index]);
+	check(HashTableParallelEnumerate(ht, 0, stop, NULL, NULL, NULL) < count,
+		"%s: the walk did not stop", name);
+	DestroyHashTable(&ht);
+	printf("%s: ok\n", name);
+}
+
+int main ( int argc, char **argv )
+{
+	size_t index;
+	for (index = 0; index < KEYS; index++)
+		sprintf(key[index], "key %zu", index);
+	run(NewHashTable(0, 0, NULL, NULL), "plain");
+	run(NewHashTableWithOptions(0, HT_OPTION_CONCURRENT, 0, NULL, NULL),
+		"concurrent");
+	run(NewShardedHashTable(4, 0, 0, 0, NULL, NULL), "sharded");
+	return 0;
+}
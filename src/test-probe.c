@@ -0,0 +1,67 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Fills open addressing tables under different growth policies, deleting
+ * and putting back as it goes, and checks after every put that the load
+ * stays within the table's maxLoadFactor, or 7/8 where that is higher or
+ * growth is switched off, and that every key is still found.
+ */
+
+#define KEYS 20000
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-probe: " __VA_ARGS__), fputc('\n', stderr);          \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][16];
+
+static void run(double maxLoadFactor, double growthFactor, const char * name)
+{
+	size_t index;
+	double most = (maxLoadFactor > 0 && maxLoadFactor < 0.875) ?
+		maxLoadFactor : 0.875, highest = 0;
+	HashTable ht = NewHashTableWithOptions(0, HT_OPTION_OPEN_ADDRESSING, 0,
+		NULL, NULL);
+	check(ht, "%s: no table", name);
+	check(HashTableSetGrowthPolicy(ht, maxLoadFactor, growthFactor),
+		"%s: the policy was refused", name);
+	for (index = 0; index < KEYS; index++) {
+		check(HashTablePut(ht, utf8var(key[index]), utf8var(key[index])),
+			"%s: put %s failed", name, key[index]);
+		/* tombstones count against the load until the next rebuild */
+		if (index % 4 == 3) {
+			check(HashTableDeleteItem(ht, HashTableGet(ht,
+				utf8var(key[index - 1]))), "%s: delete %s failed", name,
+				key[index - 1]);
+			check(HashTablePut(ht, utf8var(key[index - 1]),
+				utf8var(key[index - 1])), "%s: put %s again failed", name,
+				key[index - 1]);
+		}
+		double load = HashTableLoadFactor(ht);
+		check(load <= most, "%s: loaded to %.3f with %zu items", name, load,
+			index + 1);
+		if (load > highest) highest = load;
+	}
+	for (index = 0; index < KEYS; index++)
+		check(HashTableGet(ht, utf8var(key[index])), "%s: %s is missing",
+			name, key[index]);
+	DestroyHashTable(&ht);
+	printf("%s: ok, loaded to %.3f at most\n", name, highest);
+}
+
+int main ( int argc, char **argv )
+{
+	size_t index;
+	for (index = 0; index < KEYS; index++)
+		sprintf(key[index], "key %zu", index);
+	run(1.0, 2.0, "default");
+	run(0.5, 2.0, "half");
+	run(0.25, 1.5, "quarter");
+	run(0, 0, "no growth");
+	return 0;
+}
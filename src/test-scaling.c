@@ -0,0 +1,109 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Measures lookups per second for one, two and four readers on concurrent
+ * and lock free tables, alone and while a writer keeps growing the table.
+ * Every lookup is of a key that was put beforehand, so a lookup that misses
+ * while the writer moves buckets around fails the test. The figures only
+ * mean something with as many processors as readers.
+ */
+
+#define KEYS 20000
+#define GROWTH 60000
+#define LOOKUPS 200000
+#define READERS 4
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-scaling: " __VA_ARGS__), fputc('\n', stderr);        \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS + GROWTH][16];
+static HashTable table;
+static volatile int reading;
+
+static void * reader(void * seed)
+{
+	size_t index, state = (size_t) seed, which;
+	for (index = 0; index < LOOKUPS; index++) {
+		state = state * 2862933555777941757UL + 3037000493UL;
+		which = (state >> 33) % KEYS;
+		check(HashTableGet(table, utf8var(key[which])),
+			"%s was missed", key[which]);
+	}
+	return NULL;
+}
+
+static void * writer(void * unused)
+{
+	size_t index;
+	for (index = KEYS; index < KEYS + GROWTH
+		&& __atomic_load_n(&reading, __ATOMIC_ACQUIRE); index++)
+		check(HashTablePut(table, utf8var(key[index]), utf8var("grown")),
+			"put %s failed", key[index]);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec clock;
+	clock_gettime(CLOCK_MONOTONIC, &clock);
+	return clock.tv_sec + clock.tv_nsec / 1e9;
+}
+
+/* lookups per second, in millions */
+static double run(HashTableOption options, size_t readers, bool growing)
+{
+	pthread_t thread[READERS], grower;
+	size_t index;
+	table = NewHashTableWithOptions(0, options, 0, NULL, NULL);
+	check(table, "no table");
+	for (index = 0; index < KEYS; index++)
+		check(HashTablePut(table, utf8var(key[index]), utf8var(key[index])),
+			"put %s failed", key[index]);
+	reading = 1;
+	if (growing) check(! pthread_create(&grower, NULL, writer, NULL),
+		"no writer");
+	double start = now();
+	for (index = 0; index < readers; index++)
+		check(! pthread_create(thread + index, NULL, reader,
+			(void *) (index + 1)), "no reader");
+	for (index = 0; index < readers; index++)
+		pthread_join(thread[index], NULL);
+	double elapsed = now() - start;
+	__atomic_store_n(&reading, 0, __ATOMIC_RELEASE);
+	if (growing) pthread_join(grower, NULL);
+	DestroyHashTable(&table);
+	return readers * LOOKUPS / elapsed / 1e6;
+}
+
+static void measure(HashTableOption options, bool growing, const char * name)
+{
+	size_t readers;
+	double single = 0, rate;
+	for (readers = 1; readers <= READERS; readers <<= 1) {
+		rate = run(options, readers, growing);
+		if (readers == 1) single = rate;
+		printf("%s, readers %zu: %.2f M lookups/s, %.2fx one reader\n", name,
+			readers, rate, rate / single);
+	}
+}
+
+int main ( int argc, char **argv )
+{
+	size_t index;
+	for (index = 0; index < KEYS + GROWTH; index++)
+		sprintf(key[index], "key %zu", index);
+	measure(HT_OPTION_CONCURRENT, false, "concurrent");
+	measure(HT_OPTION_LOCK_FREE_READS, false, "lock free");
+	measure(HT_OPTION_CONCURRENT, true, "concurrent, growing");
+	measure(HT_OPTION_LOCK_FREE_READS, true, "lock free, growing");
+	return 0;
+}
@@ -0,0 +1,122 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Saves a table, maps it back at the base it chose and, while that mapping
+ * holds the base, once more somewhere else. Both must read as the table did
+ * and take puts, deletes and destruction like any other table.
+ */
+
+#define KEYS 5000
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-snapshot: " __VA_ARGS__), fputc('\n', stderr);       \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][24], value[KEYS][80], saved[KEYS][80];
+static HashTableItem reference[KEYS], savedReference[KEYS];
+
+static void verify(HashTable ht, const char * name)
+{
+	size_t index, live = 0;
+	for (index = 0; index < KEYS; index++) {
+		HashTableItem item = HashTableGet(ht, utf8var(key[index]));
+		check(item == reference[index], "%s: %s is at %zu, not %zu", name,
+			key[index], (size_t) item, (size_t) reference[index]);
+		if (! item) continue;
+		live++;
+		check(! strcmp(HashTableItemKey(ht, item), key[index])
+			&& ! strcmp(HashTableItemData(ht, item), value[index]),
+			"%s: %s does not read back", name, key[index]);
+	}
+	check(HashTableItemsTotal(ht) == live, "%s: %zu items, not %zu", name,
+		HashTableItemsTotal(ht), live);
+}
+
+/* the mapping is an ordinary table: it grows, shrinks and is let go */
+static void change(HashTable ht, const char * name)
+{
+	size_t index;
+	for (index = 0; index < KEYS; index++) {
+		if (! reference[index]) continue;
+		if (index % 4 == 1) {
+			check(HashTableDeleteItem(ht, reference[index]),
+				"%s: delete %s failed", name, key[index]);
+			reference[index] = 0;
+		} else if (index % 4 == 2) {
+			sprintf(value[index], "%s, replaced with something longer",
+				key[index]);
+			check(HashTablePut(ht, utf8var(key[index]), utf8var(value[index]))
+				== reference[index], "%s: replace %s failed", name, key[index]);
+		}
+	}
+	for (index = 0; index < KEYS; index++) {
+		if (reference[index] || index % 4 != 1) continue;
+		sprintf(value[index], "%s, put again", key[index]);
+		reference[index] =
+			HashTablePut(ht, utf8var(key[index]), utf8var(value[index]));
+		check(reference[index], "%s: put %s failed", name, key[index]);
+	}
+	verify(ht, name);
+}
+
+static void run(HashTableOption options, const char * path, const char * name)
+{
+	HashTable ht = NewHashTableWithOptions(0, options, 0, NULL, NULL);
+	size_t index;
+	for (index = 0; index < KEYS; index++) {
+		sprintf(key[index], "key %zu", index * 7919 % 100003);
+		sprintf(value[index], "value %zu %.*s", index, (int) (index % 40),
+			"........................................");
+		reference[index] =
+			HashTablePut(ht, utf8var(key[index]), utf8var(value[index]));
+		check(reference[index], "%s: put %s failed", name, key[index]);
+	}
+	for (index = 0; index < KEYS; index += 3) {
+		HashTableDeleteItem(ht, reference[index]);
+		reference[index] = 0;
+	}
+	check(HashTableSaveSnapshot(ht, path), "%s: save failed", name);
+	DestroyHashTable(&ht);
+
+	HashTable chosen = HashTableMapSnapshot(path, 0, NULL, NULL);
+	check(chosen, "%s: map failed", name);
+	verify(chosen, name);
+	/* the first mapping still holds the base, so this one has to move */
+	HashTable moved = HashTableMapSnapshot(path, 0, NULL, NULL);
+	check(moved, "%s: second map failed", name);
+	verify(moved, name);
+	check(HashTableItemKey(chosen, reference[1])
+		!= HashTableItemKey(moved, reference[1]),
+		"%s: both mappings share one address", name);
+	/* each mapping changes on its own */
+	memcpy(saved, value, sizeof(value));
+	memcpy(savedReference, reference, sizeof(reference));
+	change(moved, name);
+	DestroyHashTable(&moved);
+	unlink(path);
+	memcpy(value, saved, sizeof(value));
+	memcpy(reference, savedReference, sizeof(reference));
+	verify(chosen, name);
+	change(chosen, name);
+	DestroyHashTable(&chosen);
+	printf("%s: ok\n", name);
+}
+
+int main ( int argc, char **argv )
+{
+	char directory[] = "/tmp/test-snapshot-XXXXXX", path[64];
+	check(mkdtemp(directory), "no temporary directory");
+	sprintf(path, "%s/table", directory);
+	run(0, path, "chained");
+	run(HT_OPTION_OPEN_ADDRESSING, path, "open addressing");
+	run(HT_OPTION_ARENA | HT_OPTION_REUSE_REFERENCES, path, "arena");
+	rmdir(directory);
+	return 0;
+}
@@ -0,0 +1,92 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Sorts items on one digit of their values, which many items share, on one
+ * thread and on several, and checks that equal items keep the order they
+ * were put in, that deleted items end up last and that every reference
+ * still names its item.
+ */
+
+#define KEYS 40000
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-sort: " __VA_ARGS__), fputc('\n', stderr);           \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][16];
+static size_t calls;
+
+/* values are "group order"; only the group is compared */
+static HashTableItem byGroup
+(
+	void * ht, HashTableSortType type, HashTableSortDirection direction,
+	HashTableItem primary, HashTableItem secondary, void * private
+) {
+	const char * first = HashTableItemData(ht, primary),
+		* second = HashTableItemData(ht, secondary);
+	__atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+	if (direction & HT_SORT_DESCENDING)
+		return (second[0] > first[0]) ? secondary : primary;
+	return (second[0] < first[0]) ? secondary : primary;
+}
+
+static void run(HashTableSortType type, HashTableSortDirection direction,
+	const char * name)
+{
+	HashTable ht = NewHashTable(0, 0, NULL, NULL);
+	size_t index, live = 0, group, order;
+	char value[32], last[32] = "";
+	check(ht, "%s: no table", name);
+	for (index = 0; index < KEYS; index++) {
+		sprintf(value, "%zu %06zu", index * 7919 % 10, index);
+		check(HashTablePut(ht, utf8var(key[index]), utf8var(value)),
+			"%s: put %s failed", name, key[index]);
+	}
+	for (index = 0; index < KEYS; index += 5)
+		HashTableDeleteItem(ht, HashTableGet(ht, utf8var(key[index])));
+
+	calls = 0;
+	HashTableSortItems(ht, type, direction, byGroup, NULL);
+	for (index = 1; index <= HashTableItemsUsed(ht); index++) {
+		const char * data = HashTableItemData(ht, index);
+		if (! data) break;
+		live++;
+		check(sscanf(data, "%zu %zu", &group, &order) == 2,
+			"%s: item %zu reads %s", name, index, data);
+		const char * stored = HashTableItemKey(ht, index);
+		check(HashTableGet(ht, utf8var(stored)) == index,
+			"%s: %s is not found at its reference %zu", name, stored, index);
+		if (live > 1) {
+			int sign = (direction & HT_SORT_DESCENDING) ? -1 : 1;
+			int compared = (data[0] - last[0]) * sign;
+			check(compared > 0 || (! compared && strcmp(data, last) > 0),
+				"%s: %s sorted after %s", name, data, last);
+		}
+		strcpy(last, data);
+	}
+	for (; index <= HashTableItemsUsed(ht); index++)
+		check(! HashTableHasItem(ht, index),
+			"%s: item %zu follows a deleted one", name, index);
+	check(live == HashTableItemsTotal(ht), "%s: %zu of %zu items sorted",
+		name, live, HashTableItemsTotal(ht));
+	check(calls < (size_t) KEYS * 20, "%s: %zu comparisons", name, calls);
+	DestroyHashTable(&ht);
+	printf("%s: ok, %zu comparisons\n", name, calls);
+}
+
+int main ( int argc, char **argv )
+{
+	size_t index;
+	for (index = 0; index < KEYS; index++)
+		sprintf(key[index], "key %zu", index);
+	run(HT_SORT_ALPHA, HT_SORT_ASCENDING, "ascending");
+	run(HT_SORT_ALPHA, HT_SORT_DESCENDING, "descending");
+	run(HT_SORT_ALPHA | HT_SORT_PARALLEL, HT_SORT_ASCENDING, "parallel");
+	return 0;
+}
@@ -0,0 +1,183 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Writers put, read back and delete their own keys, and keep replacing a few
+ * shared ones, while readers look up everyone's, on the concurrent and the
+ * lock free read paths. A shared value is one byte repeated, short enough to
+ * live in its record for odd bytes and long enough to be kept apart for even
+ * ones, so a value that is not whole shows. Readers only read the items no
+ * writer deletes.
+ */
+
+#define WRITERS 4
+#define READERS 2
+#define KEYS 4000
+#define SHARED 8
+#define LONG 200
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-threads: " __VA_ARGS__), fputc('\n', stderr);        \
+    exit(1);                                                                   \
+}
+
+static char key[WRITERS][KEYS][16], shared[SHARED][16];
+static HashTable table;
+static volatile int writing;
+static bool lockFree;
+
+#define readBegin() ((lockFree) ? HashTableReadBegin(table) : 0)
+#define readEnd(ticket) if (lockFree) HashTableReadEnd(table, ticket)
+
+static size_t sharedLength(char fill)
+{
+	return (fill & 1) ? 6 : LONG;
+}
+
+/*
+ * A shared value must be all one byte, as long as that byte says. Lock free
+ * readers read it in place, which holds until their read section ends;
+ * everyone else copies it.
+ */
+static void checkShared(HashTable ht, HashTableItem item, const char * name)
+{
+	char copy[LONG + 1];
+	const char * value = copy;
+	size_t index, length;
+	if (lockFree) value = HashTableItemData(ht, item),
+		length = HashTableDataLength(value);
+	else length = HashTableItemCopyData(ht, item, copy, LONG + 1);
+	check(value && length && length <= LONG + 1, "%s: read %zu bytes", name,
+		length);
+	/* utf8 lengths count the terminator */
+	check(length == sharedLength(value[0]) + 1 && ! value[length - 1],
+		"%s: %zu bytes of %c", name, length, value[0]);
+	for (index = 1; index < length - 1; index++)
+		check(value[index] == value[0], "%s: %c and %c in one value", name,
+			value[0], value[index]);
+}
+
+/* get handlers hold the key's stripe and may still read their own item */
+static HashTableItem onGet
+(
+	void * ht, HashTableEvent event, HashTableItem item, void * private
+) {
+	if (! strncmp(HashTableItemKey(ht, item), "shared", 6))
+		checkShared(ht, item, HashTableItemKey(ht, item));
+	return item;
+}
+
+static void replaceShared(size_t self, size_t round)
+{
+	char value[LONG + 1], fill = 'A' + (self * 7 + round) % 26;
+	size_t length = sharedLength(fill);
+	memset(value, fill, length), value[length] = 0;
+	check(HashTablePut(table, utf8var(shared[round % SHARED]), utf8var(value)),
+		"put %s failed", shared[round % SHARED]);
+}
+
+static void * writer(void * private)
+{
+	size_t index, self = (size_t) private;
+	char value[32];
+	HashTableItem item;
+	for (index = 0; index < KEYS; index++) {
+		sprintf(value, "%s=%zu", key[self][index], index);
+		check(HashTablePut(table, utf8var(key[self][index]), utf8var(value)),
+			"put %s failed", key[self][index]);
+		replaceShared(self, index);
+	}
+	for (index = 0; index < KEYS; index++) {
+		sprintf(value, "%s=%zu", key[self][index], index);
+		item = HashTableGet(table, utf8var(key[self][index]));
+		check(item && ! strcmp(HashTableItemData(table, item), value),
+			"get %s lost the value put", key[self][index]);
+		replaceShared(self, index);
+		if (index & 1) continue;
+		check(HashTableDeleteItem(table, item),
+			"delete %s failed", key[self][index]);
+	}
+	for (index = 0; index < KEYS; index++) {
+		item = HashTableGet(table, utf8var(key[self][index]));
+		check(!! item == (index & 1), "%s is %s after the deletes",
+			key[self][index], (item) ? "present" : "missing");
+	}
+	__atomic_sub_fetch(&writing, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* whatever a reader finds must be whole: the key asked for, and its value */
+static void * reader(void * private)
+{
+	size_t found = 0, self, index, length;
+	char value[32];
+	HashTableItem item;
+	do {
+		for (self = 0; self < WRITERS; self++)
+			for (index = 1; index < KEYS; index += 6) {
+				size_t ticket = readBegin();
+				item = HashTableGet(table, utf8var(key[self][index]));
+				if (! item) { readEnd(ticket); continue; }
+				check(! strcmp(HashTableItemKey(table, item), key[self][index]),
+					"reader asked for %s and found %s", key[self][index],
+					(char *) HashTableItemKey(table, item));
+				length = HashTableItemCopyData(table, item, value, 31);
+				value[(length < 31) ? length : 31] = 0;
+				length = strlen(key[self][index]);
+				check(! strncmp(value, key[self][index], length)
+					&& value[length] == '=',
+					"reader found %s for %s", value, key[self][index]);
+				found++;
+				readEnd(ticket);
+			}
+		for (index = 0; index < SHARED; index++) {
+			size_t ticket = readBegin();
+			item = HashTableGet(table, utf8var(shared[index]));
+			if (item) checkShared(table, item, shared[index]), found++;
+			readEnd(ticket);
+		}
+	} while (__atomic_load_n(&writing, __ATOMIC_ACQUIRE));
+	*(size_t *) private = found;
+	return NULL;
+}
+
+static void run(HashTableOption options, const char * name)
+{
+	pthread_t thread[WRITERS + READERS];
+	size_t index, found[READERS];
+	table = NewHashTableWithOptions(0, options, HT_EVENT_GET, onGet, NULL);
+	check(table, "%s: no table", name);
+	writing = WRITERS, lockFree = options & HT_OPTION_LOCK_FREE_READS;
+	for (index = 0; index < READERS; index++)
+		pthread_create(thread + WRITERS + index, NULL, reader, found + index);
+	for (index = 0; index < WRITERS; index++)
+		pthread_create(thread + index, NULL, writer, (void *) index);
+	for (index = 0; index < WRITERS + READERS; index++)
+		pthread_join(thread[index], NULL);
+	check(HashTableItemsTotal(table) == WRITERS * KEYS / 2 + SHARED,
+		"%s: %zu items left, not %d", name, HashTableItemsTotal(table),
+		WRITERS * KEYS / 2 + SHARED);
+	DestroyHashTable(&table);
+	printf("%s: ok, readers found %zu and %zu\n", name, found[0], found[1]);
+}
+
+int main ( int argc, char **argv )
+{
+	size_t self, index;
+	for (self = 0; self < WRITERS; self++)
+		for (index = 0; index < KEYS; index++)
+			sprintf(key[self][index], "w%zu-%zu", self, index);
+	for (index = 0; index < SHARED; index++)
+		sprintf(shared[index], "shared %zu", index);
+	run(HT_OPTION_CONCURRENT, "concurrent");
+	run(HT_OPTION_CONCURRENT | HT_OPTION_OPEN_ADDRESSING, "concurrent open");
+	run(HT_OPTION_CONCURRENT | HT_OPTION_REUSE_REFERENCES | HT_OPTION_ARENA,
+		"concurrent reuse");
+	run(HT_OPTION_LOCK_FREE_READS, "lock free");
+	return 0;
+}
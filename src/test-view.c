@@ -0,0 +1,149 @@
+#include "HashTable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Takes a snapshot of a table with holes, then puts new keys into those
+ * holes, replaces values short and long, deletes items and changes their
+ * flags on the live table. Lookups, item reads, flags and enumeration on
+ * the snapshot must still give the table as it was, the live table must
+ * give it as it is, and the table cannot be destroyed under its snapshot.
+ * Leaks are left to the sanitizer.
+ */
+
+#define KEYS 3000
+
+#define check(condition, ...)                                                  \
+if (! (condition)) {                                                           \
+    fprintf(stderr, "test-view: " __VA_ARGS__), fputc('\n', stderr);           \
+    exit(1);                                                                   \
+}
+
+static char key[KEYS][16], old[KEYS][16];
+static HashTableItem before[KEYS], after[KEYS];
+static bool writable[KEYS];
+
+typedef struct sSeen {
+	const char * name;
+	size_t count;
+} sSeen;
+
+/* the snapshot only ever enumerates old values */
+static bool visit
+(
+	void * ht, HashTableEnumerateDirection direction, HashTableItem item,
+	void * private
+) {
+	sSeen * seen = private;
+	const char * data = HashTableItemData(ht, item);
+	size_t index;
+	check(data && sscanf(data, "old %zu", &index) == 1 && index < KEYS
+		&& before[index] == item, "%s: enumerated %s at %zu", seen->name,
+		(data) ? data : "nothing", item);
+	seen->count++;
+	return true;
+}
+
+static void run(HashTable ht, bool reuse, const char * name)
+{
+	size_t index, live = 0, used;
+	char value[300];
+	sSeen seen = { name, 0 };
+	check(ht, "%s: no table", name);
+	for (index = 0; index < KEYS; index++) {
+		before[index] = HashTablePut(ht, utf8var(key[index]),
+			utf8var(old[index]));
+		check(before[index], "%s: put %s failed", name, key[index]);
+	}
+	for (index = 0; index < KEYS; index += 10) {
+		HashTableDeleteItem(ht, before[index]);
+		before[index] = 0;
+	}
+	for (index = 0; index < KEYS; index++) if (before[index]) {
+		writable[index] = HashTableItemGetWritable(ht, before[index]);
+		live++;
+	}
+
+	HashTable view = HashTableSnapshot(ht);
+	check(view, "%s: no snapshot", name);
+
+	/* the deleted keys come back, into the holes where references reuse */
+	used = HashTableItemsUsed(ht);
+	for (index = 0; index < KEYS; index += 10)
+		check(after[index] = HashTablePut(ht, utf8var(key[index]),
+			utf8var("new")), "%s: put %s again failed", name, key[index]);
+	check(! reuse || HashTableItemsUsed(ht) == used, "%s: the holes were "
+		"not reused", name);
+	for (index = 1; index < KEYS; index += 10) {
+		memset(value, 'a' + index % 26, sizeof(value) - 1);
+		value[(index & 2) ? 4 : sizeof(value) - 1] = 0;
+		check(HashTablePut(ht, utf8var(key[index]), utf8var(value)),
+			"%s: replace %s failed", name, key[index]);
+	}
+	for (index = 2; index < KEYS; index += 10)
+		check(HashTableDeleteItem(ht, before[index]), "%s: delete %s failed",
+			name, key[index]);
+	for (index = 3; index < KEYS; index += 10)
+		check(HashTableItemSetWritable(ht, before[index], writable[index]),
+			"%s: flagging %s failed", name, key[index]);
+
+	errno = 0;
+	DestroyHashTable(&ht);
+	check(ht && errno == HT_ERROR_UNSUPPORTED_FUNCTION,
+		"%s: the table was destroyed under its snapshot", name);
+
+	for (index = 0; index < KEYS; index++) {
+		HashTableItem item = HashTableGet(view, utf8var(key[index]));
+		check(item == before[index], "%s: the snapshot finds %s at %zu, not "
+			"%zu", name, key[index], item, before[index]);
+		if (after[index]) check(! HashTableHasItem(view, after[index]),
+			"%s: the snapshot sees %s put again", name, key[index]);
+		if (! item) continue;
+		check(! strcmp(HashTableItemData(view, item), old[index]),
+			"%s: the snapshot reads %s for %s", name,
+			(char *) HashTableItemData(view, item), key[index]);
+		check(HashTableItemGetWritable(view, item) == writable[index],
+			"%s: the snapshot sees %s flagged anew", name, key[index]);
+	}
+	HashTableEnumerate(view, HT_ENUMERATE_FORWARD, visit, &seen);
+	check(seen.count == live, "%s: the snapshot enumerated %zu of %zu items",
+		name, seen.count, live);
+
+	/* and the live table moved on */
+	for (index = 0; index < KEYS; index++) {
+		HashTableItem item = HashTableGet(ht, utf8var(key[index]));
+		check(!! item == (index % 10 != 2), "%s: %s is %s", name, key[index],
+			(item) ? "present" : "missing");
+		if (index % 10 == 0) check(! strcmp(HashTableItemData(ht, item),
+			"new"), "%s: %s was not put again", name, key[index]);
+		if (index % 10 == 1) check(strlen(HashTableItemData(ht, item))
+			== ((index & 2) ? 4 : sizeof(value) - 1),
+			"%s: %s was not replaced", name, key[index]);
+		if (index % 10 == 3) check(HashTableItemGetWritable(ht, item)
+			!= writable[index], "%s: %s was not flagged", name, key[index]);
+	}
+
+	DestroyHashTable(&view);
+	DestroyHashTable(&ht);
+	check(! ht, "%s: the table outlived its snapshot", name);
+	printf("%s: ok\n", name);
+}
+
+int main ( int argc, char **argv )
+{
+	size_t index;
+	for (index = 0; index < KEYS; index++)
+		sprintf(key[index], "key %zu", index),
+		sprintf(old[index], "old %zu", index);
+	run(NewHashTable(0, 0, NULL, NULL), false, "plain");
+	run(NewHashTableWithOptions(0, HT_OPTION_REUSE_REFERENCES
+		| HT_OPTION_ARENA, 0, NULL, NULL), true, "reuse");
+	run(NewHashTableWithOptions(0, HT_OPTION_CONCURRENT
+		| HT_OPTION_REUSE_REFERENCES, 0, NULL, NULL), true, "concurrent");
+	run(NewHashTableWithOptions(0, HT_OPTION_LOCK_FREE_READS, 0, NULL, NULL),
+		false, "lock free");
+	return 0;
+}